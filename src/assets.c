@@ -0,0 +1,49 @@
+#include "assets.h"
+
+#include <string.h>
+
+// Generated manifest (asset_bundle.c in the build directory).
+// The path table is a perfect hash: each path maps to its own slot, so a
+// lookup is one hash and one compare.
+extern const asset_entry_t asset_entries[];
+extern const uint8_t asset_slots[];     // entry index + 1, 0 for an empty slot
+extern const uint32_t asset_slot_mask;  // slot count - 1, slot count is a power of 2
+extern const uint32_t asset_hash_seed;
+extern const uint8_t asset_blob[];
+
+#if WITH_EMBEDDED_ASSETS
+// FNV-1a, must match tools/embed_assets.py
+static uint32_t asset_hash(uint32_t seed, const char *path, size_t path_len) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (size_t i = 0; i < path_len; ++i) {
+    hash ^= (uint8_t)path[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+#endif
+
+const asset_entry_t *assets_find(const char *path, size_t path_len) {
+#if WITH_EMBEDDED_ASSETS
+  uint8_t slot = asset_slots[asset_hash(asset_hash_seed, path, path_len) & asset_slot_mask];
+  if (slot == 0) {
+    return NULL;
+  }
+
+  const asset_entry_t *entry = &asset_entries[slot - 1];
+  if (strncmp(entry->path, path, path_len) != 0 || entry->path[path_len] != '\0') {
+    return NULL;
+  }
+  return entry;
+#else
+  return NULL;
+#endif
+}
+
+const uint8_t *assets_data(uint32_t offset) {
+#if WITH_EMBEDDED_ASSETS
+  return asset_blob + offset;
+#else
+  return NULL;
+#endif
+}
@@ -0,0 +1,35 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Serve the web UI from a copy of data/ compiled into the firmware instead
+// of the filesystem. The bundle is generated at build time by
+// tools/embed_assets.py; when disabled it is dropped by the linker.
+// UI updates then ship with the firmware, /upload of static files is still
+// possible but only used for paths missing from the bundle.
+#ifndef WITH_EMBEDDED_ASSETS
+#define WITH_EMBEDDED_ASSETS 0
+#endif
+
+// Manifest entry, offsets point into asset_blob which lives in flash and
+// is read through the cache, so responses are sent without copies
+typedef struct {
+  const char *path;
+  const char *mime;
+  const char *etag;     // strong ETag of the identity variant, quoted
+  const char *gz_etag;  // strong ETag of the gzip variant, quoted
+  uint32_t offset;      // identity variant
+  uint32_t len;
+  uint32_t gz_offset;   // gzip variant, gz_len is 0 when not worth it
+  uint32_t gz_len;
+} asset_entry_t;
+
+// Returns the entry for an exact path (no query string), or NULL
+const asset_entry_t *assets_find(const char *path, size_t path_len);
+
+// Pointer to a variant of an asset
+const uint8_t *assets_data(uint32_t offset);
+
+#endif
@@ -0,0 +1,53 @@
+#include "boot.h"
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+// Local variables
+
+static const char *NAMES[BOOT_STAGE_COUNT] = {
+  [BOOT_APP_MAIN] = "app_main",
+  [BOOT_STORAGE] = "storage",
+  [BOOT_SETTINGS] = "settings",
+  [BOOT_DRIVABLE] = "drivable",
+  [BOOT_NETIF] = "netif",
+  [BOOT_WIFI] = "wifi",
+  [BOOT_DNS] = "dns",
+  [BOOT_FILESYSTEM] = "filesystem",
+  [BOOT_SERVER] = "server",
+  [BOOT_SPOOL] = "spool",
+  [BOOT_TELEMETRY] = "telemetry",
+};
+
+// An event group holds 24 bits
+_Static_assert(BOOT_STAGE_COUNT <= 24, "too many boot stages");
+
+static int64_t stage_us[BOOT_STAGE_COUNT];
+static EventGroupHandle_t stages = NULL;
+
+// Implementations
+
+void setup_boot_trace(void) {
+  stages = xEventGroupCreate();
+  boot_mark(BOOT_APP_MAIN);
+}
+
+void boot_mark(boot_stage_t stage) {
+  stage_us[stage] = esp_timer_get_time();
+  xEventGroupSetBits(stages, 1u << stage);
+}
+
+bool boot_wait(boot_stage_t stage, uint32_t timeout_ms) {
+  EventBits_t bits = xEventGroupWaitBits(stages, 1u << stage, pdFALSE, pdTRUE,
+                                         timeout_ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms));
+  return (bits & (1u << stage)) != 0;
+}
+
+const char *boot_stage_name(boot_stage_t stage) {
+  return NAMES[stage];
+}
+
+int64_t boot_stage_us(boot_stage_t stage) {
+  return stage_us[stage];
+}
@@ -0,0 +1,40 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Boot trace. The car is drivable from cached settings first, everything
+// else starts in parallel tasks afterwards (see main.c). Every stage records
+// when it finished, in us since esp_timer started: the bootloader and the
+// image load before it are not included.
+//
+// Stages are also how those tasks wait for each other, boot_wait().
+
+typedef enum {
+  BOOT_APP_MAIN,   // app_main entered
+  BOOT_STORAGE,    // NVS open
+  BOOT_SETTINGS,   // settings in RAM
+  BOOT_DRIVABLE,   // pedal and motor control running
+  BOOT_NETIF,      // TCP/IP stack and event loop
+  BOOT_WIFI,       // soft AP started, STA connecting
+  BOOT_DNS,        // captive portal DNS
+  BOOT_FILESYSTEM, // web files mounted
+  BOOT_SERVER,     // HTTP and WebSocket server
+  BOOT_SPOOL,      // telemetry spool loaded from flash
+  BOOT_TELEMETRY,  // telemetry publishing
+  BOOT_STAGE_COUNT
+} boot_stage_t;
+
+// Call first thing in app_main
+void setup_boot_trace(void);
+
+void boot_mark(boot_stage_t stage);
+// Block until stage is marked, false on timeout
+bool boot_wait(boot_stage_t stage, uint32_t timeout_ms);
+
+const char *boot_stage_name(boot_stage_t stage);
+// When stage was marked, 0 while it isn't
+int64_t boot_stage_us(boot_stage_t stage);
+
+#endif
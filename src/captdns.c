@@ -7,241 +7,157 @@
     CONDITIONS OF ANY KIND, either express or implied.
 */
 
+#define LOG_LOCAL_LEVEL LOG_CEILING_CAPTDNS
+#include "logbuf.h"
+
+#include "captdns.h"
+
 #include <sys/param.h>
 
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_event.h"
 #include "esp_netif.h"
+#include "esp_wifi.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include "lwip/netdb.h"
 
-#define DNS_PORT (53)
-#define DNS_MAX_LEN (256)
+#include "dns_reply.h"
 
-#define OPCODE_MASK (0x7800)
-#define QR_FLAG (1 << 7)
-#define QD_TYPE_A (0x0001)
-#define ANS_TTL_SEC (300)
+#define DNS_PORT (53)
+// Before binding again after a socket error
+#define DNS_RETRY_MS (1000)
 
 static const char *TAG = "dns_captive_portal";
 
-// DNS Header Packet
-typedef struct __attribute__((__packed__))
-{
-    uint16_t id;
-    uint16_t flags;
-    uint16_t qd_count;
-    uint16_t an_count;
-    uint16_t ns_count;
-    uint16_t ar_count;
-} dns_header_t;
-
-// DNS Question Packet
-typedef struct {
-    uint16_t type;
-    uint16_t class;
-} dns_question_t;
-
-// DNS Answer Packet
-typedef struct __attribute__((__packed__))
-{
-    uint16_t ptr_offset;
-    uint16_t type;
-    uint16_t class;
-    uint32_t ttl;
-    uint16_t addr_len;
-    uint32_t ip_addr;
-} dns_answer_t;
+// Soft AP address, network byte order, refreshed on IP events so the
+// answers don't look it up
+static volatile uint32_t s_ap_ip = 0;
 
-/*
-    Parse the name from the packet from the DNS name format to a regular .-seperated name
-    returns the pointer to the next part of the packet
-*/
-static char *parse_dns_name(char *raw_name, char *parsed_name, size_t parsed_name_max_len)
-{
-
-    char *label = raw_name;
-    char *name_itr = parsed_name;
-    int name_len = 0;
+static captdns_stats_t s_stats;
 
-    do {
-        int sub_name_len = *label;
-        // (len + 1) since we are adding  a '.'
-        name_len += (sub_name_len + 1);
-        if (name_len > parsed_name_max_len) {
-            return NULL;
-        }
-
-        // Copy the sub name that follows the the label
-        memcpy(name_itr, label + 1, sub_name_len);
-        name_itr[sub_name_len] = '.';
-        name_itr += (sub_name_len + 1);
-        label += sub_name_len + 1;
-    } while (*label != 0);
-
-    // Terminate the final string, replacing the last '.'
-    parsed_name[name_len - 1] = '\0';
-    // Return pointer to first char after the name
-    return label + 1;
-}
-
-// Parses the DNS request and prepares a DNS response with the IP of the softAP
-static int parse_dns_request(char *req, size_t req_len, char *dns_reply, size_t dns_reply_max_len)
+static void refresh_ap_ip(void)
 {
-    if (req_len > dns_reply_max_len) {
-        return -1;
+    esp_netif_ip_info_t ip_info;
+    esp_netif_t *ap = esp_netif_get_handle_from_ifkey("WIFI_AP_DEF");
+    if (ap && esp_netif_get_ip_info(ap, &ip_info) == ESP_OK) {
+        s_ap_ip = ip_info.ip.addr;
     }
+}
 
-    // Prepare the reply
-    memset(dns_reply, 0, dns_reply_max_len);
-    memcpy(dns_reply, req, req_len);
-
-    // Endianess of NW packet different from chip
-    dns_header_t *header = (dns_header_t *)dns_reply;
-    ESP_LOGD(TAG, "DNS query with header id: 0x%X, flags: 0x%X, qd_count: %d",
-             ntohs(header->id), ntohs(header->flags), ntohs(header->qd_count));
+static void ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    refresh_ap_ip();
+}
 
-    // Not a standard query
-    if ((header->flags & OPCODE_MASK) != 0) {
-        return 0;
+static void count(dns_reply_result_t result)
+{
+    switch (result) {
+    case DNS_REPLY_ANSWER: s_stats.answers++; break;
+    case DNS_REPLY_NODATA: s_stats.nodata++; break;
+    case DNS_REPLY_NXDOMAIN: s_stats.nxdomain++; break;
+    case DNS_REPLY_ERROR: s_stats.errors++; break;
+    default: s_stats.dropped++; break;
     }
+}
 
-    // Set question response flag
-    header->flags |= QR_FLAG;
-
-    uint16_t qd_count = ntohs(header->qd_count);
-    header->an_count = htons(qd_count);
-
-    int reply_len = qd_count * sizeof(dns_answer_t) + req_len;
-    if (reply_len > dns_reply_max_len) {
+static int open_socket(void)
+{
+    struct sockaddr_in dest_addr = {
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_family = AF_INET,
+        .sin_port = htons(DNS_PORT),
+    };
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
         return -1;
     }
-
-    // Pointer to current answer and question
-    char *cur_ans_ptr = dns_reply + req_len;
-    char *cur_qd_ptr = dns_reply + sizeof(dns_header_t);
-    char name[128];
-
-    // Respond to all questions with the ESP32's IP address
-    for (int i = 0; i < qd_count; i++) {
-        char *name_end_ptr = parse_dns_name(cur_qd_ptr, name, sizeof(name));
-        if (name_end_ptr == NULL) {
-            ESP_LOGE(TAG, "Failed to parse DNS question: %s", cur_qd_ptr);
-            return -1;
-        }
-
-        dns_question_t *question = (dns_question_t *)(name_end_ptr);
-        uint16_t qd_type = ntohs(question->type);
-        uint16_t qd_class = ntohs(question->class);
-
-        ESP_LOGD(TAG, "Received type: %d | Class: %d | Question for: %s", qd_type, qd_class, name);
-
-        if (qd_type == QD_TYPE_A) {
-            dns_answer_t *answer = (dns_answer_t *)cur_ans_ptr;
-
-            answer->ptr_offset = htons(0xC000 | (cur_qd_ptr - dns_reply));
-            answer->type = htons(qd_type);
-            answer->class = htons(qd_class);
-            answer->ttl = htonl(ANS_TTL_SEC);
-
-            esp_netif_ip_info_t ip_info;
-            esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey("WIFI_AP_DEF"), &ip_info);
-            ESP_LOGD(TAG, "Answer with PTR offset: 0x%X and IP 0x%X", ntohs(answer->ptr_offset), ip_info.ip.addr);
-
-            answer->addr_len = htons(sizeof(ip_info.ip.addr));
-            answer->ip_addr = ip_info.ip.addr;
-        }
+    if (bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        close(sock);
+        return -1;
     }
-    return reply_len;
+    ESP_LOGI(TAG, "Socket bound, port %d", DNS_PORT);
+    return sock;
 }
 
 /*
-    Sets up a socket and listen for DNS queries,
-    replies to all type A queries with the IP of the softAP
+    Replies to every query with the IP of the softAP. Blocks for the first
+    packet, then answers everything already queued before blocking again:
+    phones joining send a burst of A, AAAA and HTTPS lookups at once.
 */
-void dns_server_task(void *pvParameters)
+static void dns_server_task(void *pvParameters)
 {
-    char rx_buffer[128];
-    char addr_str[128];
-    int addr_family;
-    int ip_protocol;
+    // Replies are built in place, in the query buffer
+    static uint8_t packet[DNS_REPLY_MAX_LEN];
+    dns_reply_template_t template;
+    dns_reply_template_init(&template, s_ap_ip);
 
     while (1) {
-
-        struct sockaddr_in dest_addr;
-        dest_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        dest_addr.sin_family = AF_INET;
-        dest_addr.sin_port = htons(DNS_PORT);
-        addr_family = AF_INET;
-        ip_protocol = IPPROTO_IP;
-        inet_ntoa_r(dest_addr.sin_addr, addr_str, sizeof(addr_str) - 1);
-
-        int sock = socket(addr_family, SOCK_DGRAM, ip_protocol);
+        int sock = open_socket();
         if (sock < 0) {
-            ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
-            break;
-        }
-        ESP_LOGI(TAG, "Socket created");
-
-        int err = bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-        if (err < 0) {
-            ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+            vTaskDelay(DNS_RETRY_MS / portTICK_PERIOD_MS);
+            continue;
         }
-        ESP_LOGI(TAG, "Socket bound, port %d", DNS_PORT);
 
+        int flags = 0;
         while (1) {
-            ESP_LOGI(TAG, "Waiting for data");
-            struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
+            struct sockaddr_in source_addr;
             socklen_t socklen = sizeof(source_addr);
-            int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr *)&source_addr, &socklen);
-
-            // Error occurred during receiving
+            int len = recvfrom(sock, packet, sizeof(packet), flags, (struct sockaddr *)&source_addr, &socklen);
             if (len < 0) {
+                if (flags && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+                    // Batch done
+                    flags = 0;
+                    continue;
+                }
                 ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
-                close(sock);
                 break;
             }
-            // Data received
-            else {
-                // Get the sender's ip address as string
-                if (source_addr.sin6_family == PF_INET) {
-                    inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
-                } else if (source_addr.sin6_family == PF_INET6) {
-                    inet6_ntoa_r(source_addr.sin6_addr, addr_str, sizeof(addr_str) - 1);
-                }
+            flags = MSG_DONTWAIT;
 
-                // Null-terminate whatever we received and treat like a string...
-                rx_buffer[len] = 0;
-
-                char reply[DNS_MAX_LEN];
-                int reply_len = parse_dns_request(rx_buffer, len, reply, DNS_MAX_LEN);
-
-                ESP_LOGI(TAG, "Received %d bytes from %s | DNS reply with len: %d", len, addr_str, reply_len);
-                if (reply_len <= 0) {
-                    ESP_LOGE(TAG, "Failed to prepare a DNS reply");
-                } else {
-                    int err = sendto(sock, reply, reply_len, 0, (struct sockaddr *)&source_addr, sizeof(source_addr));
-                    if (err < 0) {
-                        ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-                        break;
-                    }
-                }
+            if (template.ip_addr != s_ap_ip) {
+                dns_reply_template_init(&template, s_ap_ip);
             }
-        }
 
-        if (sock != -1) {
-            ESP_LOGE(TAG, "Shutting down socket");
-            shutdown(sock, 0);
-            close(sock);
+            dns_reply_result_t result;
+            size_t reply_len = dns_reply_build(&template, packet, len, &result);
+            count(result);
+            ESP_LOGD(TAG, "Received %d bytes, reply %u (%d)", len, (unsigned)reply_len, result);
+            if (reply_len == 0) {
+                continue;
+            }
+            if (sendto(sock, packet, reply_len, 0, (struct sockaddr *)&source_addr, socklen) < 0) {
+                // Full send buffer for instance, the client asks again
+                ESP_LOGD(TAG, "Error occurred during sending: errno %d", errno);
+                s_stats.dropped++;
+            }
         }
+
+        ESP_LOGE(TAG, "Shutting down socket");
+        shutdown(sock, 0);
+        close(sock);
+        vTaskDelay(DNS_RETRY_MS / portTICK_PERIOD_MS);
     }
-    vTaskDelete(NULL);
 }
 
 void setup_captive_dns(void)
 {
-    xTaskCreate(dns_server_task, "dns_server", 4096, NULL, 5, NULL);
+    // The AP address is set by the time it starts, and doesn't change
+    // after. Leases handed out are a cheap occasion to check.
+    refresh_ap_ip();
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_AP_START, &ip_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_AP_STAIPASSIGNED, &ip_event_handler, NULL));
+
+    xTaskCreate(dns_server_task, "dns_server", 3072, NULL, 5, NULL);
+}
+
+void captdns_get_stats(captdns_stats_t *out)
+{
+    *out = s_stats;
 }
@@ -1,6 +1,18 @@
 #ifndef CAPTDNS_H
 #define CAPTDNS_H
 
+#include <stdint.h>
+
+// Replies sent by the captive portal DNS, see dns_reply.h
+typedef struct {
+  uint32_t answers;  // A records
+  uint32_t nodata;   // AAAA, HTTPS and other types
+  uint32_t nxdomain; // reverse lookups
+  uint32_t errors;   // malformed queries, other opcodes
+  uint32_t dropped;  // not queries, or the reply couldn't be sent
+} captdns_stats_t;
+
 void setup_captive_dns(void);
+void captdns_get_stats(captdns_stats_t *stats);
 
-#endif
\ No newline at end of file
+#endif
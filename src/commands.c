@@ -0,0 +1,478 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_COMMANDS
+#include "logbuf.h"
+
+#include "commands.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_timer.h"
+
+#include "mqtt.h"
+#include "power_wheel.h"
+#include "spool.h"
+#include "settings.h"
+#include "wifi.h"
+
+// Local variables
+
+static const char *TAG = "commands";
+
+#define REPLY_MAX_LEN 256
+#define NUMBER_MAX_LEN 32
+#define STRING_MAX_LEN 128 // longest string setting, see settings.h
+
+// A JSON value inside the received message, not terminated
+typedef struct {
+  const char *p;
+  size_t len;
+} json_span_t;
+
+// =====================
+// ==== JSON SCANNER ====
+// =====================
+
+// Just enough JSON to pick members out of a flat object without copying or
+// allocating. Invalid input makes lookups fail, it never reads past end.
+
+static const char *skip_ws(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+    p++;
+  }
+  return p;
+}
+
+// Returns the end of the value starting at p, or NULL
+static const char *skip_value(const char *p, const char *end) {
+  if (p >= end) {
+    return NULL;
+  }
+
+  if (*p == '"') {
+    for (p++; p < end; p++) {
+      if (*p == '\\') {
+        p++;
+      } else if (*p == '"') {
+        return p + 1;
+      }
+    }
+    return NULL;
+  }
+
+  if (*p == '{' || *p == '[') {
+    int depth = 0;
+    bool in_string = false;
+    for (; p < end; p++) {
+      if (in_string) {
+        if (*p == '\\') {
+          p++;
+        } else if (*p == '"') {
+          in_string = false;
+        }
+      } else if (*p == '"') {
+        in_string = true;
+      } else if (*p == '{' || *p == '[') {
+        depth++;
+      } else if ((*p == '}' || *p == ']') && --depth == 0) {
+        return p + 1;
+      }
+    }
+    return NULL;
+  }
+
+  // Number, true, false or null
+  const char *start = p;
+  while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\r' && *p != '\n' && *p != '\t') {
+    p++;
+  }
+  return p > start ? p : NULL;
+}
+
+// Value of member key in the object obj
+static bool json_member(json_span_t obj, const char *key, json_span_t *value) {
+  const char *end = obj.p + obj.len;
+  const char *p = skip_ws(obj.p, end);
+  if (p >= end || *p != '{') {
+    return false;
+  }
+  size_t key_len = strlen(key);
+
+  p = skip_ws(p + 1, end);
+  while (p < end && *p == '"') {
+    const char *name = p + 1;
+    const char *name_end = skip_value(p, end);
+    if (name_end == NULL) {
+      return false;
+    }
+    p = skip_ws(name_end, end);
+    if (p >= end || *p != ':') {
+      return false;
+    }
+    p = skip_ws(p + 1, end);
+    const char *value_end = skip_value(p, end);
+    if (value_end == NULL) {
+      return false;
+    }
+
+    if ((size_t)(name_end - 1 - name) == key_len && memcmp(name, key, key_len) == 0) {
+      value->p = p;
+      value->len = value_end - p;
+      return true;
+    }
+
+    p = skip_ws(value_end, end);
+    if (p < end && *p == ',') {
+      p = skip_ws(p + 1, end);
+    }
+  }
+  return false;
+}
+
+// Copy a string value, unescaping the usual sequences
+static bool json_string(json_span_t value, char *out, size_t out_len) {
+  if (value.len < 2 || value.p[0] != '"' || out_len == 0) {
+    return false;
+  }
+  size_t pos = 0;
+  for (size_t i = 1; i < value.len - 1; ++i) {
+    char c = value.p[i];
+    if (c == '\\' && i + 1 < value.len - 1) {
+      c = value.p[++i];
+      switch (c) {
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case 'r': c = '\r'; break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        default: break; // \" \\ \/ as is, \u not supported
+      }
+    }
+    if (pos + 1 >= out_len) {
+      return false;
+    }
+    out[pos++] = c;
+  }
+  out[pos] = '\0';
+  return true;
+}
+
+// Replace the string setting with member key if present and fitting
+static void json_update_setting(json_span_t obj, const char *key, setting_id_t id) {
+  char value_str[STRING_MAX_LEN];
+  json_span_t value;
+  if (json_member(obj, key, &value) && json_string(value, value_str, sizeof(value_str))) {
+    settings_set_string(id, value_str);
+  }
+}
+
+static bool json_number(json_span_t value, float *out) {
+  char buf[NUMBER_MAX_LEN];
+  if (value.len == 0 || value.len >= sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, value.p, value.len);
+  buf[value.len] = '\0';
+  char *end;
+  *out = strtof(buf, &end);
+  return end == buf + value.len;
+}
+
+static bool json_uint64(json_span_t value, uint64_t *out) {
+  char buf[NUMBER_MAX_LEN];
+  if (value.len == 0 || value.len >= sizeof(buf) || value.p[0] == '-') {
+    return false;
+  }
+  memcpy(buf, value.p, value.len);
+  buf[value.len] = '\0';
+  char *end;
+  *out = strtoull(buf, &end, 10);
+  return end == buf + value.len;
+}
+
+static bool json_bool(json_span_t value, bool *out) {
+  if (value.len == 4 && memcmp(value.p, "true", 4) == 0) {
+    *out = true;
+    return true;
+  }
+  if (value.len == 5 && memcmp(value.p, "false", 5) == 0) {
+    *out = false;
+    return true;
+  }
+  return false;
+}
+
+// ==================
+// ==== COMMANDS ====
+// ==================
+
+static void reply_format(command_reply_t reply, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void reply_format(command_reply_t reply, const char *format, ...) {
+  char message[REPLY_MAX_LEN];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  if (len >= (int)sizeof(message)) {
+    len = sizeof(message) - 1;
+  }
+  reply(message, len);
+}
+
+// STA Wi-Fi: save credentials
+static void set_sta(json_span_t params, command_reply_t reply) {
+  char ssid[33], pass[65];
+  json_span_t value;
+  if (json_member(params, "ssid", &value) && json_string(value, ssid, sizeof(ssid)) &&
+      json_member(params, "password", &value) && json_string(value, pass, sizeof(pass))) {
+    wifi_set_sta_credentials(ssid, pass);
+    power_wheel_config_changed();
+    reply_format(reply, "{\"ok\":true,\"type\":\"set_sta\",\"ssid\":\"%s\"}", ssid);
+  } else {
+    reply_format(reply, "{\"ok\":false,\"type\":\"set_sta\",\"error\":\"invalid parameters\"}");
+  }
+}
+
+// STA Wi-Fi: get saved SSID for prefill
+static void get_sta(json_span_t params, command_reply_t reply) {
+  reply_format(reply, "{\"type\":\"sta_info\",\"ssid\":\"%s\"}", setting_sta_ssid());
+}
+
+// STA Wi-Fi: clear creds (AP-only)
+static void clear_sta(json_span_t params, command_reply_t reply) {
+  wifi_set_sta_credentials("", "");
+  power_wheel_config_changed();
+  reply_format(reply, "{\"ok\":true,\"type\":\"clear_sta\"}");
+}
+
+// MQTT: set config (uri/user/pass/base_topic), missing members are kept
+static void set_mqtt(json_span_t params, command_reply_t reply) {
+  json_update_setting(params, "uri", SETTING_mqtt_uri);
+  json_update_setting(params, "username", SETTING_mqtt_user);
+  json_update_setting(params, "password", SETTING_mqtt_pass);
+  json_update_setting(params, "base_topic", SETTING_mqtt_base);
+
+  mqtt_apply_config_and_restart();
+  power_wheel_config_changed();
+  reply_format(reply, "{\"ok\":true,\"type\":\"set_mqtt\",\"uri\":\"%s\",\"base\":\"%s\"}",
+               setting_mqtt_uri(), setting_mqtt_base());
+}
+
+// MQTT: get config (no password echoed)
+static void get_mqtt(json_span_t params, command_reply_t reply) {
+  reply_format(reply, "{\"type\":\"mqtt_info\",\"uri\":\"%s\",\"username\":\"%s\",\"base\":\"%s\"}",
+               setting_mqtt_uri(), setting_mqtt_user(), setting_mqtt_base());
+}
+
+// MQTT: clear config
+static void clear_mqtt(json_span_t params, command_reply_t reply) {
+  setting_set_mqtt_uri("");
+  setting_set_mqtt_user("");
+  setting_set_mqtt_pass("");
+  setting_set_mqtt_base("");
+  mqtt_apply_config_and_restart();
+  power_wheel_config_changed();
+  reply_format(reply, "{\"ok\":true,\"type\":\"clear_mqtt\"}");
+}
+
+// Speed limits
+static void update_max(json_span_t params, command_reply_t reply) {
+  float max_forward, max_backward;
+  json_span_t value;
+  if (!json_member(params, "max_forward", &value) || !json_number(value, &max_forward) ||
+      !json_member(params, "max_backward", &value) || !json_number(value, &max_backward)) {
+    reply_format(reply, "{\"ok\":false,\"type\":\"update_max\",\"error\":\"invalid parameters\"}");
+    return;
+  }
+  if (power_wheel_set_limits(max_forward, max_backward) != ESP_OK) {
+    reply_format(reply, "{\"ok\":false,\"type\":\"update_max\",\"error\":\"out of bounds\"}");
+    return;
+  }
+  reply_format(reply, "{\"ok\":true,\"type\":\"update_max\"}");
+}
+
+// Check value against the schema of the setting, and save it unless only
+// checking
+static bool update_setting(setting_id_t id, json_span_t value, bool save) {
+  char str[STRING_MAX_LEN];
+  float number;
+  uint64_t integer;
+
+  switch (SETTINGS_INFO[id].type) {
+    case SETTING_FLOAT:
+      if (!json_number(value, &number) || !settings_check_float(id, number)) {
+        return false;
+      }
+      return !save || settings_set_float(id, number) == ESP_OK;
+    case SETTING_UINT64:
+      if (!json_uint64(value, &integer)) {
+        return false;
+      }
+      return !save || settings_set_uint64(id, integer) == ESP_OK;
+    case SETTING_STRING:
+      if (!json_string(value, str, sizeof(str)) || !settings_check_string(id, str)) {
+        return false;
+      }
+      return !save || settings_set_string(id, str) == ESP_OK;
+  }
+  return false;
+}
+
+// Settings: any of the members of /api/config, passwords too. All are
+// checked before any is saved, then each group changed is applied once.
+static void set_config(json_span_t params, command_reply_t reply) {
+  json_span_t values[SETTING_COUNT];
+  bool present[SETTING_COUNT];
+  uint32_t groups = 0;
+
+  for (setting_id_t id = 0; id < SETTING_COUNT; ++id) {
+    const setting_info_t *info = &SETTINGS_INFO[id];
+    present[id] = (info->flags & (SETTING_UI | SETTING_SECRET)) && json_member(params, info->name, &values[id]);
+    if (present[id] && !update_setting(id, values[id], false)) {
+      reply_format(reply, "{\"ok\":false,\"type\":\"set_config\",\"error\":\"invalid %s\"}", info->name);
+      return;
+    }
+  }
+
+  for (setting_id_t id = 0; id < SETTING_COUNT; ++id) {
+    if (present[id]) {
+      update_setting(id, values[id], true);
+      groups |= 1u << SETTINGS_INFO[id].group;
+    }
+  }
+
+  if (groups & (1u << SETTINGS_DRIVE)) {
+    power_wheel_limits_changed();
+  }
+  if (groups & (1u << SETTINGS_STA)) {
+    wifi_apply_sta_settings();
+  }
+  if (groups & (1u << SETTINGS_MQTT)) {
+    mqtt_apply_config_and_restart();
+  }
+  if (groups) {
+    power_wheel_config_changed();
+  }
+  reply_format(reply, "{\"ok\":true,\"type\":\"set_config\"}");
+}
+
+// Emergency stop
+static void emergency_stop(json_span_t params, command_reply_t reply) {
+  bool active;
+  json_span_t value;
+  if (!json_member(params, "active", &value) || !json_bool(value, &active)) {
+    reply_format(reply, "{\"ok\":false,\"type\":\"emergency_stop\",\"error\":\"invalid parameters\"}");
+    return;
+  }
+  power_wheel_set_emergency_stop(active);
+  reply_format(reply, "{\"ok\":true,\"type\":\"emergency_stop\",\"active\":%s}", active ? "true" : "false");
+}
+
+// Spool: optional "policy" ("oldest" or "downsample"), replies the counters
+static void spool(json_span_t params, command_reply_t reply) {
+  char policy[16];
+  json_span_t value;
+  if (json_member(params, "policy", &value)) {
+    if (json_string(value, policy, sizeof(policy)) && strcmp(policy, "oldest") == 0) {
+      spool_set_policy(SPOOL_DROP_OLDEST);
+    } else if (json_string(value, policy, sizeof(policy)) && strcmp(policy, "downsample") == 0) {
+      spool_set_policy(SPOOL_DROP_DOWNSAMPLE);
+    } else {
+      reply_format(reply, "{\"ok\":false,\"type\":\"spool\",\"error\":\"invalid parameters\"}");
+      return;
+    }
+  }
+
+  spool_stats_t stats;
+  spool_get_stats(&stats);
+  reply_format(reply, "{\"ok\":true,\"type\":\"spool\",\"policy\":\"%s\",\"ram\":%u,\"flash\":%u,"
+               "\"sectors\":%u,\"dropped\":%u}",
+               stats.policy == SPOOL_DROP_DOWNSAMPLE ? "downsample" : "oldest", (unsigned)stats.ram_records,
+               (unsigned)stats.flash_records, (unsigned)stats.flash_sectors, (unsigned)stats.dropped);
+}
+
+// Radio profile: optional "profile" to switch to, replies the one in use
+static void radio(json_span_t params, command_reply_t reply) {
+  char profile[16];
+  json_span_t value;
+  if (json_member(params, "profile", &value)) {
+    if (!json_string(value, profile, sizeof(profile)) || wifi_set_radio_profile(profile) != ESP_OK) {
+      reply_format(reply, "{\"ok\":false,\"type\":\"radio\",\"error\":\"invalid parameters\"}");
+      return;
+    }
+    power_wheel_config_changed();
+  }
+
+  wifi_radio_stats_t stats;
+  wifi_get_radio_stats(wifi_radio_profile(), &stats);
+  reply_format(reply, "{\"ok\":true,\"type\":\"radio\",\"profile\":\"%s\",\"tx_dbm\":%.1f,"
+               "\"beacon_ms\":%u,\"dtim\":%u,\"rtt_us\":%u,\"samples\":%u}",
+               stats.name, stats.tx_power_dbm, (unsigned)stats.beacon_interval_ms,
+               (unsigned)stats.dtim_period, (unsigned)stats.rtt_avg_us, (unsigned)stats.rtt_samples);
+}
+
+// Echo of the "t" of a sta_status broadcast, its round trip goes to the
+// radio profile statistics. No reply.
+static void pong(json_span_t params, command_reply_t reply) {
+  uint64_t sent_us;
+  json_span_t value;
+  if (!json_member(params, "t", &value) || !json_uint64(value, &sent_us)) {
+    return;
+  }
+  uint64_t now_us = esp_timer_get_time();
+  // Echoes from before a restart, or older than any sensible round trip
+  if (sent_us <= now_us && now_us - sent_us < 10000000) {
+    wifi_radio_add_rtt(now_us - sent_us);
+  }
+}
+
+typedef struct {
+  const char *name;
+  void (*run)(json_span_t params, command_reply_t reply);
+} command_t;
+
+static const command_t COMMANDS[] = {
+  { "emergency_stop", emergency_stop },
+  { "update_max", update_max },
+  { "set_config", set_config },
+  { "set_sta", set_sta },
+  { "get_sta", get_sta },
+  { "clear_sta", clear_sta },
+  { "set_mqtt", set_mqtt },
+  { "get_mqtt", get_mqtt },
+  { "clear_mqtt", clear_mqtt },
+  { "spool", spool },
+  { "radio", radio },
+  { "pong", pong },
+};
+
+void commands_dispatch(const char *command, size_t command_len,
+                       const char *params, size_t params_len, command_reply_t reply) {
+  json_span_t span = { .p = params ? params : "{}", .len = params ? params_len : 2 };
+
+  for (size_t i = 0; i < sizeof(COMMANDS) / sizeof(COMMANDS[0]); ++i) {
+    if (strlen(COMMANDS[i].name) == command_len && memcmp(COMMANDS[i].name, command, command_len) == 0) {
+      ESP_LOGD(TAG, "Command: %s", COMMANDS[i].name);
+      COMMANDS[i].run(span, reply);
+      return;
+    }
+  }
+
+  ESP_LOGW(TAG, "Unknown command: %.*s", (int)command_len, command);
+  reply_format(reply, "{\"ok\":false,\"type\":\"%.*s\",\"error\":\"unknown command\"}",
+               (int)(command_len < 32 ? command_len : 32), command);
+}
+
+void commands_dispatch_message(const char *json, size_t len, command_reply_t reply) {
+  json_span_t root = { .p = json, .len = len };
+  json_span_t command, params;
+
+  if (!json_member(root, "command", &command) || command.len < 2 || command.p[0] != '"') {
+    return;
+  }
+  bool has_params = json_member(root, "parameters", &params);
+  // The name itself is used without the quotes, escapes are not expected
+  commands_dispatch(command.p + 1, command.len - 2,
+                    has_params ? params.p : NULL, has_params ? params.len : 0, reply);
+}
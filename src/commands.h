@@ -0,0 +1,20 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stddef.h>
+
+// Commands shared by the WebSocket UI and MQTT (<base>/cmd/<command>):
+// set_sta, get_sta, clear_sta, set_mqtt, get_mqtt, clear_mqtt, update_max,
+// emergency_stop and spool. Parameters are read in place, nothing is allocated.
+
+// Sends a JSON reply back to where the command came from
+typedef void (*command_reply_t)(const char *json, size_t len);
+
+// Run command with its JSON "parameters" object, params may be NULL
+void commands_dispatch(const char *command, size_t command_len,
+                       const char *params, size_t params_len, command_reply_t reply);
+
+// Run a {"command": ..., "parameters": {...}} message
+void commands_dispatch_message(const char *json, size_t len, command_reply_t reply);
+
+#endif
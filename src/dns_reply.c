@@ -0,0 +1,127 @@
+#include "dns_reply.h"
+
+#include <string.h>
+
+// Local variables
+
+#define HEADER_LEN 12
+#define QUESTION_FIXED_LEN 4 // type and class after the name
+#define NAME_MAX_LEN 255
+
+// Header flags, first and second byte
+#define FLAG_QR 0x80
+#define FLAG_OPCODE 0x78
+#define FLAG_AA 0x04
+#define FLAG_RD 0x01
+
+#define RCODE_NOERROR 0
+#define RCODE_FORMERR 1
+#define RCODE_NXDOMAIN 3
+#define RCODE_NOTIMP 4
+
+#define TYPE_A 1
+#define TYPE_PTR 12
+#define TYPE_ANY 255
+#define CLASS_IN 1
+
+// Implementations
+
+static uint16_t read16(const uint8_t *p) {
+  return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static void write16(uint8_t *p, uint16_t value) {
+  p[0] = value >> 8;
+  p[1] = value & 0xff;
+}
+
+void dns_reply_template_init(dns_reply_template_t *template, uint32_t ip_addr) {
+  uint8_t *a = template->answer;
+  template->ip_addr = ip_addr;
+  write16(a, 0xc000 | HEADER_LEN); // name: pointer to the question
+  write16(a + 2, TYPE_A);
+  write16(a + 4, CLASS_IN);
+  write16(a + 6, DNS_REPLY_TTL_S >> 16);
+  write16(a + 8, DNS_REPLY_TTL_S & 0xffff);
+  write16(a + 10, 4);
+  memcpy(a + 12, &ip_addr, 4); // already in network order
+}
+
+// Header only reply, the question dropped
+static size_t reply_error(uint8_t *packet, uint8_t rcode, dns_reply_result_t *result) {
+  packet[2] = FLAG_QR | (packet[2] & (FLAG_OPCODE | FLAG_RD));
+  packet[3] = rcode;
+  memset(packet + 4, 0, HEADER_LEN - 4);
+  *result = DNS_REPLY_ERROR;
+  return HEADER_LEN;
+}
+
+// Length of the name starting at offset, 0 when malformed. Questions don't
+// use compression pointers. NAME_MAX_LEN counts the final zero too.
+static size_t name_len(const uint8_t *packet, size_t offset, size_t len) {
+  size_t start = offset;
+  while (offset < len) {
+    uint8_t label = packet[offset];
+    if (label == 0) {
+      return offset + 1 - start;
+    }
+    if ((label & 0xc0) != 0 || offset + 2 + label - start > NAME_MAX_LEN) {
+      return 0;
+    }
+    offset += 1 + label;
+  }
+  return 0;
+}
+
+size_t dns_reply_build(const dns_reply_template_t *template, uint8_t *packet, size_t len,
+                       dns_reply_result_t *result) {
+  // Too short, or a response: replying could start a loop
+  if (len < HEADER_LEN || (packet[2] & FLAG_QR)) {
+    *result = DNS_REPLY_DROP;
+    return 0;
+  }
+  if ((packet[2] & FLAG_OPCODE) != 0) {
+    return reply_error(packet, RCODE_NOTIMP, result);
+  }
+  // Clients send a single question, nobody answers more
+  if (read16(packet + 4) != 1) {
+    return reply_error(packet, RCODE_FORMERR, result);
+  }
+
+  size_t name = name_len(packet, HEADER_LEN, len);
+  size_t question_end = HEADER_LEN + name + QUESTION_FIXED_LEN;
+  if (name == 0 || question_end > len) {
+    return reply_error(packet, RCODE_FORMERR, result);
+  }
+  uint16_t type = read16(packet + HEADER_LEN + name);
+  uint16_t class = read16(packet + HEADER_LEN + name + 2);
+
+  uint8_t rcode = RCODE_NOERROR;
+  uint16_t answers = 0;
+  if (class == CLASS_IN && (type == TYPE_A || type == TYPE_ANY)) {
+    *result = DNS_REPLY_ANSWER;
+    answers = 1;
+  } else if (type == TYPE_PTR) {
+    *result = DNS_REPLY_NXDOMAIN;
+    rcode = RCODE_NXDOMAIN;
+  } else {
+    *result = DNS_REPLY_NODATA;
+  }
+
+  // Authoritative for every name. Authority and additional records of the
+  // query (EDNS OPT) are dropped with what follows the question.
+  packet[2] = FLAG_QR | FLAG_AA | (packet[2] & FLAG_RD);
+  packet[3] = rcode;
+  write16(packet + 6, answers);
+  write16(packet + 8, 0);
+  write16(packet + 10, 0);
+
+  if (answers == 0) {
+    return question_end;
+  }
+  if (question_end + sizeof(template->answer) > DNS_REPLY_MAX_LEN) {
+    return reply_error(packet, RCODE_FORMERR, result);
+  }
+  memcpy(packet + question_end, template->answer, sizeof(template->answer));
+  return question_end + sizeof(template->answer);
+}
@@ -0,0 +1,43 @@
+#ifndef DNS_REPLY_H
+#define DNS_REPLY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Captive portal DNS answers, built in place in the query buffer. Every
+// name resolves to the soft AP:
+//
+//   A, ANY       one A record, the AP address
+//   PTR          NXDOMAIN, there are no reverse names
+//   other types  NOERROR without answers (NODATA): AAAA, HTTPS and SVCB
+//                lookups end there and the client falls back to the A
+//                record instead of retrying
+//
+// Plain C without ESP-IDF headers, so it also builds on the host.
+
+#define DNS_REPLY_MAX_LEN 512 // plain UDP DNS, EDNS is not offered
+#define DNS_REPLY_TTL_S 300
+
+typedef enum {
+  DNS_REPLY_ANSWER,   // A record
+  DNS_REPLY_NODATA,   // known name, no record of that type
+  DNS_REPLY_NXDOMAIN,
+  DNS_REPLY_ERROR,    // FORMERR or NOTIMP
+  DNS_REPLY_DROP,     // not a query, no reply
+  DNS_REPLY_RESULT_COUNT
+} dns_reply_result_t;
+
+// The A record appended to each answer, prebuilt for the current address
+typedef struct {
+  uint32_t ip_addr; // network byte order
+  uint8_t answer[16];
+} dns_reply_template_t;
+
+void dns_reply_template_init(dns_reply_template_t *template, uint32_t ip_addr);
+
+// Turn the query of len bytes in packet (buffer of DNS_REPLY_MAX_LEN) into
+// its reply. Returns the reply length, 0 for DNS_REPLY_DROP.
+size_t dns_reply_build(const dns_reply_template_t *template, uint8_t *packet, size_t len,
+                       dns_reply_result_t *result);
+
+#endif
@@ -0,0 +1,87 @@
+#include "latency.h"
+
+#if WITH_LATENCY_BENCH
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_timer.h"
+
+// Probes start and stop on different tasks, everything is atomic instead of
+// locked so the drive loop never waits on the bench.
+
+static const char *const PROBE_NAMES[LATENCY_PROBE_COUNT] = {
+  [LATENCY_PEDAL_TO_DUTY] = "pedal_to_duty",
+  [LATENCY_ESTOP_TO_DUTY] = "estop_to_duty",
+  [LATENCY_COMMAND_TO_ACK] = "command_to_ack",
+  [LATENCY_STATE_TO_MQTT] = "state_to_mqtt",
+};
+
+// Start time with the low bit set, 0 when idle. 32 bits of microseconds
+// wrap after 71 minutes, differences stay right.
+static uint32_t pending[LATENCY_PROBE_COUNT];
+static uint32_t recorded[LATENCY_PROBE_COUNT];
+static uint32_t samples[LATENCY_PROBE_COUNT][LATENCY_SAMPLES];
+
+// Implementations
+
+static uint32_t now_us(void) {
+  return (uint32_t)esp_timer_get_time() | 1;
+}
+
+void latency_start(latency_probe_t probe) {
+  uint32_t idle = 0;
+  __atomic_compare_exchange_n(&pending[probe], &idle, now_us(), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void latency_stop(latency_probe_t probe) {
+  uint32_t start = __atomic_exchange_n(&pending[probe], 0, __ATOMIC_RELAXED);
+  if (start == 0) {
+    return;
+  }
+  uint32_t elapsed = now_us() - start;
+  uint32_t index = __atomic_fetch_add(&recorded[probe], 1, __ATOMIC_RELAXED);
+  samples[probe][index % LATENCY_SAMPLES] = elapsed;
+}
+
+void latency_cancel(latency_probe_t probe) {
+  __atomic_store_n(&pending[probe], 0, __ATOMIC_RELAXED);
+}
+
+void latency_reset(void) {
+  for (int i = 0; i < LATENCY_PROBE_COUNT; ++i) {
+    __atomic_store_n(&pending[i], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&recorded[i], 0, __ATOMIC_RELAXED);
+  }
+}
+
+static int compare_samples(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+void latency_get_stats(latency_probe_t probe, latency_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  uint32_t count = __atomic_load_n(&recorded[probe], __ATOMIC_RELAXED);
+  if (count > LATENCY_SAMPLES) {
+    count = LATENCY_SAMPLES;
+  }
+  uint32_t *sorted = count ? malloc(count * sizeof(uint32_t)) : NULL;
+  if (sorted == NULL) {
+    return;
+  }
+
+  memcpy(sorted, samples[probe], count * sizeof(uint32_t));
+  qsort(sorted, count, sizeof(uint32_t), compare_samples);
+  stats->count = count;
+  stats->p50 = sorted[(count - 1) * 50 / 100];
+  stats->p90 = sorted[(count - 1) * 90 / 100];
+  stats->p99 = sorted[(count - 1) * 99 / 100];
+  stats->max = sorted[count - 1];
+  free(sorted);
+}
+
+const char *latency_probe_name(latency_probe_t probe) {
+  return PROBE_NAMES[probe];
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+// Latency probes on the control and telemetry paths, read from /api/bench
+// and driven by tools/latency_bench.py. Only in builds with
+// WITH_LATENCY_BENCH, which also let the bench press the pedals: run it
+// with the wheels off the ground.
+
+#ifndef WITH_LATENCY_BENCH
+#define WITH_LATENCY_BENCH 0
+#endif
+
+#define LATENCY_SAMPLES 256 // per probe, the oldest are overwritten
+
+typedef enum {
+  LATENCY_PEDAL_TO_DUTY,  // pedal change seen or injected, to the PWM duty change
+  LATENCY_ESTOP_TO_DUTY,  // emergency_stop frame received, to zero duty
+  LATENCY_COMMAND_TO_ACK, // WebSocket command received, to its ack frame queued
+  LATENCY_STATE_TO_MQTT,  // driving state changed, to the telemetry publish
+  LATENCY_PROBE_COUNT
+} latency_probe_t;
+
+// Microseconds over the samples kept
+typedef struct {
+  uint32_t count;
+  uint32_t p50;
+  uint32_t p90;
+  uint32_t p99;
+  uint32_t max;
+} latency_stats_t;
+
+#if WITH_LATENCY_BENCH
+// Stamp the start of probe, unless one is pending already (first cause wins)
+void latency_start(latency_probe_t probe);
+// Record the time since the pending start, if any
+void latency_stop(latency_probe_t probe);
+void latency_cancel(latency_probe_t probe);
+
+void latency_reset(void);
+void latency_get_stats(latency_probe_t probe, latency_stats_t *stats);
+const char *latency_probe_name(latency_probe_t probe);
+#else
+#define latency_start(probe) ((void)0)
+#define latency_stop(probe) ((void)0)
+#define latency_cancel(probe) ((void)0)
+#endif
+
+#endif
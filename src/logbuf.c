@@ -0,0 +1,156 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_MAIN
+#include "logbuf.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+// Log lines are formatted by the calling task straight into a slot of a
+// bounded lock-free ring (multi producer, single consumer), then written to
+// the UART by a low priority task. A full ring drops the line instead of
+// blocking, so logging never stalls the network or driving tasks.
+
+static const char *TAG = "logbuf";
+
+#define DRAIN_PERIOD_MS 20
+
+typedef struct {
+  uint32_t seq;
+  char line[LOGBUF_LINE_LEN];
+} log_slot_t;
+
+static log_slot_t slots[LOGBUF_SLOTS];
+static uint32_t head = 0; // next position claimed by a producer
+static uint32_t tail = 0; // next position drained, only touched by the drain task
+
+static logbuf_stats_t stats;
+
+// Copy of the drained output for the HTTP tail
+static char tail_buffer[LOGBUF_TAIL_LEN];
+static size_t tail_pos = 0;
+static bool tail_wrapped = false;
+static SemaphoreHandle_t tail_mutex = NULL;
+
+// Implementations
+
+static int logbuf_vprintf(const char *format, va_list args) {
+  uint32_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  log_slot_t *slot;
+
+  for (;;) {
+    slot = &slots[pos & (LOGBUF_SLOTS - 1)];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    int32_t diff = (int32_t)(seq - pos);
+
+    if (diff == 0) {
+      // Slot is free, try to claim it. On failure pos is reloaded.
+      if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Ring is full, the drain task is behind
+      __atomic_fetch_add(&stats.dropped, 1, __ATOMIC_RELAXED);
+      return 0;
+    } else {
+      // Another producer claimed this slot, catch up
+      pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    }
+  }
+
+  int len = vsnprintf(slot->line, LOGBUF_LINE_LEN, format, args);
+  if (len >= LOGBUF_LINE_LEN) {
+    // Keep the line terminated so the UART output stays readable
+    slot->line[LOGBUF_LINE_LEN - 2] = '\n';
+    __atomic_fetch_add(&stats.truncated, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add(&stats.written, 1, __ATOMIC_RELAXED);
+
+  // Publish the slot to the drain task
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  return len;
+}
+
+static void append_tail(const char *line, size_t len) {
+  xSemaphoreTake(tail_mutex, portMAX_DELAY);
+  for (size_t i = 0; i < len; ++i) {
+    tail_buffer[tail_pos++] = line[i];
+    if (tail_pos == LOGBUF_TAIL_LEN) {
+      tail_pos = 0;
+      tail_wrapped = true;
+    }
+  }
+  xSemaphoreGive(tail_mutex);
+}
+
+static void drain_task(void *pvParameter) {
+  while (true) {
+    bool wrote = false;
+
+    for (;;) {
+      log_slot_t *slot = &slots[tail & (LOGBUF_SLOTS - 1)];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1) {
+        break;
+      }
+
+      size_t len = strnlen(slot->line, LOGBUF_LINE_LEN);
+      fwrite(slot->line, 1, len, stdout);
+      append_tail(slot->line, len);
+      wrote = true;
+
+      // Hand the slot back to the producers
+      __atomic_store_n(&slot->seq, tail + LOGBUF_SLOTS, __ATOMIC_RELEASE);
+      tail++;
+    }
+
+    if (wrote) {
+      fflush(stdout);
+    }
+    vTaskDelay(DRAIN_PERIOD_MS / portTICK_PERIOD_MS);
+  }
+}
+
+void logbuf_get_stats(logbuf_stats_t *out) {
+  out->written = __atomic_load_n(&stats.written, __ATOMIC_RELAXED);
+  out->dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+  out->truncated = __atomic_load_n(&stats.truncated, __ATOMIC_RELAXED);
+}
+
+size_t logbuf_copy_tail(char *out, size_t out_len) {
+  if (tail_mutex == NULL || out_len == 0) {
+    return 0;
+  }
+
+  xSemaphoreTake(tail_mutex, portMAX_DELAY);
+  size_t available = tail_wrapped ? LOGBUF_TAIL_LEN : tail_pos;
+  size_t len = available < out_len ? available : out_len;
+  // Start from the oldest byte that still fits in out
+  size_t start = (tail_pos + LOGBUF_TAIL_LEN - len) % LOGBUF_TAIL_LEN;
+  size_t first = LOGBUF_TAIL_LEN - start;
+  if (first >= len) {
+    memcpy(out, tail_buffer + start, len);
+  } else {
+    memcpy(out, tail_buffer + start, first);
+    memcpy(out + first, tail_buffer, len - first);
+  }
+  xSemaphoreGive(tail_mutex);
+
+  return len;
+}
+
+void setup_logbuf(void) {
+  for (uint32_t i = 0; i < LOGBUF_SLOTS; ++i) {
+    slots[i].seq = i;
+  }
+
+  tail_mutex = xSemaphoreCreateMutex();
+
+  // Lowest priority above idle, it only runs when nothing else needs the CPU
+  xTaskCreate(&drain_task, "log_drain_task", 2048, NULL, 1, NULL);
+
+  esp_log_set_vprintf(logbuf_vprintf);
+  ESP_LOGI(TAG, "Log output buffered (%d lines of %d bytes)", LOGBUF_SLOTS, LOGBUF_LINE_LEN);
+}
@@ -0,0 +1,87 @@
+#ifndef LOGBUF_H
+#define LOGBUF_H
+
+// Include this header first in every module, right after defining
+// LOG_LOCAL_LEVEL to the module's ceiling, e.g.:
+//
+//   #define LOG_LOCAL_LEVEL LOG_CEILING_WEBSOCKET
+//   #include "logbuf.h"
+//
+// ESP_LOGx calls above the ceiling are removed at compile time, so per
+// packet / per frame logs should use ESP_LOGD and cost nothing in release.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_log.h"
+
+// Per-module ceilings, override from build_flags with -DLOG_CEILING_xxx=...
+#ifndef LOG_CEILING_MAIN
+#define LOG_CEILING_MAIN ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_CAPTDNS
+#define LOG_CEILING_CAPTDNS ESP_LOG_WARN
+#endif
+#ifndef LOG_CEILING_COMMANDS
+#define LOG_CEILING_COMMANDS ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_MQTT
+#define LOG_CEILING_MQTT ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_OTA
+#define LOG_CEILING_OTA ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_POWER_WHEEL
+#define LOG_CEILING_POWER_WHEEL ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_SETTINGS
+#define LOG_CEILING_SETTINGS ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_SPIFFS
+#define LOG_CEILING_SPIFFS ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_SPOOL
+#define LOG_CEILING_SPOOL ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_STORAGE
+#define LOG_CEILING_STORAGE ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_TELEMETRY
+#define LOG_CEILING_TELEMETRY ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_WEBFILE
+#define LOG_CEILING_WEBFILE ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_WEBSERVER
+#define LOG_CEILING_WEBSERVER ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_WEBSOCKET
+#define LOG_CEILING_WEBSOCKET ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_WEBWORKER
+#define LOG_CEILING_WEBWORKER ESP_LOG_INFO
+#endif
+#ifndef LOG_CEILING_WIFI
+#define LOG_CEILING_WIFI ESP_LOG_INFO
+#endif
+
+// RAM ring, must be a power of two
+#define LOGBUF_SLOTS 32
+#define LOGBUF_LINE_LEN 128
+// Last lines kept for the HTTP tail
+#define LOGBUF_TAIL_LEN 2048
+
+typedef struct {
+  uint32_t written;   // lines accepted into the ring
+  uint32_t dropped;   // lines lost because the ring was full
+  uint32_t truncated; // lines cut to LOGBUF_LINE_LEN
+} logbuf_stats_t;
+
+// Redirect esp_log output into the ring and start the drain task
+void setup_logbuf(void);
+
+void logbuf_get_stats(logbuf_stats_t *out);
+
+// Copy the most recent output (oldest first) into out, returns the length
+size_t logbuf_copy_tail(char *out, size_t out_len);
+
+#endif
@@ -1,3 +1,6 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_MAIN
+#include "logbuf.h"
+
 #include "esp_log.h"
 #include "esp_err.h"
 #include "freertos/FreeRTOS.h"
@@ -5,43 +8,96 @@
 #include <esp_event.h>
 #include "esp_netif.h"
 
+#include "boot.h"
 #include "storage.h"
+#include "settings.h"
 #include "captdns.h"
 #include "power_wheel.h"
 #include "wifi.h"
 #include "webserver.h"
 #include "spiffs.h"
+#include "mqtt.h"
+#include "telemetry.h"
+#include "spool.h"
 
 static const char *TAG = "main";
 
-void app_main() {
-  // To disable all logs, use ESP_LOG_NONE
-  esp_log_level_set("*", ESP_LOG_DEBUG);
+// Everything the driving doesn't need starts in these, after the car is
+// drivable. They only share the boot trace stages.
 
-  ESP_LOGI(TAG, "Start hello!!");
+// Flash bound: the web files and the telemetry spool
+static void boot_flash_task(void *pvParameter) {
+  // Not fatal anymore, the car already drives: the UI and uploads fail
+  if (setup_spiffs() != ESP_OK) {
+    ESP_LOGE(TAG, "Web files unavailable");
+  }
+  boot_mark(BOOT_FILESYSTEM);
 
-  ESP_LOGI(TAG, "IDF version: %s", esp_get_idf_version());
+  // Telemetry kept while the broker is out of reach
+  setup_spool();
+  boot_mark(BOOT_SPOOL);
 
-  // Init NVS storage
-  setup_storage();
+  // Publish the driving state over MQTT
+  setup_telemetry();
+  boot_mark(BOOT_TELEMETRY);
+
+  vTaskDelete(NULL);
+}
 
+// Network bound: Wi-Fi, captive portal and servers
+static void boot_network_task(void *pvParameter) {
   // Init TCP/IP stack
   ESP_ERROR_CHECK(esp_netif_init());
   // Init event mechanism
   ESP_ERROR_CHECK(esp_event_loop_create_default());
+  boot_mark(BOOT_NETIF);
 
-  // Init file storage
-  ESP_ERROR_CHECK(setup_spiffs());
+  // Setup wifi access point
+  setup_softap();
+  boot_mark(BOOT_WIFI);
 
   // Setup captive portal - automatically opens the page when we connect to the wifi
   setup_captive_dns();
+  boot_mark(BOOT_DNS);
 
-  // Setup wifi access point
-  setup_softap();
-
-  // Setup HTTP server
+  // Setup HTTP server, once it has files to serve
+  boot_wait(BOOT_FILESYSTEM, UINT32_MAX);
   setup_server();
+  boot_mark(BOOT_SERVER);
 
-  // Setup driving
+  ESP_LOGI(TAG, "Boot done in %u ms", (unsigned)(boot_stage_us(BOOT_SERVER) / 1000));
+  vTaskDelete(NULL);
+}
+
+void app_main() {
+  setup_boot_trace();
+
+  // Buffer log output so it never blocks the calling task on the UART
+  setup_logbuf();
+
+  // To disable all logs, use ESP_LOG_NONE. Our own modules are also capped
+  // at compile time by the LOG_CEILING_xxx values in logbuf.h
+  esp_log_level_set("*", ESP_LOG_INFO);
+
+  ESP_LOGI(TAG, "Start hello!!");
+
+  ESP_LOGI(TAG, "IDF version: %s", esp_get_idf_version());
+
+  // Init NVS storage
+  setup_storage();
+  boot_mark(BOOT_STORAGE);
+  // Every setting loaded once, read from RAM afterwards
+  setup_settings();
+  setup_mqtt();
+  boot_mark(BOOT_SETTINGS);
+
+  // Setup driving first, from the cached settings: the pedal works before
+  // the network and the filesystem are up
   setup_driving();
+  boot_mark(BOOT_DRIVABLE);
+  ESP_LOGI(TAG, "Drivable after %u ms", (unsigned)(boot_stage_us(BOOT_DRIVABLE) / 1000));
+
+  // Below the driving task
+  xTaskCreate(&boot_flash_task, "boot_flash_task", 4096, NULL, 5, NULL);
+  xTaskCreate(&boot_network_task, "boot_network_task", 4096, NULL, 5, NULL);
 }
@@ -1,48 +1,96 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_MQTT
+#include "logbuf.h"
+
 #include "mqtt.h"
 #include "esp_log.h"
 #include "mqtt_client.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_crt_bundle.h"
+#include "esp_timer.h"
 
-#include "storage.h"
+#include "settings.h"
+#include "commands.h"
+#include "spiffs.h"
 #include "websocket.h"   // to broadcast mqtt_status to the UI
 
 static const char *TAG = "mqtt";
 
 static esp_mqtt_client_handle_t s_client = NULL;
 static mqtt_config_t s_cfg;
+static volatile bool s_connected = false;
+static volatile uint32_t s_connection_id = 0;
+/* Broker connection as the client sees it, s_connected is false while the
+ * STA link is down even if the TCP connection may still be alive */
+static volatile bool s_session_up = false;
+static volatile bool s_link_up = true;
+static int64_t s_connect_start = 0;
+static uint32_t s_connect_ms = 0;
+
+/* PEM files for mqtts://, kept for the lifetime of the client */
+static char *s_ca_cert = NULL;
+static char *s_client_cert = NULL;
+static char *s_client_key = NULL;
+
+/* Full topic strings, rebuilt with the configuration so publishers from any
+ * task never format into a shared buffer */
+#define TOPIC_MAX_LEN 160
+static const char *const TOPIC_SUFFIXES[MQTT_TOPIC_COUNT] = {
+  [MQTT_TOPIC_TELEMETRY] = "telemetry",
+  [MQTT_TOPIC_CONFIG]    = "config",
+  [MQTT_TOPIC_HISTORY]   = "history",
+  [MQTT_TOPIC_ACK]       = "ack",
+  [MQTT_TOPIC_COMMAND]   = "cmd/",
+};
+static char s_topics[MQTT_TOPIC_COUNT][TOPIC_MAX_LEN];
+/* Subscribed since the topics were built, a resumed session has them */
+static bool s_subscribed = false;
+
+/* Commands split over several MQTT_EVENT_DATA are reassembled here, single
+ * events are dispatched straight from the client buffer */
+#define COMMAND_NAME_MAX_LEN 32
+#define COMMAND_PAYLOAD_MAX_LEN 512
+static char s_command_name[COMMAND_NAME_MAX_LEN];
+static size_t s_command_name_len = 0;
+static char s_command_payload[COMMAND_PAYLOAD_MAX_LEN];
+static bool s_command_dropped = false;
+
+/* Set while the event handler runs, the client can't be stopped from there */
+static volatile bool s_in_event_handler = false;
+
+static mqtt_published_callback s_published_callback = NULL;
+
+static void format_topic(char *out, size_t out_len, const char *suffix) {
+  if (s_cfg.base_topic[0]) {
+    snprintf(out, out_len, "%s/%s", s_cfg.base_topic, suffix);
+  } else {
+    snprintf(out, out_len, "%s", suffix);
+  }
+}
 
-/* NVS keys */
-#define KEY_MQTT_URI   "mqtt_uri"
-#define KEY_MQTT_USER  "mqtt_user"
-#define KEY_MQTT_PASS  "mqtt_pass"
-#define KEY_MQTT_BASE  "mqtt_base"
-
-/* Defaults */
-static void defaults(mqtt_config_t *c) {
-  memset(c, 0, sizeof(*c));
-  snprintf(c->uri, sizeof(c->uri), "mqtt://192.168.1.10:1883");
-  snprintf(c->base_topic, sizeof(c->base_topic), "powerbentley");
-  // username/password empty by default
-}
-
-void mqtt_load_config_from_nvs(mqtt_config_t *out) {
-  mqtt_config_t tmp; defaults(&tmp);
-  readString(KEY_MQTT_URI,  tmp.uri,  sizeof(tmp.uri),  tmp.uri);
-  readString(KEY_MQTT_USER, tmp.username, sizeof(tmp.username), "");
-  readString(KEY_MQTT_PASS, tmp.password, sizeof(tmp.password), "");
-  readString(KEY_MQTT_BASE, tmp.base_topic, sizeof(tmp.base_topic), tmp.base_topic);
-  if (out) *out = tmp;
-  s_cfg = tmp;
-}
-
-void mqtt_save_config_to_nvs(const mqtt_config_t *cfg) {
-  mqtt_config_t c = *cfg;
-  writeString(KEY_MQTT_URI,  c.uri);
-  writeString(KEY_MQTT_USER, c.username);
-  writeString(KEY_MQTT_PASS, c.password);
-  writeString(KEY_MQTT_BASE, c.base_topic);
+static void build_topics(void) {
+  for (int i = 0; i < MQTT_TOPIC_COUNT; ++i) {
+    format_topic(s_topics[i], sizeof(s_topics[i]), TOPIC_SUFFIXES[i]);
+  }
+  s_subscribed = false;
+}
+
+/* The client keeps its own copy, settings may change while it runs */
+static void load_config(void) {
+  mqtt_config_t c = { 0 };
+  strncpy(c.uri, setting_mqtt_uri(), sizeof(c.uri) - 1);
+  strncpy(c.username, setting_mqtt_user(), sizeof(c.username) - 1);
+  strncpy(c.password, setting_mqtt_pass(), sizeof(c.password) - 1);
+  strncpy(c.base_topic, setting_mqtt_base(), sizeof(c.base_topic) - 1);
   s_cfg = c;
+  build_topics();
+}
+
+void setup_mqtt(void) {
+  load_config();
 }
 
 void mqtt_get_config(mqtt_config_t *out) {
@@ -51,25 +99,106 @@ void mqtt_get_config(mqtt_config_t *out) {
 
 static void broadcast_status(bool connected) {
   char *msg;
-  asprintf(&msg, "{\"type\":\"mqtt_status\",\"connected\":%s,\"uri\":\"%s\",\"base\":\"%s\"}",
-           connected ? "true" : "false", s_cfg.uri, s_cfg.base_topic);
+  asprintf(&msg, "{\"type\":\"mqtt_status\",\"connected\":%s,\"uri\":\"%s\",\"base\":\"%s\",\"connect_ms\":%u}",
+           connected ? "true" : "false", s_cfg.uri, s_cfg.base_topic, (unsigned)s_connect_ms);
   broadcast_message(msg);
   free(msg);
 }
 
+static void publish_reply(const char *json, size_t len) {
+  mqtt_publish(MQTT_TOPIC_ACK, json, len, 1, false);
+}
+
+/* Name of the command from <base>/cmd/<command>, false for other topics */
+static bool command_from_topic(const char *topic, int topic_len, const char **name, size_t *name_len) {
+  const char *prefix = s_topics[MQTT_TOPIC_COMMAND];
+  size_t prefix_len = strlen(prefix);
+  if (topic == NULL || topic_len <= (int)prefix_len || strncmp(topic, prefix, prefix_len) != 0) {
+    return false;
+  }
+  *name = topic + prefix_len;
+  *name_len = topic_len - prefix_len;
+  return true;
+}
+
+static void handle_data(esp_mqtt_event_handle_t event) {
+  const char *name;
+  size_t name_len;
+
+  // Whole message in one event, the common case
+  if (event->current_data_offset == 0 && event->data_len == event->total_data_len) {
+    if (command_from_topic(event->topic, event->topic_len, &name, &name_len)) {
+      commands_dispatch(name, name_len, event->data_len ? event->data : NULL, event->data_len, publish_reply);
+    }
+    return;
+  }
+
+  // First fragment carries the topic
+  if (event->current_data_offset == 0) {
+    s_command_name_len = 0;
+    s_command_dropped = true;
+    if (!command_from_topic(event->topic, event->topic_len, &name, &name_len)) {
+      return;
+    }
+    if (name_len > sizeof(s_command_name) || event->total_data_len > (int)sizeof(s_command_payload)) {
+      ESP_LOGW(TAG, "Command too large (%d bytes), dropped", event->total_data_len);
+      static const char TOO_LARGE[] = "{\"ok\":false,\"error\":\"command too large\"}";
+      publish_reply(TOO_LARGE, sizeof(TOO_LARGE) - 1);
+      return;
+    }
+    memcpy(s_command_name, name, name_len);
+    s_command_name_len = name_len;
+    s_command_dropped = false;
+  }
+
+  if (s_command_dropped || event->current_data_offset + event->data_len > (int)sizeof(s_command_payload)) {
+    return;
+  }
+  memcpy(s_command_payload + event->current_data_offset, event->data, event->data_len);
+
+  if (event->current_data_offset + event->data_len == event->total_data_len) {
+    commands_dispatch(s_command_name, s_command_name_len, s_command_payload, event->total_data_len, publish_reply);
+    s_command_dropped = true;
+  }
+}
+
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base,
                                int32_t event_id, void *event_data)
 {
   esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t) event_data;
   switch (event->event_id) {
+    case MQTT_EVENT_BEFORE_CONNECT:
+      s_connect_start = esp_timer_get_time();
+      break;
     case MQTT_EVENT_CONNECTED:
-      ESP_LOGI(TAG, "MQTT connected");
+      s_connect_ms = (uint32_t)((esp_timer_get_time() - s_connect_start) / 1000);
+      ESP_LOGI(TAG, "MQTT connected in %u ms (session %s)", (unsigned)s_connect_ms,
+               event->session_present ? "resumed" : "new");
+      s_session_up = true;
+      s_connected = s_link_up;
+      s_connection_id++;
       broadcast_status(true);
-      // Example subscribe (optional):
-      // esp_mqtt_client_subscribe(s_client, "powerbentley/cmd/#", 0);
+      // The broker kept our subscription with the session
+      if (!event->session_present || !s_subscribed) {
+        char filter[TOPIC_MAX_LEN + 2];
+        snprintf(filter, sizeof(filter), "%s+", s_topics[MQTT_TOPIC_COMMAND]);
+        s_subscribed = esp_mqtt_client_subscribe(s_client, filter, 1) >= 0;
+      }
+      break;
+    case MQTT_EVENT_DATA:
+      s_in_event_handler = true;
+      handle_data(event);
+      s_in_event_handler = false;
+      break;
+    case MQTT_EVENT_PUBLISHED:
+      if (s_published_callback) {
+        s_published_callback(event->msg_id);
+      }
       break;
     case MQTT_EVENT_DISCONNECTED:
       ESP_LOGW(TAG, "MQTT disconnected");
+      s_session_up = false;
+      s_connected = false;
       broadcast_status(false);
       break;
     case MQTT_EVENT_ERROR:
@@ -80,9 +209,71 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base,
   }
 }
 
+static char *read_pem(const char *name)
+{
+  char path[64];
+  snprintf(path, sizeof(path), SPIFFS_BASE_PATH "/%s", name);
+  FILE *f = fopen(path, "r");
+  if (!f) return NULL;
+
+  char *pem = NULL;
+  if (fseek(f, 0, SEEK_END) == 0) {
+    long size = ftell(f);
+    rewind(f);
+    pem = size > 0 ? malloc(size + 1) : NULL;
+    if (pem) {
+      // NUL terminated, mbedtls needs it to parse PEM
+      pem[fread(pem, 1, size, f)] = '\0';
+    }
+  }
+  fclose(f);
+  return pem;
+}
+
+static void free_tls(void)
+{
+  free(s_ca_cert);
+  free(s_client_cert);
+  free(s_client_key);
+  s_ca_cert = s_client_cert = s_client_key = NULL;
+}
+
+static void load_tls(esp_mqtt_client_config_t *cfg)
+{
+  s_ca_cert = read_pem(MQTT_CA_CERT_FILE);
+  if (s_ca_cert) {
+    cfg->broker.verification.certificate = s_ca_cert;
+  } else {
+    cfg->broker.verification.crt_bundle_attach = esp_crt_bundle_attach;
+  }
+
+  s_client_cert = read_pem(MQTT_CLIENT_CERT_FILE);
+  s_client_key = read_pem(MQTT_CLIENT_KEY_FILE);
+  if (s_client_cert && s_client_key) {
+    cfg->credentials.authentication.certificate = s_client_cert;
+    cfg->credentials.authentication.key = s_client_key;
+  } else if (s_client_cert || s_client_key) {
+    ESP_LOGW(TAG, "Client certificate needs both %s and %s", MQTT_CLIENT_CERT_FILE, MQTT_CLIENT_KEY_FILE);
+  }
+
+  ESP_LOGI(TAG, "TLS with %s CA, %s client certificate", s_ca_cert ? MQTT_CA_CERT_FILE : "bundled",
+           cfg->credentials.authentication.certificate ? "a" : "no");
+}
+
 void mqtt_start(void)
 {
-  if (s_client) return;
+  s_link_up = true;
+  if (s_client) {
+    if (s_session_up) {
+      // The connection survived the blip
+      s_connected = true;
+      s_connection_id++;
+    } else {
+      // Don't wait for the reconnect timer
+      esp_mqtt_client_reconnect(s_client);
+    }
+    return;
+  }
 
   if (s_cfg.uri[0] == '\0') {
     ESP_LOGW(TAG, "No MQTT URI set, not starting.");
@@ -95,8 +286,14 @@ void mqtt_start(void)
     // Username/password if provided
     .credentials.username = (s_cfg.username[0] ? s_cfg.username : NULL),
     .credentials.authentication.password = (s_cfg.password[0] ? s_cfg.password : NULL),
-    // For TLS (mqtts://) you’d add certs here
+    // Default client id is derived from the MAC, stable as sessions need
+    .session.disable_clean_session = true,
+    .session.keepalive = MQTT_KEEPALIVE_S,
+    .network.reconnect_timeout_ms = MQTT_RECONNECT_TIMEOUT_MS,
   };
+  if (strncmp(s_cfg.uri, "mqtts://", 8) == 0) {
+    load_tls(&cfg);
+  }
 
   s_client = esp_mqtt_client_init(&cfg);
   esp_mqtt_client_register_event(s_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
@@ -110,14 +307,42 @@ void mqtt_stop(void)
   esp_mqtt_client_stop(s_client);
   esp_mqtt_client_destroy(s_client);
   s_client = NULL;
+  free_tls();
+  s_session_up = false;
+  s_connected = false;
   broadcast_status(false);
   ESP_LOGI(TAG, "MQTT stopped");
 }
 
+void mqtt_link_down(void)
+{
+  s_link_up = false;
+  if (s_connected) {
+    s_connected = false;
+    broadcast_status(false);
+  }
+}
+
+static void restart_task(void *pvParameter)
+{
+  while (s_in_event_handler) {
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+  }
+  mqtt_apply_config_and_restart();
+  vTaskDelete(NULL);
+}
+
 void mqtt_apply_config_and_restart(void)
 {
+  if (s_in_event_handler) {
+    // Reconfigured over MQTT, restart once the event is handled
+    xTaskCreate(&restart_task, "mqtt_restart_task", 3072, NULL, 5, NULL);
+    return;
+  }
+
   bool was_running = (s_client != NULL);
   if (was_running) mqtt_stop();
+  load_config();
   mqtt_start();
 }
 
@@ -126,26 +351,46 @@ bool mqtt_is_running(void)
   return s_client != NULL;
 }
 
-static char tmp_topic[160];
+bool mqtt_is_connected(void)
+{
+  return s_client != NULL && s_connected;
+}
 
-static const char* full_topic(const char *suffix) {
-  if (s_cfg.base_topic[0]) {
-    snprintf(tmp_topic, sizeof(tmp_topic), "%s/%s", s_cfg.base_topic, suffix);
-    return tmp_topic;
-  }
-  return suffix;
+uint32_t mqtt_connection_id(void)
+{
+  return s_connection_id;
+}
+
+uint32_t mqtt_connect_time_ms(void)
+{
+  return s_connect_ms;
+}
+
+void mqtt_set_published_callback(mqtt_published_callback callback)
+{
+  s_published_callback = callback;
+}
+
+int mqtt_publish(mqtt_topic_t topic, const char *payload, int len, int qos, bool retain)
+{
+  if (!s_client || topic >= MQTT_TOPIC_COUNT) return -1;
+  return esp_mqtt_client_publish(s_client, s_topics[topic], payload, len, qos, retain ? 1 : 0);
 }
 
 int mqtt_publish_str(const char *topic, const char *payload, int qos, bool retain)
 {
   if (!s_client) return -1;
-  return esp_mqtt_client_publish(s_client, full_topic(topic), payload, 0, qos, retain ? 1 : 0);
+  char full[TOPIC_MAX_LEN];
+  format_topic(full, sizeof(full), topic);
+  return esp_mqtt_client_publish(s_client, full, payload, 0, qos, retain ? 1 : 0);
 }
 
 int mqtt_publish_f(const char *topic, float value, int qos, bool retain)
 {
   if (!s_client) return -1;
+  char full[TOPIC_MAX_LEN];
+  format_topic(full, sizeof(full), topic);
   char buf[32];
   int n = snprintf(buf, sizeof(buf), "%.2f", value);
-  return esp_mqtt_client_publish(s_client, full_topic(topic), buf, n, qos, retain ? 1 : 0);
+  return esp_mqtt_client_publish(s_client, full, buf, n, qos, retain ? 1 : 0);
 }
@@ -1,24 +1,68 @@
-#pragma once
+#ifndef MQTT_H
+#define MQTT_H
+
 #include <stdbool.h>
+#include <stdint.h>
+
+/* Load the configuration, call once after setup_settings() */
+void setup_mqtt(void);
 
-/* Start/stop controlled by STA link events (wifi.c) */
+/* Start/stop controlled by STA link events (wifi.c). The client outlives
+ * Wi-Fi blips: mqtt_link_down() only pauses live publishing, and
+ * mqtt_start() on an existing client reconnects it right away. */
 void mqtt_start(void);
 void mqtt_stop(void);
+void mqtt_link_down(void);
 bool mqtt_is_running(void);
+bool mqtt_is_connected(void);
+/* Incremented on every broker connection, to notice reconnects */
+uint32_t mqtt_connection_id(void);
+/* TCP, TLS and MQTT CONNECT of the last connection, in ms */
+uint32_t mqtt_connect_time_ms(void);
+
+/* mqtts:// reads PEM files from the storage filesystem. Without the CA file
+ * the broker is checked against the built-in certificate bundle, the client
+ * certificate and key are optional. */
+#define MQTT_CA_CERT_FILE     "mqtt_ca.crt"
+#define MQTT_CLIENT_CERT_FILE "mqtt_client.crt"
+#define MQTT_CLIENT_KEY_FILE  "mqtt_client.key"
+
+/* Persistent session: the broker keeps subscriptions and queued QoS 1
+ * messages between connections, so reconnects skip resubscribing */
+#define MQTT_KEEPALIVE_S 30
+#define MQTT_RECONNECT_TIMEOUT_MS 2000
 
-/* Configuration (NVS-backed) */
+/* Configuration the client runs with, copied from the settings (see
+ * settings.h) when it is applied */
 typedef struct {
-  char uri[128];      // e.g. "mqtt://192.168.1.10:1883" or "mqtts://host:8883"
+  char uri[128];      // e.g. "mqtt://192.168.1.10:1883" or "mqtts://host:8883" (see MQTT_CA_CERT_FILE)
   char username[64];
   char password[64];
   char base_topic[64]; // e.g. "powerbentley"
 } mqtt_config_t;
 
-void mqtt_load_config_from_nvs(mqtt_config_t *out);             // fills defaults if unset
-void mqtt_save_config_to_nvs(const mqtt_config_t *cfg);         // persists
-void mqtt_apply_config_and_restart(void);                       // stop → reinit → start
-void mqtt_get_config(mqtt_config_t *out);                       // current in-RAM copy
+void mqtt_apply_config_and_restart(void);                       // stop → reload → start
+void mqtt_get_config(mqtt_config_t *out);                       // copy in use
+
+/* Topics under the base topic, built when the configuration is applied */
+typedef enum {
+  MQTT_TOPIC_TELEMETRY, // <base>/telemetry, batched changes
+  MQTT_TOPIC_CONFIG,    // <base>/config, retained
+  MQTT_TOPIC_HISTORY,   // <base>/history, spooled telemetry replayed
+  MQTT_TOPIC_ACK,       // <base>/ack, command replies
+  MQTT_TOPIC_COMMAND,   // <base>/cmd/ prefix, <base>/cmd/<command> is subscribed
+  MQTT_TOPIC_COUNT
+} mqtt_topic_t;
+
+/* Called from the MQTT task once the broker acknowledged the QoS 1 message
+ * msg_id (MQTT_EVENT_PUBLISHED). Until then it only sits in the client's
+ * RAM outbox, which a reboot or mqtt_stop() loses. */
+typedef void (*mqtt_published_callback)(int msg_id);
+void mqtt_set_published_callback(mqtt_published_callback callback);
 
 /* Publish helpers */
+int mqtt_publish(mqtt_topic_t topic, const char *payload, int len, int qos, bool retain);
 int mqtt_publish_str(const char *topic, const char *payload, int qos, bool retain);
 int mqtt_publish_f(const char *topic, float value, int qos, bool retain);
+
+#endif
@@ -0,0 +1,610 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_OTA
+#include "logbuf.h"
+
+#include "ota.h"
+#include "utils.h"
+#include "spiffs.h"
+#include "storage.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+#if __has_include("miniz.h")
+#include "miniz.h"
+#else
+#include "esp32/rom/miniz.h"
+#endif
+
+// Local variables
+
+static const char *TAG = "ota";
+
+// Two buffers: one being received while the other is written to flash
+#define OTA_BUFFER_COUNT 2
+#define OTA_BUFFER_SIZE 8192
+
+// A filled buffer, len 0 stops the writer
+typedef struct {
+  int index;
+  size_t len;
+} ota_chunk_t;
+
+static bool in_progress = false;
+static char *buffers[OTA_BUFFER_COUNT];
+static QueueHandle_t free_buffers = NULL;   // indexes ready to be filled
+static QueueHandle_t filled_buffers = NULL; // chunks waiting for the writer
+static SemaphoreHandle_t writer_done = NULL;
+
+static ota_target_t target;
+static const esp_partition_t *partition = NULL;
+static esp_ota_handle_t ota_handle;
+static size_t erased_len = 0; // storage target: erased bytes from the start
+static volatile esp_err_t write_error = ESP_OK;
+
+// Packed images (tools/pack_firmware.py): this header followed by a raw
+// deflate stream limited to a 2^window_bits bytes window. Plain images start
+// with ESP_IMAGE_HEADER_MAGIC and are written as they are.
+#define PACKED_MAGIC "PBZ1"
+#define PACKED_KIND_FULL 0
+#define PACKED_KIND_DELTA 1
+#define PACKED_MIN_WINDOW_BITS 9
+#define PACKED_MAX_WINDOW_BITS 15
+
+typedef struct __attribute__((packed)) {
+  char magic[4];
+  uint8_t kind;
+  uint8_t window_bits;
+  uint16_t reserved;
+  uint32_t image_len;        // length of the decompressed image
+  uint8_t image_sha256[32];  // hash of the decompressed image
+  uint32_t reserved2;
+} packed_header_t;
+
+// Delta images (tools/make_delta.py) follow the header with the firmware
+// they apply to, then the deflate stream inflates to a list of patch ops
+typedef struct __attribute__((packed)) {
+  uint32_t source_len;
+  uint8_t source_sha256[32];
+} delta_header_t;
+
+// Fixed size op: COPY source offset, length / INSERT length, 0 then the bytes
+#define PATCH_OP_COPY 1
+#define PATCH_OP_INSERT 2
+#define PATCH_OP_SIZE 9
+#define PATCH_COPY_SIZE 1024
+
+// Writer side state, only touched by the writer task until it stopped
+static bool format_known = false;
+static bool packed = false;
+static packed_header_t header;
+static tinfl_decompressor *inflator = NULL;
+static uint8_t *window = NULL;  // inflate dictionary, also the output buffer
+static size_t window_size = 0;
+static size_t window_pos = 0;
+static bool inflate_done = false;
+static size_t input_len = 0;    // bytes received
+static size_t image_written = 0; // bytes written to the partition
+static mbedtls_sha256_context image_sha;
+// Delta state
+static const esp_partition_t *source = NULL;
+static delta_header_t delta;
+static uint8_t *copy_buffer = NULL;
+static uint8_t patch_op[PATCH_OP_SIZE];
+static size_t patch_op_len = 0;
+static uint32_t patch_literal = 0; // INSERT bytes still to pass through
+
+// Implementations
+
+// Raw partition write, each sector is erased right before the first write
+// into it so erasing overlaps with the reception of the next buffer
+static esp_err_t write_storage(const uint8_t *data, size_t len) {
+  if (image_written + len > partition->size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  while (erased_len < image_written + len) {
+    esp_err_t ret = esp_partition_erase_range(partition, erased_len, SPI_FLASH_SEC_SIZE);
+    if (ret != ESP_OK) {
+      return ret;
+    }
+    erased_len += SPI_FLASH_SEC_SIZE;
+  }
+  return esp_partition_write(partition, image_written, data, len);
+}
+
+static esp_err_t write_image(const uint8_t *data, size_t len) {
+  if (packed && image_written + len > header.image_len) {
+    ESP_LOGE(TAG, "Packed image longer than announced");
+    return ESP_ERR_INVALID_SIZE;
+  }
+  mbedtls_sha256_update(&image_sha, data, len);
+
+  esp_err_t ret = target == OTA_TARGET_STORAGE ? write_storage(data, len) : esp_ota_write(ota_handle, data, len);
+  image_written += len;
+  return ret;
+}
+
+static uint32_t read_le32(const uint8_t *data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// Write len bytes of the running firmware from offset
+static esp_err_t copy_from_source(uint32_t offset, uint32_t len) {
+  if (offset > delta.source_len || len > delta.source_len - offset) {
+    ESP_LOGE(TAG, "Patch copies outside of the source image");
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  while (len > 0) {
+    size_t part = min(len, PATCH_COPY_SIZE);
+    esp_err_t ret = esp_partition_read(source, offset, copy_buffer, part);
+    if (ret == ESP_OK) {
+      ret = write_image(copy_buffer, part);
+    }
+    if (ret != ESP_OK) {
+      return ret;
+    }
+    offset += part;
+    len -= part;
+  }
+  return ESP_OK;
+}
+
+// Run the patch ops, they may be split anywhere between two calls
+static esp_err_t apply_patch(const uint8_t *data, size_t len) {
+  while (len > 0) {
+    if (patch_literal > 0) {
+      size_t part = min(len, patch_literal);
+      esp_err_t ret = write_image(data, part);
+      if (ret != ESP_OK) {
+        return ret;
+      }
+      patch_literal -= part;
+      data += part;
+      len -= part;
+      continue;
+    }
+
+    size_t part = min(len, PATCH_OP_SIZE - patch_op_len);
+    memcpy(patch_op + patch_op_len, data, part);
+    patch_op_len += part;
+    data += part;
+    len -= part;
+    if (patch_op_len < PATCH_OP_SIZE) {
+      break;
+    }
+    patch_op_len = 0;
+
+    uint32_t a = read_le32(patch_op + 1);
+    uint32_t b = read_le32(patch_op + 5);
+    if (patch_op[0] == PATCH_OP_COPY) {
+      esp_err_t ret = copy_from_source(a, b);
+      if (ret != ESP_OK) {
+        return ret;
+      }
+    } else if (patch_op[0] == PATCH_OP_INSERT) {
+      patch_literal = a;
+    } else {
+      ESP_LOGE(TAG, "Invalid patch op %d", patch_op[0]);
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+  }
+  return ESP_OK;
+}
+
+// A delta only applies to the exact firmware it was made from
+static esp_err_t start_delta(const uint8_t *data, size_t len) {
+  if (len < sizeof(delta)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(&delta, data, sizeof(delta));
+
+  source = esp_ota_get_running_partition();
+  if (source == NULL || delta.source_len > source->size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  copy_buffer = malloc(PATCH_COPY_SIZE);
+  if (copy_buffer == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  int64_t start = esp_timer_get_time();
+  uint8_t sha[32];
+  mbedtls_sha256_context source_sha;
+  mbedtls_sha256_init(&source_sha);
+  mbedtls_sha256_starts(&source_sha, 0);
+  esp_err_t ret = ESP_OK;
+  for (uint32_t offset = 0; offset < delta.source_len && ret == ESP_OK; offset += PATCH_COPY_SIZE) {
+    size_t part = min(delta.source_len - offset, PATCH_COPY_SIZE);
+    ret = esp_partition_read(source, offset, copy_buffer, part);
+    mbedtls_sha256_update(&source_sha, copy_buffer, part);
+  }
+  mbedtls_sha256_finish(&source_sha, sha);
+  mbedtls_sha256_free(&source_sha);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  if (memcmp(sha, delta.source_sha256, sizeof(sha)) != 0) {
+    ESP_LOGE(TAG, "Delta was made for another firmware than the one running");
+    return ESP_ERR_INVALID_VERSION;
+  }
+
+  patch_op_len = 0;
+  patch_literal = 0;
+  ESP_LOGI(TAG, "Delta against %s checked in %lld ms", source->label, (esp_timer_get_time() - start) / 1000);
+  return ESP_OK;
+}
+
+static esp_err_t start_packed(const uint8_t *data, size_t len, size_t *header_len) {
+  if (len < sizeof(header)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(&header, data, sizeof(header));
+  *header_len = sizeof(header);
+
+  if (header.kind == PACKED_KIND_DELTA && target == OTA_TARGET_APP) {
+    esp_err_t ret = start_delta(data + sizeof(header), len - sizeof(header));
+    if (ret != ESP_OK) {
+      return ret;
+    }
+    *header_len += sizeof(delta);
+  } else if (header.kind != PACKED_KIND_FULL) {
+    ESP_LOGE(TAG, "Unsupported packed image kind %d", header.kind);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  if (header.window_bits < PACKED_MIN_WINDOW_BITS || header.window_bits > PACKED_MAX_WINDOW_BITS) {
+    ESP_LOGE(TAG, "Unsupported window of %d bits", header.window_bits);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  if (header.image_len > partition->size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  window_size = 1 << header.window_bits;
+  window_pos = 0;
+  inflator = malloc(sizeof(tinfl_decompressor));
+  window = malloc(window_size);
+  if (inflator == NULL || window == NULL) {
+    ESP_LOGE(TAG, "Not enough memory to inflate");
+    return ESP_ERR_NO_MEM;
+  }
+  tinfl_init(inflator);
+  inflate_done = false;
+  packed = true;
+
+  ESP_LOGI(TAG, "Packed image of %u bytes, %u bytes window", (unsigned)header.image_len, (unsigned)window_size);
+  return ESP_OK;
+}
+
+// Inflate into the circular window, writing out everything it produces
+static esp_err_t inflate_chunk(const uint8_t *data, size_t len) {
+  while (!inflate_done) {
+    size_t in_len = len;
+    size_t out_len = window_size - window_pos;
+    tinfl_status status = tinfl_decompress(inflator, data, &in_len, window, window + window_pos, &out_len,
+                                           TINFL_FLAG_HAS_MORE_INPUT);
+    data += in_len;
+    len -= in_len;
+
+    if (out_len > 0) {
+      uint8_t *out = window + window_pos;
+      esp_err_t ret = header.kind == PACKED_KIND_DELTA ? apply_patch(out, out_len) : write_image(out, out_len);
+      if (ret != ESP_OK) {
+        return ret;
+      }
+      window_pos = (window_pos + out_len) & (window_size - 1);
+    }
+
+    if (status < TINFL_STATUS_DONE) {
+      ESP_LOGE(TAG, "Corrupted packed image (%d)", status);
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+    if (status == TINFL_STATUS_DONE) {
+      inflate_done = true;
+    } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0) {
+      break;
+    }
+  }
+  return ESP_OK;
+}
+
+static esp_err_t process_chunk(const uint8_t *data, size_t len) {
+  input_len += len;
+
+  if (!format_known) {
+    // The first buffer is filled completely, so it holds the whole header
+    format_known = true;
+    if (len >= 4 && memcmp(data, PACKED_MAGIC, 4) == 0) {
+      size_t header_len;
+      esp_err_t ret = start_packed(data, len, &header_len);
+      if (ret != ESP_OK) {
+        return ret;
+      }
+      data += header_len;
+      len -= header_len;
+    }
+  }
+
+  return packed ? inflate_chunk(data, len) : write_image(data, len);
+}
+
+// Check a packed image against its header once everything was written
+static esp_err_t verify_packed(const uint8_t *sha) {
+  if (!inflate_done || image_written != header.image_len) {
+    ESP_LOGE(TAG, "Packed image truncated (%u of %u bytes)", (unsigned)image_written, (unsigned)header.image_len);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (memcmp(sha, header.image_sha256, sizeof(header.image_sha256)) != 0) {
+    ESP_LOGE(TAG, "Packed image hash mismatch");
+    return ESP_ERR_INVALID_CRC;
+  }
+
+  ESP_LOGI(TAG, "Packed image verified, %u bytes received for %u bytes written",
+           (unsigned)input_len, (unsigned)image_written);
+  return ESP_OK;
+}
+
+// Read the storage partition back, the application partition is checked by
+// esp_ota_end() instead. The writer stopped, so its buffers are free.
+static esp_err_t verify_storage(const uint8_t *sha) {
+  uint8_t *buffer = (uint8_t *)buffers[0];
+  uint8_t read_sha[32];
+  mbedtls_sha256_context read_ctx;
+  mbedtls_sha256_init(&read_ctx);
+  mbedtls_sha256_starts(&read_ctx, 0);
+  esp_err_t ret = ESP_OK;
+  for (size_t offset = 0; offset < image_written && ret == ESP_OK; offset += OTA_BUFFER_SIZE) {
+    size_t part = min(image_written - offset, OTA_BUFFER_SIZE);
+    ret = esp_partition_read(partition, offset, buffer, part);
+    mbedtls_sha256_update(&read_ctx, buffer, part);
+  }
+  mbedtls_sha256_finish(&read_ctx, read_sha);
+  mbedtls_sha256_free(&read_ctx);
+
+  if (ret == ESP_OK && memcmp(sha, read_sha, sizeof(read_sha)) != 0) {
+    ESP_LOGE(TAG, "Storage read back differs from the upload");
+    ret = ESP_ERR_INVALID_CRC;
+  }
+  return ret;
+}
+
+// Check everything the writer produced, called once it stopped
+static esp_err_t verify_image(void) {
+  uint8_t sha[32];
+  mbedtls_sha256_finish(&image_sha, sha);
+
+  esp_err_t ret = packed ? verify_packed(sha) : ESP_OK;
+  if (ret == ESP_OK && target == OTA_TARGET_STORAGE) {
+    ret = verify_storage(sha);
+  }
+  return ret;
+}
+
+static void writer_task(void *pvParameter) {
+  ota_chunk_t chunk;
+
+  while (xQueueReceive(filled_buffers, &chunk, portMAX_DELAY) == pdTRUE && chunk.len > 0) {
+    // After a failure keep draining so the receiver never blocks
+    if (write_error == ESP_OK) {
+      esp_err_t ret = process_chunk((const uint8_t *)buffers[chunk.index], chunk.len);
+      if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "OTA write failed (%s)", esp_err_to_name(ret));
+        write_error = ret;
+      }
+    }
+    xQueueSend(free_buffers, &chunk.index, portMAX_DELAY);
+  }
+
+  xSemaphoreGive(writer_done);
+  vTaskDelete(NULL);
+}
+
+static void free_pipeline(void) {
+  if (free_buffers) vQueueDelete(free_buffers);
+  if (filled_buffers) vQueueDelete(filled_buffers);
+  if (writer_done) vSemaphoreDelete(writer_done);
+  free_buffers = NULL;
+  filled_buffers = NULL;
+  writer_done = NULL;
+
+  for (int i = 0; i < OTA_BUFFER_COUNT; ++i) {
+    free(buffers[i]);
+    buffers[i] = NULL;
+  }
+
+  mbedtls_sha256_free(&image_sha);
+  free(inflator);
+  free(window);
+  free(copy_buffer);
+  inflator = NULL;
+  window = NULL;
+  copy_buffer = NULL;
+  packed = false;
+  format_known = false;
+  in_progress = false;
+}
+
+// Stop the writer once it flushed everything queued
+static void stop_writer(void) {
+  ota_chunk_t stop = { .index = -1, .len = 0 };
+  xQueueSend(filled_buffers, &stop, portMAX_DELAY);
+  xSemaphoreTake(writer_done, portMAX_DELAY);
+}
+
+// The filesystem can't stay mounted while its partition is rewritten. The
+// caller makes sure no file is open (webfile.c suspends file requests).
+static esp_err_t begin_storage(void) {
+  esp_err_t ret = unmount_spiffs();
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to unmount the filesystem (%s)", esp_err_to_name(ret));
+    return ret;
+  }
+  erased_len = 0;
+  return ESP_OK;
+}
+
+// Mount again, an incomplete image fails to mount and gets formatted, so
+// single files can still be uploaded afterwards
+static void end_storage(void) {
+  setup_spiffs();
+}
+
+esp_err_t ota_begin(size_t upload_len, ota_target_t update_target) {
+  if (in_progress) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  // Settings changed just before the update shouldn't wait on the restart
+  storage_flush();
+
+  target = update_target;
+  if (target == OTA_TARGET_STORAGE) {
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, SPIFFS_PARTITION_LABEL);
+  } else {
+    partition = esp_ota_get_next_update_partition(NULL);
+  }
+  if (partition == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (upload_len > partition->size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  in_progress = true;
+  for (int i = 0; i < OTA_BUFFER_COUNT; ++i) {
+    buffers[i] = malloc(OTA_BUFFER_SIZE);
+  }
+  free_buffers = xQueueCreate(OTA_BUFFER_COUNT, sizeof(int));
+  filled_buffers = xQueueCreate(OTA_BUFFER_COUNT + 1, sizeof(ota_chunk_t));
+  writer_done = xSemaphoreCreateBinary();
+
+  bool allocated = free_buffers && filled_buffers && writer_done;
+  for (int i = 0; i < OTA_BUFFER_COUNT; ++i) {
+    allocated = allocated && buffers[i];
+  }
+  if (!allocated) {
+    ESP_LOGE(TAG, "Not enough memory for the OTA pipeline");
+    free_pipeline();
+    return ESP_ERR_NO_MEM;
+  }
+
+  // Sectors are erased on demand by the writer, while the next buffer is
+  // received, instead of erasing the whole partition up front
+  esp_err_t ret;
+  if (target == OTA_TARGET_STORAGE) {
+    ret = begin_storage();
+  } else {
+    ret = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &ota_handle);
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to begin OTA (%s)", esp_err_to_name(ret));
+    free_pipeline();
+    return ret;
+  }
+  mbedtls_sha256_init(&image_sha);
+  mbedtls_sha256_starts(&image_sha, 0);
+  write_error = ESP_OK;
+  input_len = 0;
+  image_written = 0;
+
+  for (int i = 0; i < OTA_BUFFER_COUNT; ++i) {
+    xQueueSend(free_buffers, &i, 0);
+  }
+  xTaskCreate(&writer_task, "ota_writer_task", 4096, NULL, 4, NULL);
+
+  ESP_LOGI(TAG, "Receiving %u bytes for partition %s", (unsigned)upload_len, partition->label);
+  return ESP_OK;
+}
+
+esp_err_t ota_next_buffer(ota_buffer_t *buffer) {
+  if (!in_progress) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (xQueueReceive(free_buffers, &buffer->index, portMAX_DELAY) != pdTRUE) {
+    return ESP_FAIL;
+  }
+  buffer->data = buffers[buffer->index];
+  buffer->size = OTA_BUFFER_SIZE;
+
+  if (write_error != ESP_OK) {
+    xQueueSend(free_buffers, &buffer->index, 0);
+    return write_error;
+  }
+  return ESP_OK;
+}
+
+esp_err_t ota_commit_buffer(const ota_buffer_t *buffer, size_t len) {
+  if (!in_progress) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (len == 0) {
+    // Nothing to write, keep the buffer available
+    xQueueSend(free_buffers, &buffer->index, 0);
+    return ESP_OK;
+  }
+  ota_chunk_t chunk = { .index = buffer->index, .len = len };
+  xQueueSend(filled_buffers, &chunk, portMAX_DELAY);
+  return write_error;
+}
+
+esp_err_t ota_finish(void) {
+  if (!in_progress) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  stop_writer();
+  if (write_error == ESP_OK) {
+    write_error = verify_image();
+  }
+  free_pipeline();
+
+  if (target == OTA_TARGET_STORAGE) {
+    end_storage();
+    if (write_error == ESP_OK) {
+      ESP_LOGI(TAG, "Filesystem image written to %s", partition->label);
+    }
+    return write_error;
+  }
+
+  if (write_error != ESP_OK) {
+    esp_ota_abort(ota_handle);
+    return write_error;
+  }
+
+  // Validates the written image
+  esp_err_t ret = esp_ota_end(ota_handle);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Image validation failed (%s)", esp_err_to_name(ret));
+    return ret;
+  }
+
+  ret = esp_ota_set_boot_partition(partition);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Set new boot partition failed (%s)", esp_err_to_name(ret));
+    return ret;
+  }
+
+  ESP_LOGI(TAG, "Update written, boot partition is now %s", partition->label);
+  return ESP_OK;
+}
+
+void ota_abort(void) {
+  if (!in_progress) {
+    return;
+  }
+  stop_writer();
+  free_pipeline();
+  if (target == OTA_TARGET_STORAGE) {
+    end_storage();
+  } else {
+    esp_ota_abort(ota_handle);
+  }
+  ESP_LOGW(TAG, "Update aborted");
+}
@@ -0,0 +1,41 @@
+#ifndef OTA_H
+#define OTA_H
+
+#include <stddef.h>
+#include "esp_err.h"
+
+// Firmware update pipeline: the caller fills one buffer from the network
+// while a writer task flashes the previous one. Accepts plain application
+// images, packed ones from tools/pack_firmware.py and deltas against the
+// running firmware from tools/make_delta.py. Packed images and deltas are
+// inflated on the fly and checked against their embedded length and SHA-256.
+// The same pipeline writes filesystem images to the storage partition.
+
+typedef enum {
+  OTA_TARGET_APP,     // next OTA application partition, booted after a restart
+  OTA_TARGET_STORAGE, // filesystem partition, remounted once written
+} ota_target_t;
+
+typedef struct {
+  int index;
+  char *data;
+  size_t size;
+} ota_buffer_t;
+
+// Start an update of the target partition, upload_len is the size of the
+// image as received
+esp_err_t ota_begin(size_t upload_len, ota_target_t target);
+
+// Wait for a free buffer to fill, fails if a previous write failed
+esp_err_t ota_next_buffer(ota_buffer_t *buffer);
+
+// Hand len bytes of a filled buffer over to the writer
+esp_err_t ota_commit_buffer(const ota_buffer_t *buffer, size_t len);
+
+// Wait for the last writes, validate the image and boot from it next time
+esp_err_t ota_finish(void);
+
+// Drop the update, the running firmware stays the boot partition
+void ota_abort(void);
+
+#endif
@@ -1,3 +1,6 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_POWER_WHEEL
+#include "logbuf.h"
+
 #include "power_wheel.h"
 
 #include <sys/param.h>
@@ -12,12 +15,14 @@
 #include "esp_wifi.h"
 #include "esp_netif.h"
 
+#include "boot.h"
 #include "websocket.h"
-#include "cJSON.h"
-#include "storage.h"
+#include "settings.h"
 #include "utils.h"
 #include "wifi.h"
 #include "mqtt.h"
+#include "commands.h"
+#include "latency.h"
 
 // ================
 // ==== MACROS ====
@@ -48,11 +53,13 @@
 #define FORWARD_SHUTOFF_THRESOLD 15 // %
 #define BACKWARD_SHUTOFF_THRESOLD 10 // %
 
-#define DEFAULT_FORWARD_MAX_SPEED 60 // %
-#define DEFAULT_BACKWARD_MAX_SPEED 35 // %
-
 #define SPEED_INCREMENT 0.5f // % of increment per loop
 
+// Speed changes below this step don't count as a new state
+#define STATE_SPEED_STEP 0.1f
+
+#define BROADCAST_PERIOD_MS 200
+
 // PWM
 
 #define MOTOR_PWM_CHANNEL_FORWARD LEDC_CHANNEL_1
@@ -67,12 +74,20 @@
 static const char *TAG = "power_wheel";
 
 static float current_speed = 0.0f;
-static float max_forward = DEFAULT_FORWARD_MAX_SPEED;
-static float max_backward = DEFAULT_BACKWARD_MAX_SPEED;
 static bool emergency_stop = false;
 
+// Readers compare versions instead of values, see power_wheel_get_state()
+static uint32_t state_version = 0;
+static uint32_t config_version = 0;
+
+#if WITH_LATENCY_BENCH
+// Pedal position pressed by the latency bench, % and negative backward
+static volatile bool bench_pedal_active = false;
+static volatile int bench_pedal = 0;
+#endif
+
 static uint32_t led_sleep_delay = 500;
-static uint64_t total_runtime_s = 0;       // persisted
+static uint64_t total_runtime_s = 0;       // persisted every RUNTIME_SAVE_PERIOD_S
 static const uint32_t RUNTIME_SAVE_PERIOD_S = 60;
 
 
@@ -95,10 +110,12 @@ static void buttons_read_pedals(uint8_t* forward_position, uint8_t* backward_pos
 static void setup_pin();
 static void setup_pwm();
 
-static void send_values_to_motor(float speed);
+static bool send_values_to_motor(float speed);
 static void blink_led_running(float speed);
 static void broadcast_all_values(void);
 
+static void state_changed(void);
+
 static int get_speed_target(uint8_t forward_position, uint8_t backward_position);
 static float compute_next_speed(float current, float target, float delta);
 
@@ -106,156 +123,20 @@ static float compute_next_speed(float current, float target, float delta);
 // ==== WEBSOCKETS RX ====
 // =======================
 
-static void data_received(httpd_ws_frame_t* ws_pkt) {
-  ESP_LOGI(TAG, "Received packet with message: %s", ws_pkt->payload);
-
-  cJSON *root = cJSON_Parse((char*)ws_pkt->payload);
-  if (!root) return;
-  cJSON *cmdNode = cJSON_GetObjectItem(root, "command");
-  if (!cJSON_IsString(cmdNode)) { cJSON_Delete(root); return; }
-  char* command = cmdNode->valuestring;
-  ESP_LOGI(TAG, "Command: %s", command);
-
-  // ----- STA Wi-Fi: save credentials -----
-  if (strcmp("set_sta", command) == 0) {
-    cJSON* parameters = cJSON_GetObjectItem(root, "parameters");
-    if (parameters) {
-      cJSON* ssid = cJSON_GetObjectItem(parameters, "ssid");
-      cJSON* pass = cJSON_GetObjectItem(parameters, "password");
-      if (cJSON_IsString(ssid) && cJSON_IsString(pass)) {
-        wifi_set_sta_credentials(ssid->valuestring, pass->valuestring);
-        char *ack;
-        asprintf(&ack, "{\"ok\":true,\"type\":\"set_sta\",\"ssid\":\"%s\"}", ssid->valuestring);
-        broadcast_message(ack);
-        free(ack);
-      } else {
-        char *ack;
-        asprintf(&ack, "{\"ok\":false,\"type\":\"set_sta\",\"error\":\"invalid parameters\"}");
-        broadcast_message(ack);
-        free(ack);
-      }
-    }
-    goto end;
-  }
-
-  // ----- STA Wi-Fi: get saved SSID for prefill -----
-  if (strcmp("get_sta", command) == 0) {
-    char ssid_buf[33] = {0};
-    readString("sta_ssid", ssid_buf, sizeof(ssid_buf), "");
-    char *msg;
-    asprintf(&msg, "{\"type\":\"sta_info\",\"ssid\":\"%s\"}", ssid_buf);
-    broadcast_message(msg);
-    free(msg);
-    goto end;
-  }
-
-  // ----- STA Wi-Fi: clear creds (AP-only) -----
-  if (strcmp("clear_sta", command) == 0) {
-    wifi_set_sta_credentials("", "");
-    char *ack;
-    asprintf(&ack, "{\"ok\":true,\"type\":\"clear_sta\"}");
-    broadcast_message(ack);
-    free(ack);
-    goto end;
-  }
-
-  // ----- MQTT: set config (uri/user/pass/base_topic) -----
-  if (strcmp("set_mqtt", command) == 0) {
-    cJSON* p = cJSON_GetObjectItem(root, "parameters");
-    if (p) {
-      mqtt_config_t cfg;
-      mqtt_get_config(&cfg); // start from current
-      cJSON* uri  = cJSON_GetObjectItem(p, "uri");
-      cJSON* user = cJSON_GetObjectItem(p, "username");
-      cJSON* pass = cJSON_GetObjectItem(p, "password");
-      cJSON* base = cJSON_GetObjectItem(p, "base_topic");
-      if (cJSON_IsString(uri))  { strncpy(cfg.uri, uri->valuestring, sizeof(cfg.uri)-1); }
-      if (cJSON_IsString(user)) { strncpy(cfg.username, user->valuestring, sizeof(cfg.username)-1); }
-      if (cJSON_IsString(pass)) { strncpy(cfg.password, pass->valuestring, sizeof(cfg.password)-1); }
-      if (cJSON_IsString(base)) { strncpy(cfg.base_topic, base->valuestring, sizeof(cfg.base_topic)-1); }
-
-      mqtt_save_config_to_nvs(&cfg);
-      mqtt_apply_config_and_restart();
-
-      char *ack;
-      asprintf(&ack, "{\"ok\":true,\"type\":\"set_mqtt\",\"uri\":\"%s\",\"base\":\"%s\"}", cfg.uri, cfg.base_topic);
-      broadcast_message(ack);
-      free(ack);
-    }
-    goto end;
-  }
-
-  // ----- MQTT: get config (no password echoed) -----
-  if (strcmp("get_mqtt", command) == 0) {
-    mqtt_config_t cfg;
-    mqtt_get_config(&cfg);
-    char *msg;
-    asprintf(&msg, "{\"type\":\"mqtt_info\",\"uri\":\"%s\",\"username\":\"%s\",\"base\":\"%s\"}",
-             cfg.uri, cfg.username, cfg.base_topic);
-    broadcast_message(msg);
-    free(msg);
-    goto end;
-  }
-
-  // ----- MQTT: clear config -----
-  if (strcmp("clear_mqtt", command) == 0) {
-    mqtt_config_t cfg; memset(&cfg, 0, sizeof(cfg));
-    mqtt_save_config_to_nvs(&cfg);
-    mqtt_apply_config_and_restart();
-    char *ack;
-    asprintf(&ack, "{\"ok\":true,\"type\":\"clear_mqtt\"}");
-    broadcast_message(ack);
-    free(ack);
-    goto end;
-  }
-
-  // ----- Speed limits -----
-  if (strcmp("update_max", command) == 0) {
-    cJSON* parameters = cJSON_GetObjectItem(root, "parameters");
-    if (parameters == NULL) {
-      goto end;
-    }
-
-    cJSON *max_forward_node = cJSON_GetObjectItem(parameters, "max_forward");
-    cJSON *max_backward_node = cJSON_GetObjectItem(parameters, "max_backward");
-    if (!cJSON_IsNumber(max_forward_node) || !cJSON_IsNumber(max_backward_node)) {
-      goto end;
-    }
-
-    max_forward = max_forward_node->valuedouble;
-    max_backward = max_backward_node->valuedouble;
-
-    writeFloat("max_forward", max_forward);
-    writeFloat("max_backward", max_backward);
-
-    broadcast_all_values();
-    goto end;
-  }
-
-  // ----- Emergency stop -----
-  if (strcmp("emergency_stop", command) == 0) {
-    cJSON* parameters = cJSON_GetObjectItem(root, "parameters");
-    if (parameters == NULL) {
-      goto end;
-    }
-
-    cJSON *active_node = cJSON_GetObjectItem(parameters, "active");
-    if (!cJSON_IsBool(active_node)) {
-      goto end;
-    }
-
-    emergency_stop = cJSON_IsTrue(active_node);
-    if (emergency_stop) {
-      current_speed = 0;
-      send_values_to_motor(current_speed);
-    }
-
-    broadcast_all_values();
-    goto end;
-  }
+// Replies go to every UI, like the state broadcasts
+static void ws_reply(const char *json, size_t len) {
+  broadcast_message((char *)json);
+  latency_stop(LATENCY_COMMAND_TO_ACK);
+}
 
-end:
-  cJSON_Delete(root);
+static void data_received(httpd_ws_frame_t* ws_pkt) {
+  ESP_LOGD(TAG, "Received packet with message: %.*s", (int)ws_pkt->len, ws_pkt->payload);
+  // Only emergency_stop stops its probe, commands are run synchronously
+  latency_start(LATENCY_COMMAND_TO_ACK);
+  latency_start(LATENCY_ESTOP_TO_DUTY);
+  commands_dispatch_message((const char *)ws_pkt->payload, ws_pkt->len, ws_reply);
+  latency_cancel(LATENCY_ESTOP_TO_DUTY);
+  latency_cancel(LATENCY_COMMAND_TO_ACK);
 }
 
 // **********
@@ -337,10 +218,8 @@ void setup_pwm() {
 // *****************
 
 void setup_driving(void) {
-  // Retrieve max values from storage
-  readFloat("max_forward", &max_forward, DEFAULT_FORWARD_MAX_SPEED);
-  readFloat("max_backward", &max_backward, DEFAULT_BACKWARD_MAX_SPEED);
-  readUInt64("total_runtime_s", &total_runtime_s, 0);
+  // Speed limits are read from the settings as they are needed
+  total_runtime_s = setting_total_runtime_s();
 
   // Setup pins
   setup_pin();
@@ -377,10 +256,12 @@ int get_speed_target(uint8_t forward_position, uint8_t backward_position) {
   }
   
   if (forward_position) {
+    float max_forward = setting_max_forward();
     return min(max_forward, max_forward * (forward_position / 100.0f));
   } 
 
   // Backward is negative values
+  float max_backward = setting_max_backward();
   return max(-max_backward, -max_backward * (backward_position / 100.0f));
 }
 
@@ -427,12 +308,16 @@ static void drive_task(void *pvParameter) {
   int64_t last_update = esp_timer_get_time();
   float target = 0.0f;
   float delta = 0.0f;
+  uint8_t last_forward = 0;
+  uint8_t last_backward = 0;
 
   while (true) {
     if (emergency_stop) {
       current_speed = 0;
       send_values_to_motor(current_speed);
       blink_led_running(current_speed);
+      // Pedals are ignored, a pending pedal probe would never stop
+      latency_cancel(LATENCY_PEDAL_TO_DUTY);
       vTaskDelay(20 / portTICK_PERIOD_MS);
       continue;
     }
@@ -446,6 +331,18 @@ static void drive_task(void *pvParameter) {
     buttons_read_pedals(&forward_position, &backward_position);
     #endif
 
+    #if WITH_LATENCY_BENCH
+    if (bench_pedal_active) {
+      forward_position = bench_pedal > 0 ? bench_pedal : 0;
+      backward_position = bench_pedal < 0 ? -bench_pedal : 0;
+    }
+    #endif
+    if (forward_position != last_forward || backward_position != last_backward) {
+      latency_start(LATENCY_PEDAL_TO_DUTY);
+      last_forward = forward_position;
+      last_backward = backward_position;
+    }
+
     // Update targeted speed accordingly
     target = get_speed_target(forward_position, backward_position);
 
@@ -454,10 +351,17 @@ static void drive_task(void *pvParameter) {
     delta = (esp_timer_get_time() - last_update) / 1000;
 
     // Compute next speed based on current speed and targeted speed
+    float previous_speed = current_speed;
     current_speed = compute_next_speed(current_speed, target, delta);
+    if (lroundf(previous_speed / STATE_SPEED_STEP) != lroundf(current_speed / STATE_SPEED_STEP)) {
+      state_changed();
+    }
 
-    // Send value to the motor
-    send_values_to_motor(current_speed);
+    // Send value to the motor. At the target with the duty unchanged (speed
+    // limit reached or 0), the pedal change moved nothing, drop its probe.
+    if (!send_values_to_motor(current_speed) && current_speed == target) {
+      latency_cancel(LATENCY_PEDAL_TO_DUTY);
+    }
 
     last_update = esp_timer_get_time();
 
@@ -487,11 +391,12 @@ static void runtime_task(void *pvParameter) {
     if (fabsf(current_speed) >= 1.0f && !emergency_stop) {
       total_runtime_s++;
       acc_save++;
+      state_changed();
     }
 
     // Persist every RUNTIME_SAVE_PERIOD_S seconds
     if (acc_save >= RUNTIME_SAVE_PERIOD_S) {
-      writeUInt64("total_runtime_s", total_runtime_s);
+      setting_set_total_runtime_s(total_runtime_s);
       acc_save = 0;
 
       // Optional: broadcast an update so UI/MQTT can reflect it
@@ -536,7 +441,11 @@ static void buttons_read_pedals(uint8_t* forward_position, uint8_t* backward_pos
 }
 #endif
 
-static void send_values_to_motor(float speed) {
+// True when the duty changed
+static bool send_values_to_motor(float speed) {
+  static uint32_t last_forward_duty = 0;
+  static uint32_t last_backward_duty = 0;
+
   float forward_duty_fraction = 0.0f;
   float backward_duty_fraction = 0.0f;
 
@@ -555,6 +464,14 @@ static void send_values_to_motor(float speed) {
 
   ESP_ERROR_CHECK(ledc_set_duty(LEDC_HIGH_SPEED_MODE, MOTOR_PWM_CHANNEL_BACKWARD, backward_duty));
   ESP_ERROR_CHECK(ledc_update_duty(LEDC_HIGH_SPEED_MODE, MOTOR_PWM_CHANNEL_BACKWARD));
+
+  if (forward_duty == last_forward_duty && backward_duty == last_backward_duty) {
+    return false;
+  }
+  latency_stop(LATENCY_PEDAL_TO_DUTY);
+  last_forward_duty = forward_duty;
+  last_backward_duty = backward_duty;
+  return true;
 }
 
 static void blink_led_running(float speed) {
@@ -590,14 +507,18 @@ static void broadcast_sta_status(void) {
     }
   }
 
+  // "t" comes back with the pong command, for the radio profile round trips
   char *msg;
-  asprintf(&msg, "{\"type\":\"sta_status\",\"connected\":%s,\"ip\":\"%s\"}",
-           connected ? "true" : "false", ipstr);
+  asprintf(&msg, "{\"type\":\"sta_status\",\"connected\":%s,\"ip\":\"%s\",\"connect_ms\":%u,\"cached_ap\":%s,\"t\":%llu}",
+           connected ? "true" : "false", ipstr, (unsigned)wifi_connect_time_ms(),
+           wifi_connected_to_cached_ap() ? "true" : "false", (unsigned long long)esp_timer_get_time());
   broadcast_message(msg);
   free(msg);
 }
 
 static void sta_status_task(void *pvParameter) {
+  // Driving starts before the network
+  boot_wait(BOOT_WIFI, UINT32_MAX);
   while (true) {
     broadcast_sta_status();
     vTaskDelay(2000 / portTICK_PERIOD_MS);
@@ -615,12 +536,88 @@ static void sta_status_task(void *pvParameter) {
 //   "max_backward": 50,
 //   "emergency_stop": false
 //}
-broadcast_all_values() {
+static void broadcast_all_values(void) {
   char *message;
   char *format = "{\"current_speed\":%f,\"max_forward\":%f,\"max_backward\":%f,\"emergency_stop\":%s,\"total_runtime_s\":%llu}";
-  asprintf(&message, format, current_speed, max_forward, max_backward,
+  asprintf(&message, format, current_speed, setting_max_forward(), setting_max_backward(),
            emergency_stop ? "true" : "false", (unsigned long long)total_runtime_s);
-  ESP_LOGI(TAG, "Send %s", message);
+  ESP_LOGD(TAG, "Send %s", message);
   broadcast_message(message);
   free(message);
 }
+
+static void broadcast_speed_task(void *pvParameter) {
+  while (true) {
+    broadcast_all_values();
+    vTaskDelay(BROADCAST_PERIOD_MS / portTICK_PERIOD_MS);
+  }
+}
+
+// ***************
+// **** STATE
+// ***************
+
+static void state_changed(void) {
+  // Written after the values, so a reader never pairs a version with
+  // values older than it
+  __atomic_fetch_add(&state_version, 1, __ATOMIC_RELEASE);
+  latency_start(LATENCY_STATE_TO_MQTT);
+}
+
+void power_wheel_config_changed(void) {
+  __atomic_fetch_add(&config_version, 1, __ATOMIC_RELEASE);
+}
+
+void power_wheel_get_state(power_wheel_state_t *out) {
+  out->version = __atomic_load_n(&state_version, __ATOMIC_ACQUIRE);
+  out->current_speed = current_speed;
+  out->max_forward = setting_max_forward();
+  out->max_backward = setting_max_backward();
+  out->emergency_stop = emergency_stop;
+  out->total_runtime_s = total_runtime_s;
+}
+
+uint32_t power_wheel_config_version(void) {
+  return __atomic_load_n(&config_version, __ATOMIC_ACQUIRE);
+}
+
+esp_err_t power_wheel_set_limits(float forward, float backward) {
+  // Both or neither
+  if (!settings_check_float(SETTING_max_forward, forward) ||
+      !settings_check_float(SETTING_max_backward, backward)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  setting_set_max_forward(forward);
+  setting_set_max_backward(backward);
+  power_wheel_limits_changed();
+  return ESP_OK;
+}
+
+void power_wheel_limits_changed(void) {
+  state_changed();
+  power_wheel_config_changed();
+
+  broadcast_all_values();
+}
+
+void power_wheel_set_emergency_stop(bool active) {
+  emergency_stop = active;
+  if (emergency_stop) {
+    current_speed = 0;
+    send_values_to_motor(current_speed);
+    latency_stop(LATENCY_ESTOP_TO_DUTY);
+  }
+  state_changed();
+
+  broadcast_all_values();
+}
+
+#if WITH_LATENCY_BENCH
+void power_wheel_bench_pedal(bool active, int position) {
+  bench_pedal = position < -100 ? -100 : position > 100 ? 100 : position;
+  bench_pedal_active = active;
+  // Injected now, so the wait for the next drive loop counts too
+  latency_cancel(LATENCY_PEDAL_TO_DUTY);
+  latency_start(LATENCY_PEDAL_TO_DUTY);
+}
+#endif
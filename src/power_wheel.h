@@ -1,6 +1,42 @@
 #ifndef POWER_WEEL_H
 #define POWER_WEEL_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#include "latency.h"
+
+typedef struct {
+  uint32_t version;         // changes whenever one of the values below does
+  float current_speed;      // %, negative backward
+  float max_forward;        // %
+  float max_backward;       // %
+  bool emergency_stop;
+  uint64_t total_runtime_s;
+} power_wheel_state_t;
+
 void setup_driving(void);
 
+// Snapshot of the driving state, cheap enough to poll
+void power_wheel_get_state(power_wheel_state_t *out);
+
+// Bumped when a setting (speed limits, Wi-Fi, MQTT) is changed
+uint32_t power_wheel_config_version(void);
+void power_wheel_config_changed(void);
+
+// Save new speed limits in %, ESP_ERR_INVALID_ARG out of the settings bounds
+esp_err_t power_wheel_set_limits(float max_forward, float max_backward);
+// Speed limits changed in the settings directly
+void power_wheel_limits_changed(void);
+
+// Stops the motor right away when activated
+void power_wheel_set_emergency_stop(bool active);
+
+#if WITH_LATENCY_BENCH
+// Drive as if the pedals were at position (%, negative backward) until
+// released, for tools/latency_bench.py
+void power_wheel_bench_pedal(bool active, int position);
+#endif
+
 #endif
@@ -0,0 +1,236 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_SETTINGS
+#include "logbuf.h"
+
+#include "settings.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "storage.h"
+
+// Local variables
+
+static const char *TAG = "settings";
+
+#define KEY_SETTINGS_VERSION "settings_ver"
+
+#define SETTING_INFO_FLOAT(name, key, def, min, max, group, flags) \
+  [SETTING_##name] = { #name, key, SETTING_FLOAT, group, flags, min, max, 0 },
+#define SETTING_INFO_UINT64(name, key, def, group, flags) \
+  [SETTING_##name] = { #name, key, SETTING_UINT64, group, flags, 0, 0, 0 },
+#define SETTING_INFO_STRING(name, key, size, def, group, flags) \
+  [SETTING_##name] = { #name, key, SETTING_STRING, group, flags, 0, 0, size },
+const setting_info_t SETTINGS_INFO[SETTING_COUNT] = {
+  SETTINGS_SCHEMA(SETTING_INFO_FLOAT, SETTING_INFO_UINT64, SETTING_INFO_STRING)
+};
+
+#define SETTING_DEFAULT_FLOAT(name, key, def, min, max, group, flags) .name = def,
+#define SETTING_DEFAULT_UINT64(name, key, def, group, flags) .name = def,
+#define SETTING_DEFAULT_STRING(name, key, size, def, group, flags) .name = def,
+static const settings_t DEFAULTS = {
+  SETTINGS_SCHEMA(SETTING_DEFAULT_FLOAT, SETTING_DEFAULT_UINT64, SETTING_DEFAULT_STRING)
+};
+
+#define SETTING_OFFSET_FLOAT(name, key, def, min, max, group, flags) [SETTING_##name] = offsetof(settings_t, name),
+#define SETTING_OFFSET_UINT64(name, key, def, group, flags) [SETTING_##name] = offsetof(settings_t, name),
+#define SETTING_OFFSET_STRING(name, key, size, def, group, flags) [SETTING_##name] = offsetof(settings_t, name),
+static const size_t OFFSETS[SETTING_COUNT] = {
+  SETTINGS_SCHEMA(SETTING_OFFSET_FLOAT, SETTING_OFFSET_UINT64, SETTING_OFFSET_STRING)
+};
+
+settings_t settings_values;
+
+static SemaphoreHandle_t mutex = NULL;
+
+// Implementations
+
+static void *value_of(settings_t *settings, setting_id_t id) {
+  return (uint8_t *)settings + OFFSETS[id];
+}
+
+bool settings_check_float(setting_id_t id, float value) {
+  const setting_info_t *info = &SETTINGS_INFO[id];
+  return info->type == SETTING_FLOAT && !isnan(value) && value >= info->min && value <= info->max;
+}
+
+bool settings_check_string(setting_id_t id, const char *value) {
+  const setting_info_t *info = &SETTINGS_INFO[id];
+  return info->type == SETTING_STRING && value != NULL && strlen(value) < info->size;
+}
+
+// Brings settings stored by an older firmware to SETTINGS_VERSION, one
+// version at a time
+static void migrate(uint64_t from) {
+  switch (from) {
+    case 0:
+      // Written before the schema with the same keys and types, but never
+      // bounds checked: loading replaced anything out of bounds already
+      /* fall through */
+    default:
+      break;
+  }
+}
+
+static void load(setting_id_t id) {
+  const setting_info_t *info = &SETTINGS_INFO[id];
+  void *value = value_of(&settings_values, id);
+  const void *def = value_of((settings_t *)&DEFAULTS, id);
+  bool valid = true;
+
+  switch (info->type) {
+    case SETTING_FLOAT:
+      readFloat((char *)info->key, value, *(const float *)def);
+      valid = settings_check_float(id, *(float *)value);
+      break;
+    case SETTING_UINT64:
+      readUInt64(info->key, value, *(const uint64_t *)def);
+      break;
+    case SETTING_STRING:
+      readString(info->key, value, info->size, def);
+      break;
+  }
+
+  if (!valid) {
+    ESP_LOGW(TAG, "%s out of bounds, back to the default", info->name);
+    settings_set_float(id, *(const float *)def);
+  }
+}
+
+void setup_settings(void) {
+  mutex = xSemaphoreCreateMutex();
+  settings_values = DEFAULTS;
+
+  for (setting_id_t id = 0; id < SETTING_COUNT; ++id) {
+    load(id);
+  }
+
+  uint64_t version;
+  readUInt64(KEY_SETTINGS_VERSION, &version, 0);
+  if (version != SETTINGS_VERSION) {
+    ESP_LOGI(TAG, "Migrating settings from version %u", (unsigned)version);
+    migrate(version);
+    writeUInt64(KEY_SETTINGS_VERSION, SETTINGS_VERSION);
+  }
+}
+
+esp_err_t settings_set_float(setting_id_t id, float value) {
+  if (!settings_check_float(id, value)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  float *current = value_of(&settings_values, id);
+  if (*current == value) {
+    return ESP_OK;
+  }
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  *current = value;
+  xSemaphoreGive(mutex);
+
+  return writeFloat((char *)SETTINGS_INFO[id].key, value);
+}
+
+esp_err_t settings_set_uint64(setting_id_t id, uint64_t value) {
+  if (SETTINGS_INFO[id].type != SETTING_UINT64) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  uint64_t *current = value_of(&settings_values, id);
+  if (*current == value) {
+    return ESP_OK;
+  }
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  *current = value;
+  xSemaphoreGive(mutex);
+
+  return writeUInt64(SETTINGS_INFO[id].key, value);
+}
+
+esp_err_t settings_set_string(setting_id_t id, const char *value) {
+  if (!settings_check_string(id, value)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  char *current = value_of(&settings_values, id);
+  if (strcmp(current, value) == 0) {
+    return ESP_OK;
+  }
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  strcpy(current, value);
+  xSemaphoreGive(mutex);
+
+  return writeString(SETTINGS_INFO[id].key, value);
+}
+
+// Append to out at *pos, false once it doesn't fit
+static bool append(char *out, size_t out_len, size_t *pos, const char *format, ...) __attribute__((format(printf, 4, 5)));
+static bool append(char *out, size_t out_len, size_t *pos, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(out + *pos, out_len - *pos, format, args);
+  va_end(args);
+  if (len < 0 || (size_t)len >= out_len - *pos) {
+    return false;
+  }
+  *pos += len;
+  return true;
+}
+
+static bool append_string(char *out, size_t out_len, size_t *pos, const char *value) {
+  if (!append(out, out_len, pos, "\"")) {
+    return false;
+  }
+  for (; *value; ++value) {
+    unsigned char c = *value;
+    bool ok;
+    if (c == '"' || c == '\\') {
+      ok = append(out, out_len, pos, "\\%c", c);
+    } else if (c < 0x20) {
+      ok = append(out, out_len, pos, "\\u%04x", c);
+    } else {
+      ok = append(out, out_len, pos, "%c", c);
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return append(out, out_len, pos, "\"");
+}
+
+size_t settings_serialize(char *out, size_t out_len, uint8_t flags) {
+  size_t pos = 0;
+  bool ok = append(out, out_len, &pos, "{");
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  for (setting_id_t id = 0; id < SETTING_COUNT && ok; ++id) {
+    const setting_info_t *info = &SETTINGS_INFO[id];
+    if (!(info->flags & flags) || (info->flags & SETTING_SECRET)) {
+      continue;
+    }
+
+    const void *value = value_of(&settings_values, id);
+    ok = append(out, out_len, &pos, "%s\"%s\":", pos > 1 ? "," : "", info->name);
+    switch (info->type) {
+      case SETTING_FLOAT:
+        ok = ok && append(out, out_len, &pos, "%.1f", *(const float *)value);
+        break;
+      case SETTING_UINT64:
+        ok = ok && append(out, out_len, &pos, "%llu", (unsigned long long)*(const uint64_t *)value);
+        break;
+      case SETTING_STRING:
+        ok = ok && append_string(out, out_len, &pos, value);
+        break;
+    }
+  }
+  xSemaphoreGive(mutex);
+
+  if (!ok || !append(out, out_len, &pos, "}")) {
+    ESP_LOGW(TAG, "Settings don't fit in %u bytes", (unsigned)out_len);
+    return 0;
+  }
+  return pos;
+}
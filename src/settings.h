@@ -0,0 +1,127 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+// Every persisted setting, described once. Each entry becomes a member of
+// settings_t, loaded from NVS at boot, typed accessors, bounds checks and a
+// JSON member named after the setting. NVS keys (15 characters at most)
+// must not change: bump SETTINGS_VERSION and migrate in settings.c instead.
+//
+//   FLOAT(name, key, default, min, max, group, flags)
+//   UINT64(name, key, default, group, flags)
+//   STRING(name, key, size, default, group, flags), size with the terminator
+
+#define SETTINGS_SCHEMA(FLOAT, UINT64, STRING) \
+  FLOAT(max_forward, "max_forward", 60, 0, 100, SETTINGS_DRIVE, SETTING_UI | SETTING_MQTT) \
+  FLOAT(max_backward, "max_backward", 35, 0, 100, SETTINGS_DRIVE, SETTING_UI | SETTING_MQTT) \
+  UINT64(total_runtime_s, "total_runtime_s", 0, SETTINGS_FIRMWARE, 0) \
+  UINT64(boot_count, "boot_count", 0, SETTINGS_FIRMWARE, 0) \
+  STRING(sta_ssid, "sta_ssid", 33, "", SETTINGS_STA, SETTING_UI) \
+  STRING(sta_pass, "sta_pass", 65, "", SETTINGS_STA, SETTING_SECRET) \
+  UINT64(sta_bssid, "sta_bssid", 0, SETTINGS_FIRMWARE, 0) /* AP of the last connection, 0 for none */ \
+  UINT64(sta_channel, "sta_channel", 0, SETTINGS_FIRMWARE, 0) \
+  UINT64(sta_ip, "sta_ip", 0, SETTINGS_FIRMWARE, 0) /* its lease, network byte order */ \
+  UINT64(sta_netmask, "sta_netmask", 0, SETTINGS_FIRMWARE, 0) \
+  UINT64(sta_gw, "sta_gw", 0, SETTINGS_FIRMWARE, 0) \
+  UINT64(sta_dns, "sta_dns", 0, SETTINGS_FIRMWARE, 0) \
+  STRING(mqtt_uri, "mqtt_uri", 128, "mqtt://192.168.1.10:1883", SETTINGS_MQTT, SETTING_UI) \
+  STRING(mqtt_user, "mqtt_user", 64, "", SETTINGS_MQTT, SETTING_UI) \
+  STRING(mqtt_pass, "mqtt_pass", 64, "", SETTINGS_MQTT, SETTING_SECRET) \
+  STRING(mqtt_base, "mqtt_base", 64, "powerbentley", SETTINGS_MQTT, SETTING_UI) \
+  STRING(radio_profile, "radio_profile", 16, "balanced", SETTINGS_RADIO, SETTING_MQTT) /* see wifi.h */
+
+// Stored in NVS, older values are migrated at boot
+#define SETTINGS_VERSION 1
+
+// What has to be applied again when one of its settings changes
+typedef enum {
+  SETTINGS_DRIVE,    // speed limits, power_wheel.c
+  SETTINGS_STA,      // Wi-Fi station, wifi.c
+  SETTINGS_MQTT,     // broker, mqtt.c
+  SETTINGS_RADIO,    // Wi-Fi power and latency, wifi.c, set by name with the radio command
+  SETTINGS_FIRMWARE, // kept by the firmware itself: counters, caches
+} settings_group_t;
+
+#define SETTING_UI     0x01 // in /api/config, set by the set_config command
+#define SETTING_MQTT   0x02 // in the retained <base>/config message
+#define SETTING_SECRET 0x04 // set by set_config, never serialized
+
+typedef enum {
+  SETTING_FLOAT,
+  SETTING_UINT64,
+  SETTING_STRING,
+} setting_type_t;
+
+#define SETTING_ID_FLOAT(name, key, def, min, max, group, flags) SETTING_##name,
+#define SETTING_ID_UINT64(name, key, def, group, flags) SETTING_##name,
+#define SETTING_ID_STRING(name, key, size, def, group, flags) SETTING_##name,
+typedef enum {
+  SETTINGS_SCHEMA(SETTING_ID_FLOAT, SETTING_ID_UINT64, SETTING_ID_STRING)
+  SETTING_COUNT
+} setting_id_t;
+#undef SETTING_ID_FLOAT
+#undef SETTING_ID_UINT64
+#undef SETTING_ID_STRING
+
+#define SETTING_MEMBER_FLOAT(name, key, def, min, max, group, flags) float name;
+#define SETTING_MEMBER_UINT64(name, key, def, group, flags) uint64_t name;
+#define SETTING_MEMBER_STRING(name, key, size, def, group, flags) char name[size];
+typedef struct {
+  SETTINGS_SCHEMA(SETTING_MEMBER_FLOAT, SETTING_MEMBER_UINT64, SETTING_MEMBER_STRING)
+} settings_t;
+#undef SETTING_MEMBER_FLOAT
+#undef SETTING_MEMBER_UINT64
+#undef SETTING_MEMBER_STRING
+
+typedef struct {
+  const char *name; // JSON member
+  const char *key;  // NVS key
+  setting_type_t type;
+  settings_group_t group;
+  uint8_t flags;
+  float min, max;   // floats only
+  size_t size;      // strings only
+} setting_info_t;
+
+extern const setting_info_t SETTINGS_INFO[SETTING_COUNT];
+
+// Loaded by setup_settings(), read through the accessors below. Strings
+// change in place, copy them when a concurrent change would matter.
+extern settings_t settings_values;
+
+// Load every setting, call once after setup_storage()
+void setup_settings(void);
+
+// Bounds checked, ESP_ERR_INVALID_ARG when out of them. Values are written
+// behind to NVS, see storage.h.
+esp_err_t settings_set_float(setting_id_t id, float value);
+esp_err_t settings_set_uint64(setting_id_t id, uint64_t value);
+esp_err_t settings_set_string(setting_id_t id, const char *value);
+bool settings_check_float(setting_id_t id, float value);
+bool settings_check_string(setting_id_t id, const char *value);
+
+// JSON object of the settings with any of flags, secrets left out. Returns
+// the length, 0 when it doesn't fit.
+size_t settings_serialize(char *out, size_t out_len, uint8_t flags);
+
+// Typed accessors: setting_max_forward(), setting_set_max_forward(60)...
+
+#define SETTING_ACCESSORS_FLOAT(name, key, def, min, max, group, flags) \
+  static inline float setting_##name(void) { return settings_values.name; } \
+  static inline esp_err_t setting_set_##name(float value) { return settings_set_float(SETTING_##name, value); }
+#define SETTING_ACCESSORS_UINT64(name, key, def, group, flags) \
+  static inline uint64_t setting_##name(void) { return settings_values.name; } \
+  static inline esp_err_t setting_set_##name(uint64_t value) { return settings_set_uint64(SETTING_##name, value); }
+#define SETTING_ACCESSORS_STRING(name, key, size, def, group, flags) \
+  static inline const char *setting_##name(void) { return settings_values.name; } \
+  static inline esp_err_t setting_set_##name(const char *value) { return settings_set_string(SETTING_##name, value); }
+SETTINGS_SCHEMA(SETTING_ACCESSORS_FLOAT, SETTING_ACCESSORS_UINT64, SETTING_ACCESSORS_STRING)
+#undef SETTING_ACCESSORS_FLOAT
+#undef SETTING_ACCESSORS_UINT64
+#undef SETTING_ACCESSORS_STRING
+
+#endif
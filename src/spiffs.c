@@ -1,42 +1,195 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_SPIFFS
+#include "logbuf.h"
+
 #include "spiffs.h"
 
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "esp_log.h"
 #include "esp_err.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#if WITH_LITTLEFS
+#include "esp_littlefs.h"
+#else
 #include "esp_spiffs.h"
+#endif
 
 static const char *TAG = "spiffs";
 
+// Benchmark workload
+#define BENCH_FILES 16
+#define BENCH_FILE_SIZE 512
+#define BENCH_STATS 64
+#define BENCH_READ_SIZE (32 * 1024)
+#define BENCH_CHUNK 1024
+
 // File system on which is stored the webpage
 
-esp_err_t setup_spiffs(void) {
-    ESP_LOGI(TAG, "Initializing SPIFFS");
+#if WITH_LITTLEFS
+
+static esp_err_t mount(void) {
+    esp_vfs_littlefs_conf_t conf = {
+      .base_path = SPIFFS_BASE_PATH,
+      .partition_label = SPIFFS_PARTITION_LABEL,
+      .format_if_mount_failed = true
+    };
+    return esp_vfs_littlefs_register(&conf);
+}
+
+static esp_err_t get_info(size_t *total, size_t *used) {
+    return esp_littlefs_info(SPIFFS_PARTITION_LABEL, total, used);
+}
+
+static esp_err_t unmount(void) {
+    return esp_vfs_littlefs_unregister(SPIFFS_PARTITION_LABEL);
+}
 
+#else
+
+static esp_err_t mount(void) {
     esp_vfs_spiffs_conf_t conf = {
       .base_path = SPIFFS_BASE_PATH,
-      .partition_label = NULL,
+      .partition_label = SPIFFS_PARTITION_LABEL,
       .max_files = SPIFFS_MAX_FILES,
       .format_if_mount_failed = true
     };
+    return esp_vfs_spiffs_register(&conf);
+}
+
+static esp_err_t get_info(size_t *total, size_t *used) {
+    return esp_spiffs_info(SPIFFS_PARTITION_LABEL, total, used);
+}
+
+static esp_err_t unmount(void) {
+    return esp_vfs_spiffs_unregister(SPIFFS_PARTITION_LABEL);
+}
 
-    esp_err_t ret = esp_vfs_spiffs_register(&conf);
+#endif
+
+esp_err_t setup_spiffs(void) {
+    ESP_LOGI(TAG, "Initializing %s", SPIFFS_BACKEND);
+
+    esp_err_t ret = mount();
     if (ret != ESP_OK) {
         if (ret == ESP_FAIL) {
             ESP_LOGE(TAG, "Failed to mount or format filesystem");
         } else if (ret == ESP_ERR_NOT_FOUND) {
-            ESP_LOGE(TAG, "Failed to find SPIFFS partition");
+            ESP_LOGE(TAG, "Failed to find %s partition", SPIFFS_PARTITION_LABEL);
         } else {
-            ESP_LOGE(TAG, "Failed to initialize SPIFFS (%s)", esp_err_to_name(ret));
+            ESP_LOGE(TAG, "Failed to initialize %s (%s)", SPIFFS_BACKEND, esp_err_to_name(ret));
         }
         return ESP_FAIL;
     }
 
     size_t total = 0, used = 0;
-    ret = esp_spiffs_info(NULL, &total, &used);
+    ret = get_info(&total, &used);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
+        ESP_LOGE(TAG, "Failed to get %s partition information (%s)", SPIFFS_BACKEND, esp_err_to_name(ret));
         return ESP_FAIL;
     }
 
     ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
     return ESP_OK;
 }
+
+// Release the partition, e.g. before writing a whole new image to it
+esp_err_t unmount_spiffs(void) {
+    ESP_LOGI(TAG, "Unmounting %s", SPIFFS_BACKEND);
+    return unmount();
+}
+
+static void bench_path(char *path, size_t len, int i) {
+    snprintf(path, len, SPIFFS_BASE_PATH "/.bench%d", i);
+}
+
+static uint32_t elapsed_since(int64_t start) {
+    return (uint32_t)(esp_timer_get_time() - start);
+}
+
+esp_err_t spiffs_benchmark(spiffs_bench_t *out) {
+    static char buffer[BENCH_CHUNK];
+    char path[32];
+    esp_err_t ret = ESP_OK;
+    memset(out, 0, sizeof(*out));
+    memset(buffer, 0xa5, sizeof(buffer));
+
+    // Small files, like settings or uploaded assets
+    uint64_t total = 0;
+    for (int i = 0; i < BENCH_FILES; ++i) {
+        bench_path(path, sizeof(path), i);
+        int64_t start = esp_timer_get_time();
+        FILE *fd = fopen(path, "w");
+        if (fd == NULL) {
+            ret = ESP_FAIL;
+            break;
+        }
+        size_t written = fwrite(buffer, 1, BENCH_FILE_SIZE, fd);
+        fclose(fd);
+        uint32_t elapsed = elapsed_since(start);
+        if (written != BENCH_FILE_SIZE) {
+            ret = ESP_FAIL;
+            break;
+        }
+        total += elapsed;
+        if (elapsed > out->write_max) {
+            out->write_max = elapsed;
+        }
+    }
+    out->write_avg = total / BENCH_FILES;
+
+    // Half of the lookups miss, like the .gz probe of every download
+    total = 0;
+    struct stat st;
+    for (int i = 0; i < BENCH_STATS && ret == ESP_OK; ++i) {
+        bench_path(path, sizeof(path), esp_random() % (2 * BENCH_FILES));
+        int64_t start = esp_timer_get_time();
+        stat(path, &st);
+        uint32_t elapsed = elapsed_since(start);
+        total += elapsed;
+        if (elapsed > out->stat_max) {
+            out->stat_max = elapsed;
+        }
+    }
+    out->stat_avg = total / BENCH_STATS;
+
+    // One larger file written then read back in chunks
+    bench_path(path, sizeof(path), BENCH_FILES);
+    FILE *fd = ret == ESP_OK ? fopen(path, "w") : NULL;
+    if (fd) {
+        for (int i = 0; i < BENCH_READ_SIZE / BENCH_CHUNK; ++i) {
+            fwrite(buffer, 1, BENCH_CHUNK, fd);
+        }
+        fclose(fd);
+
+        int64_t start = esp_timer_get_time();
+        fd = fopen(path, "r");
+        size_t read_len = 0, len;
+        while (fd && (len = fread(buffer, 1, BENCH_CHUNK, fd)) > 0) {
+            read_len += len;
+        }
+        if (fd) {
+            fclose(fd);
+        }
+        uint32_t elapsed = elapsed_since(start);
+        out->read_kbps = elapsed ? (uint64_t)read_len * 1000000 / 1024 / elapsed : 0;
+    } else {
+        ret = ESP_FAIL;
+    }
+
+    total = 0;
+    for (int i = 0; i <= BENCH_FILES; ++i) {
+        bench_path(path, sizeof(path), i);
+        int64_t start = esp_timer_get_time();
+        unlink(path);
+        total += elapsed_since(start);
+    }
+    out->remove_avg = total / (BENCH_FILES + 1);
+
+    ESP_LOGI(TAG, "Benchmark %s: write %u/%u us, stat %u/%u us, read %u KB/s",
+             SPIFFS_BACKEND, (unsigned)out->write_avg, (unsigned)out->write_max,
+             (unsigned)out->stat_avg, (unsigned)out->stat_max, (unsigned)out->read_kbps);
+    return ret;
+}
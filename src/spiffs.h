@@ -1,11 +1,44 @@
 #ifndef SPIFFS_H
 #define SPIFFS_H
 
+#include <stdint.h>
 #include "esp_err.h"
 
+// Mount LittleFS instead of SPIFFS on the storage partition. Paths stay
+// under SPIFFS_BASE_PATH so the rest of the firmware doesn't change. Also
+// set board_build.filesystem = littlefs (PlatformIO) or -DWITH_LITTLEFS=1
+// (CMake) so the filesystem image is built for the same backend.
+#ifndef WITH_LITTLEFS
+#define WITH_LITTLEFS 0
+#endif
+
 esp_err_t setup_spiffs(void);
+esp_err_t unmount_spiffs(void);
 
 #define SPIFFS_BASE_PATH "/spiffs"
+#define SPIFFS_PARTITION_LABEL "storage"
 #define SPIFFS_MAX_FILES 10 // This decides the maximum number of files that can be created on the storage
 
-#endif
\ No newline at end of file
+#if WITH_LITTLEFS
+#define SPIFFS_BACKEND "littlefs"
+#define SPIFFS_OBJ_NAME_LEN CONFIG_LITTLEFS_OBJ_NAME_LEN
+#else
+#define SPIFFS_BACKEND "spiffs"
+#define SPIFFS_OBJ_NAME_LEN CONFIG_SPIFFS_OBJ_NAME_LEN
+#endif
+
+// Timings of spiffs_benchmark(), in microseconds unless stated otherwise
+typedef struct {
+  uint32_t write_avg;     // create, write and close one small file
+  uint32_t write_max;     // worst case of the above, garbage collection shows here
+  uint32_t stat_avg;      // stat of a random existing or missing file
+  uint32_t stat_max;
+  uint32_t read_kbps;     // sequential read throughput in KB/s
+  uint32_t remove_avg;
+} spiffs_bench_t;
+
+// Exercise the mounted filesystem with scratch files, removed afterwards.
+// Takes a few seconds.
+esp_err_t spiffs_benchmark(spiffs_bench_t *out);
+
+#endif
@@ -0,0 +1,512 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_SPOOL
+#include "logbuf.h"
+
+#include "spool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+
+#include "settings.h"
+#include "storage.h"
+
+// Local variables
+
+static const char *TAG = "spool";
+
+// Seconds since epoch below this mean the clock was never set
+#define CLOCK_SET_AFTER 1600000000
+
+#define SECTOR_MAGIC 0x314c5053 // "SPL1"
+
+#define RECORD_WALL_CLOCK 0x01
+// Flash state byte, cleared on the last record of each replayed batch.
+// Replay is in order, so everything before a sent record was sent too.
+#define RECORD_PENDING 0xff
+#define RECORD_SENT 0x00
+#define RECORD_END 0xffff // len of erased flash
+
+typedef struct {
+  uint16_t len;
+  uint8_t flags;
+  uint8_t state;
+  uint32_t boot;
+  int64_t timestamp_ms;
+} record_header_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+} sector_header_t;
+
+typedef struct {
+  uint32_t sector;
+  uint32_t offset;
+} flash_pos_t;
+
+#define RECORD_MAX_SIZE (sizeof(record_header_t) + SPOOL_RECORD_MAX_LEN)
+
+static SemaphoreHandle_t mutex = NULL;
+static spool_policy_t policy = SPOOL_DROP_POLICY;
+static uint32_t boot_count = 0;
+static uint32_t dropped = 0;
+// Bumped whenever records move or go, a batch peeked before is then stale
+static uint32_t generation = 0;
+
+// RAM ring, records wrap around the end
+static uint8_t ram[SPOOL_RAM_SIZE];
+static size_t ram_head = 0;
+static size_t ram_used = 0;
+static uint32_t ram_records = 0;
+
+// Flash ring of sectors, older than everything in RAM. The read position is
+// the oldest pending record and equals the write position when none are.
+static const esp_partition_t *partition = NULL;
+static uint32_t sector_count = 0;
+static uint32_t write_seq = 0;
+static flash_pos_t write_pos;
+static flash_pos_t read_pos;
+static uint32_t flash_records = 0;
+
+// Last spool_peek_batch()
+static struct {
+  uint32_t generation;
+  uint32_t ram_records;
+  size_t ram_bytes;
+  uint32_t flash_records;
+  flash_pos_t flash_last; // last record sent
+  flash_pos_t flash_end;  // after it
+} batch;
+
+// Implementations
+
+static void ram_read(size_t pos, void *data, size_t len) {
+  pos %= SPOOL_RAM_SIZE;
+  size_t first = len < SPOOL_RAM_SIZE - pos ? len : SPOOL_RAM_SIZE - pos;
+  memcpy(data, ram + pos, first);
+  memcpy((uint8_t *)data + first, ram, len - first);
+}
+
+static void ram_write(size_t pos, const void *data, size_t len) {
+  pos %= SPOOL_RAM_SIZE;
+  size_t first = len < SPOOL_RAM_SIZE - pos ? len : SPOOL_RAM_SIZE - pos;
+  memcpy(ram + pos, data, first);
+  memcpy(ram, (const uint8_t *)data + first, len - first);
+}
+
+static void ram_drop_oldest(void) {
+  record_header_t header;
+  ram_read(ram_head, &header, sizeof(header));
+  size_t size = sizeof(header) + header.len;
+  ram_head = (ram_head + size) % SPOOL_RAM_SIZE;
+  ram_used -= size;
+  ram_records--;
+}
+
+// Keep the first, the last and every other record in between
+static void ram_downsample(void) {
+  uint8_t record[RECORD_MAX_SIZE];
+  size_t src = 0, dst = 0;
+  uint32_t index = 0, kept = 0;
+
+  while (src < ram_used) {
+    record_header_t header;
+    ram_read(ram_head + src, &header, sizeof(header));
+    size_t size = sizeof(header) + header.len;
+    if (index % 2 == 0 || src + size == ram_used) {
+      if (dst != src) {
+        ram_read(ram_head + src, record, size);
+        ram_write(ram_head + dst, record, size);
+      }
+      dst += size;
+      kept++;
+    }
+    src += size;
+    index++;
+  }
+
+  ESP_LOGD(TAG, "Downsampled %u to %u records", (unsigned)ram_records, (unsigned)kept);
+  dropped += ram_records - kept;
+  ram_records = kept;
+  ram_used = dst;
+}
+
+static uint32_t flash_address(flash_pos_t pos) {
+  return pos.sector * SPI_FLASH_SEC_SIZE + pos.offset;
+}
+
+static void next_sector(flash_pos_t *pos) {
+  pos->sector = (pos->sector + 1) % sector_count;
+  pos->offset = sizeof(sector_header_t);
+}
+
+// Header of the record at pos, moving pos to the next sector when this one
+// is full. Only called while pending records are left past pos.
+static void flash_record_at(flash_pos_t *pos, record_header_t *header) {
+  if (pos->offset + sizeof(*header) <= SPI_FLASH_SEC_SIZE) {
+    esp_partition_read(partition, flash_address(*pos), header, sizeof(*header));
+    if (header->len != RECORD_END) {
+      return;
+    }
+  }
+  next_sector(pos);
+  esp_partition_read(partition, flash_address(*pos), header, sizeof(*header));
+}
+
+static bool start_sector(uint32_t sector) {
+  sector_header_t header = { .magic = SECTOR_MAGIC, .seq = write_seq + 1 };
+  esp_err_t err = esp_partition_erase_range(partition, sector * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+  if (err == ESP_OK) {
+    err = esp_partition_write(partition, sector * SPI_FLASH_SEC_SIZE, &header, sizeof(header));
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to start sector %u (%s)", (unsigned)sector, esp_err_to_name(err));
+    return false;
+  }
+  write_seq++;
+  write_pos.sector = sector;
+  write_pos.offset = sizeof(header);
+  return true;
+}
+
+static bool flash_append(const void *record, size_t size) {
+  if (write_pos.offset + size > SPI_FLASH_SEC_SIZE) {
+    uint32_t next = (write_pos.sector + 1) % sector_count;
+    if (flash_records > 0 && next == read_pos.sector) {
+      return false;
+    }
+    if (!start_sector(next)) {
+      return false;
+    }
+  }
+  if (flash_records == 0) {
+    read_pos = write_pos;
+  }
+  if (esp_partition_write(partition, flash_address(write_pos), record, size) != ESP_OK) {
+    return false;
+  }
+  write_pos.offset += size;
+  flash_records++;
+  return true;
+}
+
+// Give up the oldest flash sector with pending records
+static bool flash_drop_oldest(void) {
+  if (flash_records == 0 || read_pos.sector == write_pos.sector) {
+    return false;
+  }
+
+  uint32_t sector = read_pos.sector;
+  uint32_t count = 0;
+  flash_pos_t last;
+  record_header_t header;
+  while (read_pos.sector == sector && flash_records > count) {
+    flash_record_at(&read_pos, &header);
+    if (read_pos.sector != sector) {
+      break;
+    }
+    last = read_pos;
+    read_pos.offset += sizeof(header) + header.len;
+    count++;
+  }
+  // Marked like a replayed batch, or the next boot would count them again
+  if (count > 0) {
+    uint8_t sent = RECORD_SENT;
+    esp_partition_write(partition, flash_address(last) + offsetof(record_header_t, state), &sent, 1);
+  }
+
+  ESP_LOGD(TAG, "Dropped flash sector %u (%u records)", (unsigned)sector, (unsigned)count);
+  flash_records -= count;
+  dropped += count;
+  if (flash_records == 0) {
+    read_pos = write_pos;
+  } else if (read_pos.sector == sector) {
+    next_sector(&read_pos);
+  }
+  return true;
+}
+
+// Move the oldest RAM record to flash
+static bool spill_oldest(void) {
+  if (partition == NULL || ram_records == 0) {
+    return false;
+  }
+  uint8_t record[RECORD_MAX_SIZE];
+  record_header_t header;
+  ram_read(ram_head, &header, sizeof(header));
+  size_t size = sizeof(header) + header.len;
+  ram_read(ram_head, record, size);
+  if (!flash_append(record, size)) {
+    return false;
+  }
+  ram_drop_oldest();
+  return true;
+}
+
+static bool make_room(size_t size) {
+  while (SPOOL_RAM_SIZE - ram_used < size) {
+    generation++;
+    if (spill_oldest()) {
+      continue;
+    }
+    if (policy == SPOOL_DROP_DOWNSAMPLE && ram_records > 2) {
+      ram_downsample();
+    } else if (policy == SPOOL_DROP_OLDEST && flash_drop_oldest()) {
+      continue;
+    } else if (ram_records > 0) {
+      ram_drop_oldest();
+      dropped++;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Find the write position and the oldest pending record left by the
+// previous boots
+static void load_flash(void) {
+  uint8_t *sector = malloc(SPI_FLASH_SEC_SIZE);
+  if (sector == NULL) {
+    partition = NULL;
+    return;
+  }
+
+  // Sectors are used in ring order, the newest one is written to
+  bool found = false;
+  flash_records = 0;
+  for (uint32_t i = 0; i < sector_count; ++i) {
+    sector_header_t header;
+    esp_partition_read(partition, i * SPI_FLASH_SEC_SIZE, &header, sizeof(header));
+    if (header.magic == SECTOR_MAGIC && (!found || header.seq > write_seq)) {
+      write_seq = header.seq;
+      write_pos.sector = i;
+      found = true;
+    }
+  }
+  if (!found) {
+    write_pos.sector = sector_count - 1;
+    write_pos.offset = SPI_FLASH_SEC_SIZE;
+    read_pos = write_pos;
+    free(sector);
+    return;
+  }
+
+  bool have_read = false;
+  for (uint32_t n = 1; n <= sector_count; ++n) {
+    uint32_t i = (write_pos.sector + n) % sector_count;
+    esp_partition_read(partition, i * SPI_FLASH_SEC_SIZE, sector, SPI_FLASH_SEC_SIZE);
+    const sector_header_t *sector_header = (const sector_header_t *)sector;
+    if (sector_header->magic != SECTOR_MAGIC) {
+      continue;
+    }
+
+    uint32_t offset = sizeof(sector_header_t);
+    while (offset + sizeof(record_header_t) <= SPI_FLASH_SEC_SIZE) {
+      record_header_t header;
+      memcpy(&header, sector + offset, sizeof(header));
+      if (header.len == RECORD_END || offset + sizeof(header) + header.len > SPI_FLASH_SEC_SIZE) {
+        break;
+      }
+      if (!have_read) {
+        read_pos.sector = i;
+        read_pos.offset = offset;
+        have_read = true;
+      }
+      offset += sizeof(header) + header.len;
+      if (header.state == RECORD_SENT) {
+        flash_records = 0;
+        read_pos.sector = i;
+        read_pos.offset = offset;
+      } else {
+        flash_records++;
+      }
+    }
+    if (i == write_pos.sector) {
+      write_pos.offset = offset;
+    }
+  }
+  free(sector);
+
+  if (flash_records == 0) {
+    read_pos = write_pos;
+  }
+}
+
+static int64_t now_ms(uint8_t *flags) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec >= CLOCK_SET_AFTER) {
+    *flags |= RECORD_WALL_CLOCK;
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  }
+  return esp_timer_get_time() / 1000;
+}
+
+// Start of one batch item, up to the payload
+static int format_item(char *out, size_t out_len, const record_header_t *header) {
+  const char *key = "up";
+  int64_t timestamp = header->timestamp_ms;
+  uint8_t flags = 0;
+  int64_t now = now_ms(&flags);
+
+  if (header->flags & RECORD_WALL_CLOCK) {
+    key = "t";
+  } else if ((flags & RECORD_WALL_CLOCK) && header->boot == boot_count) {
+    // Taken before the clock was set during this boot
+    timestamp += now - esp_timer_get_time() / 1000;
+    key = "t";
+  }
+  return snprintf(out, out_len, "{\"%s\":%lld,\"boot\":%u,\"v\":", key, (long long)timestamp, (unsigned)header->boot);
+}
+
+void setup_spool(void) {
+  mutex = xSemaphoreCreateMutex();
+
+  boot_count = (uint32_t)setting_boot_count() + 1;
+  setting_set_boot_count(boot_count);
+  // Written through, a power cut before the write-behind flush would give
+  // the next boot the same id
+  if (storage_flush() != ESP_OK) {
+    ESP_LOGE(TAG, "Could not persist boot count %u", (unsigned)boot_count);
+  }
+
+  partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, SPOOL_PARTITION_LABEL);
+  if (partition != NULL) {
+    sector_count = partition->size / SPI_FLASH_SEC_SIZE;
+    if (sector_count < 2) {
+      partition = NULL;
+    }
+  }
+  if (partition == NULL) {
+    ESP_LOGI(TAG, "No %s partition, spooling to RAM only", SPOOL_PARTITION_LABEL);
+    return;
+  }
+
+  load_flash();
+  ESP_LOGI(TAG, "Spool of %u sectors, %u records pending", (unsigned)sector_count, (unsigned)flash_records);
+}
+
+bool spool_push(const char *payload, size_t len) {
+  if (len > SPOOL_RECORD_MAX_LEN) {
+    return false;
+  }
+
+  record_header_t header = { .len = len, .state = RECORD_PENDING, .boot = boot_count };
+  header.timestamp_ms = now_ms(&header.flags);
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  bool ok = make_room(sizeof(header) + len);
+  if (ok) {
+    ram_write(ram_head + ram_used, &header, sizeof(header));
+    ram_write(ram_head + ram_used + sizeof(header), payload, len);
+    ram_used += sizeof(header) + len;
+    ram_records++;
+  } else {
+    dropped++;
+  }
+  xSemaphoreGive(mutex);
+  return ok;
+}
+
+bool spool_empty(void) {
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  bool empty = ram_records == 0 && flash_records == 0;
+  xSemaphoreGive(mutex);
+  return empty;
+}
+
+size_t spool_peek_batch(char *out, size_t out_len) {
+  size_t pos = 1;
+  record_header_t header;
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  memset(&batch, 0, sizeof(batch));
+  batch.generation = generation;
+
+  // Flash first, it holds the oldest records
+  flash_pos_t flash = read_pos;
+  while (batch.flash_records < flash_records) {
+    flash_pos_t record = flash;
+    flash_record_at(&record, &header);
+    int prefix = format_item(out + pos, out_len - pos, &header);
+    if (pos + prefix + header.len + 2 >= out_len) {
+      break;
+    }
+    pos += prefix;
+    esp_partition_read(partition, flash_address(record) + sizeof(header), out + pos, header.len);
+    pos += header.len;
+    out[pos++] = '}';
+    out[pos++] = ',';
+    batch.flash_last = record;
+    record.offset += sizeof(header) + header.len;
+    flash = record;
+    batch.flash_records++;
+  }
+  batch.flash_end = flash;
+
+  while (batch.flash_records == flash_records && batch.ram_records < ram_records) {
+    ram_read(ram_head + batch.ram_bytes, &header, sizeof(header));
+    int prefix = format_item(out + pos, out_len - pos, &header);
+    if (pos + prefix + header.len + 2 >= out_len) {
+      break;
+    }
+    pos += prefix;
+    ram_read(ram_head + batch.ram_bytes + sizeof(header), out + pos, header.len);
+    pos += header.len;
+    out[pos++] = '}';
+    out[pos++] = ',';
+    batch.ram_bytes += sizeof(header) + header.len;
+    batch.ram_records++;
+  }
+  xSemaphoreGive(mutex);
+
+  if (pos == 1) {
+    return 0;
+  }
+  out[0] = '[';
+  out[pos - 1] = ']';
+  return pos;
+}
+
+void spool_commit_batch(void) {
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  // Records moved since the peek, they are sent again rather than lost
+  if (batch.generation != generation) {
+    xSemaphoreGive(mutex);
+    return;
+  }
+
+  if (batch.flash_records > 0) {
+    uint8_t sent = RECORD_SENT;
+    esp_partition_write(partition, flash_address(batch.flash_last) + offsetof(record_header_t, state), &sent, 1);
+    flash_records -= batch.flash_records;
+    read_pos = flash_records > 0 ? batch.flash_end : write_pos;
+  }
+  ram_head = (ram_head + batch.ram_bytes) % SPOOL_RAM_SIZE;
+  ram_used -= batch.ram_bytes;
+  ram_records -= batch.ram_records;
+
+  memset(&batch, 0, sizeof(batch));
+  generation++;
+  xSemaphoreGive(mutex);
+}
+
+void spool_set_policy(spool_policy_t new_policy) {
+  policy = new_policy;
+}
+
+void spool_get_stats(spool_stats_t *stats) {
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  stats->ram_records = ram_records;
+  stats->flash_records = flash_records;
+  stats->flash_sectors = partition ? sector_count : 0;
+  stats->dropped = dropped;
+  stats->policy = policy;
+  xSemaphoreGive(mutex);
+}
@@ -0,0 +1,55 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Store-and-forward for MQTT payloads produced while the broker is out of
+// reach. Records keep the time they were taken and go to a RAM ring first,
+// the oldest spill to the "spool" flash partition when it exists. On
+// reconnect they are replayed oldest first in JSON array batches:
+//
+//   [{"t":<epoch ms>,"boot":<n>,"v":<payload>}, ...]
+//
+// "t" becomes "up" (ms since boot <n>) while the clock has not been set.
+
+#define SPOOL_RAM_SIZE 8192
+#define SPOOL_PARTITION_LABEL "spool"
+#define SPOOL_RECORD_MAX_LEN 192 // payload bytes
+
+typedef enum {
+  SPOOL_DROP_OLDEST,     // lose the start of the outage
+  SPOOL_DROP_DOWNSAMPLE, // keep all of it, every other record goes when full
+} spool_policy_t;
+
+#ifndef SPOOL_DROP_POLICY
+#define SPOOL_DROP_POLICY SPOOL_DROP_OLDEST
+#endif
+
+typedef struct {
+  uint32_t ram_records;
+  uint32_t flash_records; // not yet replayed
+  uint32_t flash_sectors; // 0 without the partition
+  uint32_t dropped;       // since boot
+  spool_policy_t policy;
+} spool_stats_t;
+
+void setup_spool(void);
+
+// Keep payload (JSON) for later, false when it was dropped
+bool spool_push(const char *payload, size_t len);
+
+bool spool_empty(void);
+
+// Oldest records as one JSON array in out, returns its length, 0 when
+// empty. They stay spooled until spool_commit_batch().
+size_t spool_peek_batch(char *out, size_t out_len);
+// Forget the records of the last spool_peek_batch(), once the broker
+// acknowledged them
+void spool_commit_batch(void);
+
+void spool_set_policy(spool_policy_t policy);
+void spool_get_stats(spool_stats_t *stats);
+
+#endif
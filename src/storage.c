@@ -1,11 +1,234 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_STORAGE
+#include "logbuf.h"
+
+#include <string.h>
+#include <stdlib.h>
 #include "nvs_flash.h"
 #include "nvs.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 
 #include "storage.h"
 
+static const char *TAG = "Storage";
+
 nvs_handle_t storage;
 
+// Written keys, dirty until the flush task has set them in NVS
+
+#define KEY_MAX_LEN 16 // NVS key names are 15 characters at most
+
+typedef enum {
+  CACHED_FLOAT,
+  CACHED_STRING,
+  CACHED_UINT64,
+} cached_type_t;
+
+typedef struct {
+  char key[KEY_MAX_LEN];
+  cached_type_t type;
+  bool dirty;
+  union {
+    float f;
+    uint64_t u64;
+    char *str;
+  } value;
+} cached_key_t;
+
+static cached_key_t settings[STORAGE_CACHE_SIZE];
+static size_t setting_count = 0;
+static SemaphoreHandle_t settings_mutex = NULL;
+static TaskHandle_t flush_task_handle = NULL;
+
+static int64_t first_dirty_us = 0; // 0 while nothing is dirty
+static int64_t last_write_us = 0;
+static storage_stats_t stats;
+
+// Give up on the flush at restart rather than wait on a stalled task
+#define SHUTDOWN_FLUSH_TIMEOUT_MS 100
+
+// Implementations
+
+static bool same_value(const cached_key_t *a, const cached_key_t *b) {
+  if (a->type != b->type) {
+    return false;
+  }
+  switch (a->type) {
+    case CACHED_FLOAT:
+      return a->value.f == b->value.f;
+    case CACHED_UINT64:
+      return a->value.u64 == b->value.u64;
+    case CACHED_STRING:
+      return strcmp(a->value.str, b->value.str) == 0;
+  }
+  return false;
+}
+
+static cached_key_t *find_setting(const char *key) {
+  for (size_t i = 0; i < setting_count; ++i) {
+    if (strcmp(settings[i].key, key) == 0) {
+      return &settings[i];
+    }
+  }
+  return NULL;
+}
+
+static esp_err_t set_in_nvs(const cached_key_t *setting) {
+  switch (setting->type) {
+    case CACHED_FLOAT:
+      return nvs_set_blob(storage, setting->key, &setting->value.f, sizeof(float));
+    case CACHED_UINT64:
+      return nvs_set_blob(storage, setting->key, &setting->value.u64, sizeof(uint64_t));
+    case CACHED_STRING:
+      return nvs_set_str(storage, setting->key, setting->value.str);
+  }
+  return ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t flush_locked(void) {
+  esp_err_t ret = ESP_OK;
+  uint32_t flushed = 0;
+
+  for (size_t i = 0; i < setting_count; ++i) {
+    if (!settings[i].dirty) {
+      continue;
+    }
+    esp_err_t err = set_in_nvs(&settings[i]);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to store %s (%s)", settings[i].key, esp_err_to_name(err));
+      ret = err;
+      continue;
+    }
+    settings[i].dirty = false;
+    flushed++;
+  }
+
+  if (flushed > 0) {
+    esp_err_t err = nvs_commit(storage);
+    if (err != ESP_OK) {
+      ret = err;
+    }
+    stats.flushed += flushed;
+    stats.commits++;
+    ESP_LOGD(TAG, "Flushed %u keys", (unsigned)flushed);
+  }
+  stats.dirty -= flushed;
+  if (stats.dirty == 0) {
+    first_dirty_us = 0;
+  }
+  return ret;
+}
+
+// Takes ownership of setting's string. Returns false when the cache is
+// full and the key isn't in it yet.
+static bool write_setting(const cached_key_t *setting) {
+  bool cached = true;
+
+  xSemaphoreTake(settings_mutex, portMAX_DELAY);
+  stats.writes++;
+
+  cached_key_t *entry = find_setting(setting->key);
+  if (entry != NULL && !entry->dirty && same_value(entry, setting)) {
+    // Already stored, a slider settling back for instance
+    stats.avoided++;
+    if (setting->type == CACHED_STRING) {
+      free(setting->value.str);
+    }
+    xSemaphoreGive(settings_mutex);
+    return true;
+  }
+  if (entry == NULL && setting_count < STORAGE_CACHE_SIZE) {
+    entry = &settings[setting_count++];
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->key, setting->key);
+  }
+
+  if (entry == NULL) {
+    cached = false;
+  } else {
+    bool was_dirty = entry->dirty;
+    if (entry->type == CACHED_STRING) {
+      free(entry->value.str);
+    }
+    entry->type = setting->type;
+    entry->value = setting->value;
+    entry->dirty = true;
+
+    int64_t now = esp_timer_get_time();
+    last_write_us = now;
+    if (was_dirty) {
+      // Replaces a write that never reached NVS
+      stats.avoided++;
+    } else {
+      stats.dirty++;
+    }
+    if (first_dirty_us == 0) {
+      first_dirty_us = now;
+      xTaskNotifyGive(flush_task_handle);
+    }
+  }
+  xSemaphoreGive(settings_mutex);
+
+  return cached;
+}
+
+// Written through when the cache is full
+static esp_err_t write_through(const cached_key_t *setting) {
+  xSemaphoreTake(settings_mutex, portMAX_DELAY);
+  esp_err_t ret = set_in_nvs(setting);
+  if (ret == ESP_OK) {
+    ret = nvs_commit(storage);
+    stats.flushed++;
+    stats.commits++;
+  }
+  xSemaphoreGive(settings_mutex);
+  return ret;
+}
+
+static void flush_task(void *pvParameter) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // Every write pushes the flush back, up to the maximum delay
+    while (true) {
+      xSemaphoreTake(settings_mutex, portMAX_DELAY);
+      int64_t first = first_dirty_us;
+      int64_t due = last_write_us + STORAGE_FLUSH_QUIET_MS * 1000LL;
+      xSemaphoreGive(settings_mutex);
+
+      if (first == 0) {
+        break; // flushed by someone else
+      }
+      if (due > first + STORAGE_FLUSH_MAX_DELAY_MS * 1000LL) {
+        due = first + STORAGE_FLUSH_MAX_DELAY_MS * 1000LL;
+      }
+      int64_t now = esp_timer_get_time();
+      if (now >= due) {
+        if (storage_flush() == ESP_OK) {
+          break;
+        }
+        // Failed keys stay dirty and no write wakes this task again while
+        // they are: keep retrying
+        vTaskDelay(STORAGE_FLUSH_RETRY_MS / portTICK_PERIOD_MS);
+        continue;
+      }
+      vTaskDelay((due - now) / 1000 / portTICK_PERIOD_MS + 1);
+    }
+  }
+}
+
+static void flush_on_shutdown(void) {
+  if (xSemaphoreTake(settings_mutex, SHUTDOWN_FLUSH_TIMEOUT_MS / portTICK_PERIOD_MS) != pdTRUE) {
+    return;
+  }
+  flush_locked();
+  xSemaphoreGive(settings_mutex);
+}
+
 // Long term storage that survives restart
 
 void setup_storage(void) {
@@ -16,25 +239,74 @@ void setup_storage(void) {
     ret = nvs_flash_init();
   }
   ESP_ERROR_CHECK(ret);
-  
+
   ret = nvs_open("storage", NVS_READWRITE, &storage);
   if (ret != ESP_OK) {
     printf("Error (%s) opening NVS handle!\n", esp_err_to_name(ret));
   }
+
+  settings_mutex = xSemaphoreCreateMutex();
+  xTaskCreate(&flush_task, "storage_flush_task", 3072, NULL, 2, &flush_task_handle);
+  // Pending settings are written on esp_restart(), OTA included
+  ESP_ERROR_CHECK(esp_register_shutdown_handler(flush_on_shutdown));
+}
+
+esp_err_t storage_flush(void) {
+  xSemaphoreTake(settings_mutex, portMAX_DELAY);
+  esp_err_t ret = flush_locked();
+  xSemaphoreGive(settings_mutex);
+  return ret;
+}
+
+void storage_get_stats(storage_stats_t *out) {
+  xSemaphoreTake(settings_mutex, portMAX_DELAY);
+  *out = stats;
+  xSemaphoreGive(settings_mutex);
+}
+
+// Copy of the cached value of key, false when it isn't cached
+static bool read_setting(const char *key, cached_type_t type, void *out, size_t out_len) {
+  bool found = false;
+
+  xSemaphoreTake(settings_mutex, portMAX_DELAY);
+  cached_key_t *entry = find_setting(key);
+  if (entry && entry->type == type) {
+    found = true;
+    if (type == CACHED_STRING) {
+      strncpy(out, entry->value.str, out_len - 1);
+      ((char *)out)[out_len - 1] = '\0';
+    } else {
+      memcpy(out, &entry->value, out_len);
+    }
+  }
+  xSemaphoreGive(settings_mutex);
+
+  return found;
+}
+
+static cached_key_t make_setting(const char *key, cached_type_t type) {
+  cached_key_t setting = { .type = type };
+  strncpy(setting.key, key, sizeof(setting.key) - 1);
+  return setting;
 }
 
 esp_err_t readFloat(char* key, float *value, float defaultValue) {
   *value = defaultValue;
+  if (read_setting(key, CACHED_FLOAT, value, sizeof(float))) {
+    return ESP_OK;
+  }
   size_t required_size = 4;
   return nvs_get_blob(storage, key, value, &required_size);
 }
 
 esp_err_t writeFloat(char* key, float value) {
-  ESP_LOGI("Storage", "Store value %f for key %s", value, key);
-  esp_err_t ret = nvs_set_blob(storage, key, &value, sizeof(float));
-  if (ret != ESP_OK) return ret;
+  ESP_LOGI(TAG, "Store value %f for key %s", value, key);
+  cached_key_t setting = make_setting(key, CACHED_FLOAT);
+  setting.value.f = value;
+  return write_setting(&setting) ? ESP_OK : write_through(&setting);
+}
 
-  esp_err_t readString(const char* key, char* out, size_t out_len, const char* def) {
+esp_err_t readString(const char* key, char* out, size_t out_len, const char* def) {
   if (!out || out_len == 0) return ESP_ERR_INVALID_ARG;
 
   // Default
@@ -45,6 +317,10 @@ esp_err_t writeFloat(char* key, float value) {
     out[0] = '\0';
   }
 
+  if (read_setting(key, CACHED_STRING, out, out_len)) {
+    return ESP_OK;
+  }
+
   // Query size
   size_t required = 0;
   esp_err_t ret = nvs_get_str(storage, key, NULL, &required);
@@ -57,15 +333,23 @@ esp_err_t writeFloat(char* key, float value) {
 
 esp_err_t writeString(const char* key, const char* value) {
   if (!value) value = "";
-  ESP_LOGI("Storage", "Store string for key %s: '%s'", key, value);
-  esp_err_t ret = nvs_set_str(storage, key, value);
-  if (ret != ESP_OK) return ret;
-  return nvs_commit(storage);
+  ESP_LOGI(TAG, "Store string for key %s: '%s'", key, value);
+  cached_key_t setting = make_setting(key, CACHED_STRING);
+  setting.value.str = strdup(value);
+  if (setting.value.str == NULL) return ESP_ERR_NO_MEM;
+  if (write_setting(&setting)) return ESP_OK;
+
+  esp_err_t ret = write_through(&setting);
+  free(setting.value.str);
+  return ret;
 }
 
 esp_err_t readUInt64(const char* key, uint64_t* out, uint64_t def) {
   if (!out) return ESP_ERR_INVALID_ARG;
   *out = def;
+  if (read_setting(key, CACHED_UINT64, out, sizeof(uint64_t))) {
+    return ESP_OK;
+  }
   uint64_t v = 0;
   size_t len = sizeof(v);
   esp_err_t ret = nvs_get_blob(storage, key, &v, &len);
@@ -74,10 +358,7 @@ esp_err_t readUInt64(const char* key, uint64_t* out, uint64_t def) {
 }
 
 esp_err_t writeUInt64(const char* key, uint64_t value) {
-  esp_err_t ret = nvs_set_blob(storage, key, &value, sizeof(value));
-  if (ret != ESP_OK) return ret;
-  return nvs_commit(storage);
-}
-
-  return nvs_commit(storage);
+  cached_key_t setting = make_setting(key, CACHED_UINT64);
+  setting.value.u64 = value;
+  return write_setting(&setting) ? ESP_OK : write_through(&setting);
 }
@@ -1,8 +1,35 @@
 #ifndef STORAGE_H
 #define STORAGE_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+// Settings are written behind: writes land in RAM and read back from there
+// right away, a background task sets every dirty key and commits once the
+// writes have been quiet for a while. storage_flush() runs before a restart.
+// Power loss can lose up to STORAGE_FLUSH_MAX_DELAY_MS of changes, keys that
+// must survive it are followed by storage_flush().
+
+#define STORAGE_CACHE_SIZE 24           // keys written since boot, more are written through
+#define STORAGE_FLUSH_QUIET_MS 2000     // after the last write
+#define STORAGE_FLUSH_MAX_DELAY_MS 10000 // after the first unflushed write
+#define STORAGE_FLUSH_RETRY_MS 5000      // after a failed flush
+
+typedef struct {
+  uint32_t writes;  // write calls
+  uint32_t flushed; // keys actually set in NVS
+  uint32_t avoided; // writes coalesced or unchanged, never reaching NVS
+  uint32_t commits;
+  uint32_t dirty;   // keys waiting for the next flush
+} storage_stats_t;
+
 void setup_storage(void);
 
+// Write every dirty key now, in one commit
+esp_err_t storage_flush(void);
+void storage_get_stats(storage_stats_t *stats);
+
 esp_err_t readFloat(char* key, float *value, float defaultValue);
 esp_err_t writeFloat(char* key, float value);
 esp_err_t readString(const char* key, char* out, size_t out_len, const char* def);
@@ -0,0 +1,225 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_TELEMETRY
+#include "logbuf.h"
+
+#include "telemetry.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+
+#include "mqtt.h"
+#include "power_wheel.h"
+#include "settings.h"
+#include "spool.h"
+#include "latency.h"
+
+// Local variables
+
+static const char *TAG = "telemetry";
+
+// Smallest change worth a message
+#define SPEED_DEADBAND 1.0f   // %
+#define RSSI_DEADBAND 3       // dBm
+#define RUNTIME_DEADBAND_S 10
+
+// No RSSI while the STA link is down
+#define RSSI_NONE 0
+
+typedef struct {
+  float speed;
+  bool emergency_stop;
+  uint64_t total_runtime_s;
+  int rssi;
+} telemetry_values_t;
+
+static telemetry_values_t published;
+
+static char replay_batch[TELEMETRY_REPLAY_BATCH_LEN];
+
+// Batch waiting for its PUBACK, -1 when none is
+static int replay_msg_id = -1;
+static uint32_t replay_connection_id = 0;
+static int64_t replay_sent_ms = 0;
+
+// Acknowledged message ids, from the MQTT task
+#define PUBLISHED_QUEUE_LEN 8
+static QueueHandle_t published_ids = NULL;
+
+// Implementations
+
+static int read_rssi(void) {
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+    return RSSI_NONE;
+  }
+  return ap_info.rssi;
+}
+
+static int append(char *out, size_t out_len, int pos, const char *format, ...) __attribute__((format(printf, 4, 5)));
+static int append(char *out, size_t out_len, int pos, const char *format, ...) {
+  if (pos < 0 || (size_t)pos >= out_len) {
+    return pos;
+  }
+  va_list args;
+  va_start(args, format);
+  pos += vsnprintf(out + pos, out_len - pos, format, args);
+  va_end(args);
+  return pos;
+}
+
+// Fields past their deadband, or all of them when full is set. Returns the
+// payload length, 0 when there is nothing to send.
+static int build_batch(char *out, size_t out_len, const telemetry_values_t *now, bool full) {
+  int pos = 0;
+  const char *sep = "{";
+
+  if (full || fabsf(now->speed - published.speed) >= SPEED_DEADBAND ||
+      (now->speed == 0.0f && published.speed != 0.0f)) {
+    pos = append(out, out_len, pos, "%s\"speed\":%.1f", sep, now->speed);
+    published.speed = now->speed;
+    sep = ",";
+  }
+  if (full || now->emergency_stop != published.emergency_stop) {
+    pos = append(out, out_len, pos, "%s\"emergency_stop\":%s", sep, now->emergency_stop ? "true" : "false");
+    published.emergency_stop = now->emergency_stop;
+    sep = ",";
+  }
+  if (full || now->total_runtime_s >= published.total_runtime_s + RUNTIME_DEADBAND_S) {
+    pos = append(out, out_len, pos, "%s\"total_runtime_s\":%llu", sep, (unsigned long long)now->total_runtime_s);
+    published.total_runtime_s = now->total_runtime_s;
+    sep = ",";
+  }
+  if (full || abs(now->rssi - published.rssi) >= RSSI_DEADBAND) {
+    pos = append(out, out_len, pos, "%s\"rssi\":%d", sep, now->rssi);
+    published.rssi = now->rssi;
+    sep = ",";
+  }
+
+  if (pos == 0) {
+    return 0;
+  }
+  return append(out, out_len, pos, "}");
+}
+
+static void publish_config(void) {
+  char payload[128];
+  size_t len = settings_serialize(payload, sizeof(payload), SETTING_MQTT);
+  if (len > 0) {
+    mqtt_publish(MQTT_TOPIC_CONFIG, payload, len, 1, true);
+  }
+}
+
+// Queued rather than matched here, the PUBACK can beat mqtt_publish()
+// returning the id
+static void on_published(int msg_id) {
+  xQueueSend(published_ids, &msg_id, 0);
+}
+
+static bool replay_acked(TickType_t wait) {
+  int msg_id;
+  while (xQueueReceive(published_ids, &msg_id, wait) == pdTRUE) {
+    if (msg_id == replay_msg_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Send part of what was spooled while disconnected, oldest first. A batch
+// is only forgotten once the broker has it, one is in flight at a time.
+static void replay_spool(void) {
+  for (int i = 0; i < TELEMETRY_REPLAY_BATCHES; ++i) {
+    if (replay_msg_id >= 0) {
+      int64_t now_ms = esp_timer_get_time() / 1000;
+      if (replay_acked(TELEMETRY_REPLAY_ACK_WAIT_MS / portTICK_PERIOD_MS)) {
+        spool_commit_batch();
+      } else if (mqtt_connection_id() == replay_connection_id &&
+                 now_ms - replay_sent_ms < TELEMETRY_REPLAY_ACK_TIMEOUT_MS) {
+        return;
+      } else {
+        ESP_LOGW(TAG, "Replay of message %d not acknowledged, sending again", replay_msg_id);
+      }
+      replay_msg_id = -1;
+    }
+
+    if (spool_empty()) {
+      return;
+    }
+    size_t len = spool_peek_batch(replay_batch, sizeof(replay_batch));
+    if (len == 0) {
+      return;
+    }
+    // Drop ids of other messages, a full queue would drop this one's
+    xQueueReset(published_ids);
+    replay_connection_id = mqtt_connection_id();
+    replay_sent_ms = esp_timer_get_time() / 1000;
+    replay_msg_id = mqtt_publish(MQTT_TOPIC_HISTORY, replay_batch, len, 1, false);
+    if (replay_msg_id < 0) {
+      replay_msg_id = -1;
+      return;
+    }
+  }
+}
+
+static void telemetry_task(void *pvParameter) {
+  uint32_t connection_id = 0;
+  uint32_t config_version = 0;
+  int64_t last_full = 0;
+  char payload[128];
+
+  while (true) {
+    vTaskDelay(TELEMETRY_INTERVAL_MS / portTICK_PERIOD_MS);
+    bool connected = mqtt_is_connected();
+
+    power_wheel_state_t state;
+    power_wheel_get_state(&state);
+
+    // Retained, so only on change and once per broker connection
+    bool reconnected = connected && mqtt_connection_id() != connection_id;
+    if (connected && (reconnected || power_wheel_config_version() != config_version)) {
+      connection_id = mqtt_connection_id();
+      config_version = power_wheel_config_version();
+      publish_config();
+    }
+
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    bool full = reconnected || now_ms - last_full >= TELEMETRY_FULL_PERIOD_MS;
+    if (full) {
+      last_full = now_ms;
+    }
+
+    telemetry_values_t now = {
+      .speed = state.current_speed,
+      .emergency_stop = state.emergency_stop,
+      .total_runtime_s = state.total_runtime_s,
+      .rssi = read_rssi(),
+    };
+    int len = build_batch(payload, sizeof(payload), &now, full);
+    if (len > 0 && connected) {
+      ESP_LOGD(TAG, "Publish %s", payload);
+      mqtt_publish(MQTT_TOPIC_TELEMETRY, payload, len, 0, false);
+      latency_stop(LATENCY_STATE_TO_MQTT);
+    } else if (len > 0) {
+      ESP_LOGD(TAG, "Spool %s", payload);
+      spool_push(payload, len);
+      latency_cancel(LATENCY_STATE_TO_MQTT);
+    }
+
+    if (connected) {
+      replay_spool();
+    }
+  }
+}
+
+void setup_telemetry(void) {
+  published_ids = xQueueCreate(PUBLISHED_QUEUE_LEN, sizeof(int));
+  mqtt_set_published_callback(&on_published);
+  xTaskCreate(&telemetry_task, "telemetry_task", 3072, NULL, 3, NULL);
+}
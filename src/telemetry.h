@@ -0,0 +1,24 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+// Publish the driving state over MQTT. Fields are sent only when they moved
+// past their deadband, all changes of one interval in a single JSON payload
+// on <base>/telemetry. Speed limits go retained to <base>/config.
+// Batches taken while the broker is out of reach are spooled (spool.h) and
+// replayed to <base>/history once it is back.
+
+#define TELEMETRY_INTERVAL_MS 1000
+// Everything is sent again this often, so new subscribers catch up
+#define TELEMETRY_FULL_PERIOD_MS 60000
+// Replay pace after a reconnect, so live traffic still gets through
+#define TELEMETRY_REPLAY_BATCHES 4
+#define TELEMETRY_REPLAY_BATCH_LEN 1024
+// A replayed batch stays spooled until the broker acknowledges it. Each
+// batch is awaited this long before the next interval, and sent again when
+// no acknowledgement came within the timeout or the connection changed.
+#define TELEMETRY_REPLAY_ACK_WAIT_MS 200
+#define TELEMETRY_REPLAY_ACK_TIMEOUT_MS 15000
+
+void setup_telemetry(void);
+
+#endif
@@ -1,52 +1,355 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_WEBFILE
+#include "logbuf.h"
+
 #include "webfile.h"
 
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include <sys/unistd.h>
 #include <esp_log.h>
 #include <esp_http_server.h>
-#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_spiffs.h"
 #include "esp_vfs.h"
 
 #include "websocket.h"
 #include "utils.h"
 #include "spiffs.h"
+#include "assets.h"
+#include "ota.h"
+#include "webworker.h"
 
 // Local variables
 
 static const char *TAG = "webfile";
 
-#define SCRATCH_BUFSIZE  8192
 // Max length a file path can have on storage
-#define FILE_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
+#define FILE_PATH_MAX (ESP_VFS_PATH_MAX + SPIFFS_OBJ_NAME_LEN)
 // Max size of an individual file. Make sure this
 // value is same as that set in upload_script.html */
 #define MAX_FILE_SIZE   (200*1024) // 200 KB
 #define MAX_FILE_SIZE_STR "200KB"
 
-static esp_ota_handle_t ota_handle;
-
-// Buffer for temporary storage during file transfer
-static char scratch_buffer[SCRATCH_BUFSIZE];
+// Suffix of the precompressed variants written by tools/gzip_assets.py
+#define GZIP_SUFFIX ".gz"
+// Pages are revalidated on every load (cheap with ETag), other assets are
+// kept by the browser for a day
+#define CACHE_CONTROL_PAGE "no-cache"
+#define CACHE_CONTROL_ASSET "max-age=86400"
+// "<size>-<content digest>-gz"
+#define ETAG_MAX_LEN 32
+
+// Content digests of the files served since boot
+#define DIGEST_MAX_ENTRIES 16
+#define DIGEST_READ_LEN 256
+
+// RAM cache of small files
+#define CACHE_MAX_ENTRIES 8
+#define CACHE_MAX_BYTES (32*1024)
+#define CACHE_MAX_FILE_SIZE (16*1024)
+
+// Longest wait of a filesystem image update for file requests to finish
+#define FILES_SUSPEND_TIMEOUT_MS 10000
+#define FILES_SUSPEND_POLL_MS 20
+
+// Upload progress broadcast throttling
+#define PROGRESS_STEP_PERCENT 5
+#define PROGRESS_INTERVAL_MS 500
+
+typedef struct {
+  bool sent;
+  int last_percent;
+  int64_t last_time;
+} upload_progress_t;
+
+// A cached response. Entries are keyed by the requested file path and
+// whether the client accepts gzip, so a hit needs no stat at all.
+// Entries are reference counted so eviction never frees one being sent.
+typedef struct {
+  char path[FILE_PATH_MAX];
+  bool gzip_accepted;
+  bool gzipped;      // data is the .gz variant
+  char etag[ETAG_MAX_LEN];
+  uint32_t last_used;
+  int refs;          // the table holds one reference
+  size_t len;
+  char data[];
+} cache_entry_t;
+
+// Digest of a stored file (the .gz variant has its own), for the ETag.
+// Size and mtime alone miss edits: images built by mkspiffs or spiffsgen
+// carry no meaningful mtime.
+typedef struct {
+  char path[FILE_PATH_MAX];
+  uint32_t digest;
+} file_digest_t;
+
+static file_digest_t digests[DIGEST_MAX_ENTRIES]; // empty path for a free slot
+static int digest_next = 0;                       // next slot replaced
+static cache_entry_t *cache_entries[CACHE_MAX_ENTRIES];
+static uint32_t cache_clock = 0;
+static webfile_cache_stats_t cache_stats = { .capacity = CACHE_MAX_BYTES };
+static SemaphoreHandle_t cache_mutex = NULL;
+// File requests in progress, on workers or the httpd task. A filesystem
+// image update refuses new ones and waits for these before unmounting.
+static uint32_t files_busy = 0;
+static bool files_suspended = false;
 
 // Implementations
 
 #define IS_FILE_EXTENSION(filename, ext) \
   (strcasecmp(&filename[strlen(filename) - sizeof(ext) + 1], ext) == 0)
 
-// Set HTTP content type from file extension
-static esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filename) {
+// Whether the path of uri ends with a private key extension, any case.
+// Private keys (MQTT_CLIENT_KEY_FILE) never leave the device.
+static bool is_private_key(const char *uri) {
+  static const char KEY_SUFFIX[] = ".key";
+  size_t len = strcspn(uri, "?#");
+  return len >= sizeof(KEY_SUFFIX) - 1 &&
+         strncasecmp(uri + len - (sizeof(KEY_SUFFIX) - 1), KEY_SUFFIX, sizeof(KEY_SUFFIX) - 1) == 0;
+}
+
+// HTTP content type from file extension
+static const char *content_type_from_file(const char *filename) {
   if (IS_FILE_EXTENSION(filename, ".pdf")) {
-    return httpd_resp_set_type(req, "application/pdf");
+    return "application/pdf";
   } else if (IS_FILE_EXTENSION(filename, ".html")) {
-    return httpd_resp_set_type(req, "text/html");
+    return "text/html";
   } else if (IS_FILE_EXTENSION(filename, ".jpeg")) {
-    return httpd_resp_set_type(req, "image/jpeg");
+    return "image/jpeg";
   } else if (IS_FILE_EXTENSION(filename, ".ico")) {
-    return httpd_resp_set_type(req, "image/x-icon");
+    return "image/x-icon";
   }
   // For any other type always set as plain text
-  return httpd_resp_set_type(req, "text/plain");
+  return "text/plain";
+}
+
+// File cache
+
+static void cache_unref(cache_entry_t *entry) {
+  if (--entry->refs == 0) {
+    free(entry);
+  }
+}
+
+// Remove slot i from the table, must hold cache_mutex
+static void cache_remove(int i) {
+  cache_stats.bytes -= cache_entries[i]->len;
+  cache_stats.entries--;
+  cache_unref(cache_entries[i]);
+  cache_entries[i] = NULL;
+}
+
+// Returns a referenced entry, release it with cache_release
+static cache_entry_t *cache_acquire(const char *path, bool gzip_accepted) {
+  cache_entry_t *found = NULL;
+
+  xSemaphoreTake(cache_mutex, portMAX_DELAY);
+  for (int i = 0; i < CACHE_MAX_ENTRIES; ++i) {
+    cache_entry_t *entry = cache_entries[i];
+    if (entry && entry->gzip_accepted == gzip_accepted && strcmp(entry->path, path) == 0) {
+      entry->last_used = ++cache_clock;
+      entry->refs++;
+      found = entry;
+      break;
+    }
+  }
+  if (found) {
+    cache_stats.hits++;
+  } else {
+    cache_stats.misses++;
+  }
+  xSemaphoreGive(cache_mutex);
+
+  return found;
+}
+
+static void cache_release(cache_entry_t *entry) {
+  xSemaphoreTake(cache_mutex, portMAX_DELAY);
+  cache_unref(entry);
+  xSemaphoreGive(cache_mutex);
+}
+
+// Read a whole file into a new entry, returns it referenced or NULL
+static cache_entry_t *cache_load(const char *path, bool gzip_accepted, bool gzipped,
+                                 const char *etag, FILE *fd, size_t len) {
+  cache_entry_t *entry = malloc(sizeof(cache_entry_t) + len);
+  if (entry == NULL) {
+    return NULL;
+  }
+  if (fread(entry->data, 1, len, fd) != len) {
+    free(entry);
+    return NULL;
+  }
+
+  strlcpy(entry->path, path, sizeof(entry->path));
+  entry->gzip_accepted = gzip_accepted;
+  entry->gzipped = gzipped;
+  strlcpy(entry->etag, etag, sizeof(entry->etag));
+  entry->len = len;
+  entry->refs = 2; // table + caller
+
+  xSemaphoreTake(cache_mutex, portMAX_DELAY);
+  entry->last_used = ++cache_clock;
+
+  // Evict least recently used entries until it fits
+  int free_slot = -1;
+  for (;;) {
+    int lru = -1;
+    free_slot = -1;
+    for (int i = 0; i < CACHE_MAX_ENTRIES; ++i) {
+      if (cache_entries[i] == NULL) {
+        free_slot = i;
+      } else if (lru == -1 || cache_entries[i]->last_used < cache_entries[lru]->last_used) {
+        lru = i;
+      }
+    }
+    if (free_slot != -1 && cache_stats.bytes + len <= CACHE_MAX_BYTES) {
+      break;
+    }
+    cache_remove(lru);
+    cache_stats.evictions++;
+  }
+
+  cache_entries[free_slot] = entry;
+  cache_stats.bytes += len;
+  cache_stats.entries++;
+  xSemaphoreGive(cache_mutex);
+
+  return entry;
+}
+
+// File digests, under cache_mutex like the cache they go with
+
+static bool digest_lookup(const char *path, uint32_t *out) {
+  bool found = false;
+  xSemaphoreTake(cache_mutex, portMAX_DELAY);
+  for (int i = 0; i < DIGEST_MAX_ENTRIES; ++i) {
+    if (strcmp(digests[i].path, path) == 0) {
+      *out = digests[i].digest;
+      found = true;
+      break;
+    }
+  }
+  xSemaphoreGive(cache_mutex);
+  return found;
+}
+
+// FNV-1a of the whole file, remembered for the next requests
+static bool digest_compute(const char *path, uint32_t *out) {
+  FILE *fd = fopen(path, "r");
+  if (!fd) {
+    return false;
+  }
+  uint8_t buf[DIGEST_READ_LEN];
+  uint32_t digest = 2166136261u;
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), fd)) > 0) {
+    for (size_t i = 0; i < len; ++i) {
+      digest = (digest ^ buf[i]) * 16777619u;
+    }
+  }
+  bool ok = !ferror(fd);
+  fclose(fd);
+  if (!ok) {
+    return false;
+  }
+
+  xSemaphoreTake(cache_mutex, portMAX_DELAY);
+  file_digest_t *slot = &digests[digest_next];
+  digest_next = (digest_next + 1) % DIGEST_MAX_ENTRIES;
+  strlcpy(slot->path, path, sizeof(slot->path));
+  slot->digest = digest;
+  xSemaphoreGive(cache_mutex);
+
+  *out = digest;
+  return true;
+}
+
+// Drop the digests of base and its .gz variant, must hold cache_mutex
+static void digest_invalidate(const char *base) {
+  size_t len = strlen(base);
+  for (int i = 0; i < DIGEST_MAX_ENTRIES; ++i) {
+    if (strncmp(digests[i].path, base, len) == 0 &&
+        (digests[i].path[len] == '\0' || strcmp(digests[i].path + len, GZIP_SUFFIX) == 0)) {
+      digests[i].path[0] = '\0';
+    }
+  }
+}
+
+// Drop every cached response built from the file at path
+static void cache_invalidate(const char *path) {
+  // Both variants are keyed by the path of the identity file
+  char base[FILE_PATH_MAX];
+  strlcpy(base, path, sizeof(base));
+  size_t len = strlen(base);
+  if (len > sizeof(GZIP_SUFFIX) - 1 && strcmp(base + len - sizeof(GZIP_SUFFIX) + 1, GZIP_SUFFIX) == 0) {
+    base[len - sizeof(GZIP_SUFFIX) + 1] = '\0';
+  }
+
+  xSemaphoreTake(cache_mutex, portMAX_DELAY);
+  digest_invalidate(base);
+  for (int i = 0; i < CACHE_MAX_ENTRIES; ++i) {
+    if (cache_entries[i] && strcmp(cache_entries[i]->path, base) == 0) {
+      cache_remove(i);
+      cache_stats.invalidations++;
+    }
+  }
+  xSemaphoreGive(cache_mutex);
+}
+
+// Drop everything, e.g. once the whole filesystem was replaced
+static void cache_invalidate_all(void) {
+  xSemaphoreTake(cache_mutex, portMAX_DELAY);
+  memset(digests, 0, sizeof(digests));
+  for (int i = 0; i < CACHE_MAX_ENTRIES; ++i) {
+    if (cache_entries[i]) {
+      cache_remove(i);
+      cache_stats.invalidations++;
+    }
+  }
+  xSemaphoreGive(cache_mutex);
+}
+
+void webfile_get_cache_stats(webfile_cache_stats_t *out) {
+  if (cache_mutex == NULL) {
+    *out = cache_stats;
+    return;
+  }
+  xSemaphoreTake(cache_mutex, portMAX_DELAY);
+  *out = cache_stats;
+  xSemaphoreGive(cache_mutex);
+}
+
+// Whether the client announced it can decode gzip
+static bool accepts_gzip(httpd_req_t *req) {
+  char value[64];
+  if (httpd_req_get_hdr_value_str(req, "Accept-Encoding", value, sizeof(value)) != ESP_OK) {
+    return false;
+  }
+  return strstr(value, "gzip") != NULL;
+}
+
+// Strong validator derived from the stored file content, the encoding is
+// part of it since both variants are different representations of the URI
+static void make_etag(char *etag, size_t etag_len, const struct stat *file_stat, uint32_t digest, bool gzipped) {
+  snprintf(etag, etag_len, "\"%lx-%08lx%s\"",
+           (unsigned long)file_stat->st_size, (unsigned long)digest, gzipped ? "-gz" : "");
+}
+
+// Whether the client cached copy matches etag
+static bool etag_matches(httpd_req_t *req, const char *etag) {
+  char value[128];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) != ESP_OK) {
+    return false;
+  }
+  return strcmp(value, "*") == 0 || strstr(value, etag) != NULL;
 }
 
 // Redirect to /
@@ -58,6 +361,33 @@ static esp_err_t redirect_root(httpd_req_t *req) {
   return ESP_OK;
 }
 
+// Connectivity checks of the phone and desktop OSes. They are repeated for
+// as long as a device stays on the soft AP. Each gets the same tiny
+// redirect to the dashboard, which is what makes the OS show it as the
+// captive portal, without a filesystem lookup or the page itself.
+static const char *CAPTIVE_PROBES[] = {
+  "/generate_204",              // Android
+  "/gen_204",                   // Android, Chrome OS
+  "/hotspot-detect.html",       // iOS, macOS
+  "/library/test/success.html", // older iOS
+  "/ncsi.txt",                  // Windows
+  "/connecttest.txt",           // Windows 10 and later
+  "/redirect",                  // Windows, opened once a portal is detected
+  "/success.txt",               // Firefox
+  "/canonical.html",            // Firefox
+};
+#define CAPTIVE_PROBE_COUNT (sizeof(CAPTIVE_PROBES) / sizeof(CAPTIVE_PROBES[0]))
+
+static esp_err_t captive_probe_handler(httpd_req_t *req) {
+  ESP_LOGD(TAG, "Captive probe %s", req->uri);
+  cache_stats.probes++;
+
+  httpd_resp_set_status(req, "302 Found");
+  httpd_resp_set_hdr(req, "Location", "/");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, NULL, 0);
+}
+
 // Copies the full path into destination buffer and returns
 // pointer to path (skipping the preceding base path)
 static const char* get_path_from_uri(char *dest, const char *base_path, const char *uri, size_t destsize) {
@@ -93,18 +423,338 @@ static void restart_task(void *pvParameter) {
   esp_restart();
 }
 
-static void broadcast_upload_progress(int loaded, int total) {
-  char *message;
-  char *format = "{\"loaded\":\"%d\",\"total\":\"%d\"}";
-  asprintf(&message, format, loaded, total);
-  ESP_LOGI(TAG, "%s", message);
+// Broadcast upload progress, throttled to one message per
+// PROGRESS_STEP_PERCENT or PROGRESS_INTERVAL_MS, whichever comes first
+static void report_upload_progress(upload_progress_t *progress, int loaded, int total) {
+  int percent = total > 0 ? (int)((int64_t)loaded * 100 / total) : 100;
+  int64_t now = esp_timer_get_time();
+  bool done = loaded >= total;
+
+  if (progress->sent && !done &&
+      percent - progress->last_percent < PROGRESS_STEP_PERCENT &&
+      now - progress->last_time < PROGRESS_INTERVAL_MS * 1000) {
+    return;
+  }
+  progress->sent = true;
+  progress->last_percent = percent;
+  progress->last_time = now;
+
+  char message[48];
+  snprintf(message, sizeof(message), "{\"loaded\":\"%d\",\"total\":\"%d\"}", loaded, total);
+  ESP_LOGD(TAG, "%s", message);
   broadcast_message(message);
 }
 
+// Responses
+
+// How to answer a GET for one representation (identity or gzip) of a file
+typedef struct {
+  const char *content_type;
+  const char *cache_control;
+  const char *etag;
+  bool gzipped;
+  size_t total;   // size of the representation
+  size_t start;   // byte range to send
+  size_t len;
+  bool partial;
+  // Referenced by httpd until the response is sent
+  char content_range[48];
+} file_response_t;
+
+typedef enum {
+  RESPOND_BODY,
+  RESPOND_NOT_MODIFIED,
+  RESPOND_RANGE_NOT_SATISFIABLE,
+} respond_t;
+
+typedef enum {
+  RANGE_NONE,          // absent, malformed or multiple ranges: send everything
+  RANGE_OK,
+  RANGE_UNSATISFIABLE,
+} range_t;
+
+// Parse a single "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+static range_t parse_range(const char *value, size_t total, size_t *start, size_t *len) {
+  if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL) {
+    return RANGE_NONE;
+  }
+  const char *p = value + 6;
+  char *end;
+
+  if (*p == '-') {
+    unsigned long suffix = strtoul(p + 1, &end, 10);
+    if (end == p + 1 || *end != '\0') {
+      return RANGE_NONE;
+    }
+    if (suffix == 0 || total == 0) {
+      return RANGE_UNSATISFIABLE;
+    }
+    *start = total - min((size_t)suffix, total);
+    *len = total - *start;
+    return RANGE_OK;
+  }
+
+  unsigned long first = strtoul(p, &end, 10);
+  if (end == p || *end != '-') {
+    return RANGE_NONE;
+  }
+  p = end + 1;
+  unsigned long last = total ? total - 1 : 0;
+  if (*p != '\0') {
+    last = strtoul(p, &end, 10);
+    if (end == p || *end != '\0' || last < first) {
+      return RANGE_NONE;
+    }
+  }
+  if (first >= total) {
+    return RANGE_UNSATISFIABLE;
+  }
+  last = min((size_t)last, total - 1);
+
+  *start = first;
+  *len = last - first + 1;
+  return RANGE_OK;
+}
+
+// Apply If-None-Match, Range and If-Range to the response
+static respond_t evaluate_request(httpd_req_t *req, file_response_t *resp) {
+  resp->start = 0;
+  resp->len = resp->total;
+  resp->partial = false;
+
+  if (etag_matches(req, resp->etag)) {
+    return RESPOND_NOT_MODIFIED;
+  }
+
+  char value[64];
+  if (httpd_req_get_hdr_value_str(req, "Range", value, sizeof(value)) != ESP_OK) {
+    return RESPOND_BODY;
+  }
+
+  // A range only applies to the representation the client already has part of.
+  // We send no Last-Modified, so a date never matches either. A validator
+  // too long to be ours doesn't match: full body.
+  if (httpd_req_get_hdr_value_len(req, "If-Range") > 0) {
+    char if_range[ETAG_MAX_LEN + 4];
+    if (httpd_req_get_hdr_value_str(req, "If-Range", if_range, sizeof(if_range)) != ESP_OK ||
+        strcmp(if_range, resp->etag) != 0) {
+      return RESPOND_BODY;
+    }
+  }
+
+  switch (parse_range(value, resp->total, &resp->start, &resp->len)) {
+    case RANGE_OK:
+      resp->partial = true;
+      snprintf(resp->content_range, sizeof(resp->content_range), "bytes %u-%u/%u",
+               (unsigned)resp->start, (unsigned)(resp->start + resp->len - 1), (unsigned)resp->total);
+      return RESPOND_BODY;
+    case RANGE_UNSATISFIABLE:
+      snprintf(resp->content_range, sizeof(resp->content_range), "bytes */%u", (unsigned)resp->total);
+      return RESPOND_RANGE_NOT_SATISFIABLE;
+    default:
+      return RESPOND_BODY;
+  }
+}
+
+// Headers shared by every outcome, sent through httpd
+static void set_file_headers(httpd_req_t *req, file_response_t *resp) {
+  httpd_resp_set_type(req, resp->content_type);
+  httpd_resp_set_hdr(req, "ETag", resp->etag);
+  httpd_resp_set_hdr(req, "Cache-Control", resp->cache_control);
+  httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+  httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+}
+
+static esp_err_t send_without_body(httpd_req_t *req, file_response_t *resp, respond_t outcome) {
+  set_file_headers(req, resp);
+  if (outcome == RESPOND_NOT_MODIFIED) {
+    httpd_resp_set_status(req, "304 Not Modified");
+  } else {
+    httpd_resp_set_status(req, "416 Range Not Satisfiable");
+    httpd_resp_set_hdr(req, "Content-Range", resp->content_range);
+  }
+  return httpd_resp_send(req, NULL, 0);
+}
+
+// Body held in memory, httpd adds the Content-Length
+static esp_err_t send_memory_body(httpd_req_t *req, file_response_t *resp, const char *data) {
+  set_file_headers(req, resp);
+  if (resp->gzipped) {
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+  }
+  if (resp->partial) {
+    httpd_resp_set_status(req, "206 Partial Content");
+    httpd_resp_set_hdr(req, "Content-Range", resp->content_range);
+  }
+  return httpd_resp_send(req, data + resp->start, resp->len);
+}
+
+static esp_err_t send_memory(httpd_req_t *req, file_response_t *resp, const char *data) {
+  respond_t outcome = evaluate_request(req, resp);
+  if (outcome != RESPOND_BODY) {
+    return send_without_body(req, resp, outcome);
+  }
+  return send_memory_body(req, resp, data);
+}
+
+// httpd_send may send less than asked
+static esp_err_t send_all(httpd_req_t *req, const char *buf, size_t len) {
+  while (len > 0) {
+    int sent = httpd_send(req, buf, len);
+    if (sent == HTTPD_SOCK_ERR_TIMEOUT) {
+      // Retry if timeout occurred
+      continue;
+    }
+    if (sent <= 0) {
+      return ESP_FAIL;
+    }
+    buf += sent;
+    len -= sent;
+  }
+  return ESP_OK;
+}
+
+// Stream a file with an exact Content-Length. httpd only streams with
+// chunked encoding, so the response head is written on the socket here.
+// Runs on a web worker, which provides the buffer.
+static esp_err_t send_file_body(httpd_req_t *req, file_response_t *resp, FILE *fd) {
+  char *buffer = web_worker_buffer();
+  if (resp->start && fseek(fd, resp->start, SEEK_SET) != 0) {
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
+    return ESP_FAIL;
+  }
+
+  int head_len = snprintf(buffer, WEB_WORKER_BUFSIZE,
+                          "HTTP/1.1 %s\r\n"
+                          "Content-Type: %s\r\n"
+                          "Content-Length: %u\r\n"
+                          "Accept-Ranges: bytes\r\n"
+                          "ETag: %s\r\n"
+                          "Cache-Control: %s\r\n"
+                          "Vary: Accept-Encoding\r\n",
+                          resp->partial ? "206 Partial Content" : "200 OK",
+                          resp->content_type, (unsigned)resp->len, resp->etag, resp->cache_control);
+  if (resp->gzipped) {
+    head_len += snprintf(buffer + head_len, WEB_WORKER_BUFSIZE - head_len, "Content-Encoding: gzip\r\n");
+  }
+  if (resp->partial) {
+    head_len += snprintf(buffer + head_len, WEB_WORKER_BUFSIZE - head_len, "Content-Range: %s\r\n", resp->content_range);
+  }
+  head_len += snprintf(buffer + head_len, WEB_WORKER_BUFSIZE - head_len, "\r\n");
+
+  if (send_all(req, buffer, head_len) != ESP_OK) {
+    ESP_LOGE(TAG, "File sending failed!");
+    return ESP_FAIL;
+  }
+
+  size_t remaining = resp->len;
+  while (remaining > 0) {
+    // Read file in chunks into the transfer buffer
+    size_t chunksize = fread(buffer, 1, min(remaining, (size_t)WEB_WORKER_BUFSIZE), fd);
+    if (chunksize == 0) {
+      // The file shrank under us, the client will see a short body
+      ESP_LOGE(TAG, "File read failed!");
+      return ESP_FAIL;
+    }
+
+    if (send_all(req, buffer, chunksize) != ESP_OK) {
+      ESP_LOGE(TAG, "File sending failed!");
+      return ESP_FAIL;
+    }
+    remaining -= chunksize;
+  }
+
+  return ESP_OK;
+}
+
+#if WITH_EMBEDDED_ASSETS
+// Send an asset of the firmware bundle straight from flash
+static esp_err_t send_asset(httpd_req_t *req, const asset_entry_t *asset) {
+  bool gzipped = asset->gz_len > 0 && accepts_gzip(req);
+  file_response_t resp = {
+    .content_type = asset->mime,
+    .cache_control = strcmp(asset->mime, "text/html") == 0 ? CACHE_CONTROL_PAGE : CACHE_CONTROL_ASSET,
+    .etag = gzipped ? asset->gz_etag : asset->etag,
+    .gzipped = gzipped,
+    .total = gzipped ? asset->gz_len : asset->len,
+  };
+  return send_memory(req, &resp, (const char *)assets_data(gzipped ? asset->gz_offset : asset->offset));
+}
+#endif
+
+static void files_leave(void) {
+  __atomic_sub_fetch(&files_busy, 1, __ATOMIC_SEQ_CST);
+}
+
+// False while the filesystem is being replaced, leave with files_leave()
+static bool files_enter(void) {
+  __atomic_add_fetch(&files_busy, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&files_suspended, __ATOMIC_SEQ_CST)) {
+    files_leave();
+    return false;
+  }
+  return true;
+}
+
+// Refuse new file requests and wait for the running ones, false when
+// another update holds the files or they didn't finish in time
+static bool files_suspend(void) {
+  bool suspended = false;
+  if (!__atomic_compare_exchange_n(&files_suspended, &suspended, true, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    return false;
+  }
+  int64_t deadline = esp_timer_get_time() + FILES_SUSPEND_TIMEOUT_MS * 1000LL;
+  while (__atomic_load_n(&files_busy, __ATOMIC_SEQ_CST) > 0) {
+    if (esp_timer_get_time() > deadline) {
+      __atomic_store_n(&files_suspended, false, __ATOMIC_SEQ_CST);
+      return false;
+    }
+    vTaskDelay(FILES_SUSPEND_POLL_MS / portTICK_PERIOD_MS);
+  }
+  return true;
+}
+
+static void files_resume(void) {
+  __atomic_store_n(&files_suspended, false, __ATOMIC_SEQ_CST);
+}
+
+static esp_err_t send_files_busy(httpd_req_t *req) {
+  httpd_resp_set_status(req, "503 Service Unavailable");
+  httpd_resp_set_hdr(req, "Retry-After", "5");
+  httpd_resp_sendstr(req, "Filesystem update in progress, retry later");
+  return ESP_OK;
+}
+
+static esp_err_t download_file(httpd_req_t *req);
+
 // Handler to download a file from the server
 static esp_err_t download_get_handler(httpd_req_t *req) {
-  ESP_LOGE(TAG, "Request received for %s", req->uri);
+  ESP_LOGD(TAG, "Request received for %s", req->uri);
 
+  // Before any lookup, bundled assets included
+  if (is_private_key(req->uri)) {
+    httpd_resp_send_err(req, HTTPD_403_FORBIDDEN, "Forbidden");
+    return ESP_FAIL;
+  }
+
+#if WITH_EMBEDDED_ASSETS
+  // Bundled assets first, they need no filesystem access at all
+  const asset_entry_t *asset = assets_find(req->uri, strcspn(req->uri, "?#"));
+  if (asset) {
+    return send_asset(req, asset);
+  }
+#endif
+
+  if (!files_enter()) {
+    return send_files_busy(req);
+  }
+  esp_err_t ret = download_file(req);
+  files_leave();
+  return ret;
+}
+
+// A file of the filesystem, possibly resubmitted to a worker
+static esp_err_t download_file(httpd_req_t *req) {
   char filepath[FILE_PATH_MAX];
   FILE *fd = NULL;
   struct stat file_stat;
@@ -117,17 +767,79 @@ static esp_err_t download_get_handler(httpd_req_t *req) {
     return ESP_FAIL;
   }
 
-  if (strcmp(filename, "/") == 0 || strcmp(filename, "/hotspot-detect.html") == 0) {
+  if (strcmp(filename, "/") == 0) {
     strcpy(filepath, "/spiffs/index.html");
     filename = "/index.html";
   }
 
-  if (stat(filepath, &file_stat) == -1) {
-      ESP_LOGE(TAG, "Failed to stat file: %s", filepath);
+  // Type and caching policy come from the requested name, not the variant sent
+  file_response_t resp = {
+    .content_type = content_type_from_file(filename),
+    .cache_control = IS_FILE_EXTENSION(filename, ".html") ? CACHE_CONTROL_PAGE : CACHE_CONTROL_ASSET,
+  };
+
+  // Repeat requests are answered from RAM
+  bool gzip_accepted = accepts_gzip(req);
+  cache_entry_t *entry = cache_acquire(filepath, gzip_accepted);
+  if (entry) {
+    resp.etag = entry->etag;
+    resp.gzipped = entry->gzipped;
+    resp.total = entry->len;
+    esp_err_t ret = send_memory(req, &resp, entry->data);
+    cache_release(entry);
+    return ret;
+  }
+
+  // Prefer the precompressed variant when the client can decode it
+  bool gzipped = false;
+  size_t filepath_len = strlen(filepath);
+  if (filepath_len + sizeof(GZIP_SUFFIX) <= sizeof(filepath) && gzip_accepted) {
+    strcpy(filepath + filepath_len, GZIP_SUFFIX);
+    gzipped = stat(filepath, &file_stat) == 0;
+    if (!gzipped) {
+      filepath[filepath_len] = '\0';
+    }
+  }
+
+  if (!gzipped && stat(filepath, &file_stat) == -1) {
+      ESP_LOGD(TAG, "Failed to stat file: %s", filepath);
       // If file not present on SPIFFS, redirect to root
       return redirect_root(req);
   }
 
+  // The digest takes a read of the whole file, once per file since boot.
+  // Not on the httpd task for large ones, see the worker below.
+  uint32_t digest;
+  if (!digest_lookup(filepath, &digest)) {
+    if (file_stat.st_size > CACHE_MAX_FILE_SIZE && !web_worker_current()) {
+      return web_worker_submit(req, download_get_handler);
+    }
+    if (!digest_compute(filepath, &digest)) {
+      ESP_LOGE(TAG, "Failed to read existing file: %s", filepath);
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
+      return ESP_FAIL;
+    }
+  }
+
+  char etag[ETAG_MAX_LEN];
+  make_etag(etag, sizeof(etag), &file_stat, digest, gzipped);
+  resp.etag = etag;
+  resp.gzipped = gzipped;
+  resp.total = file_stat.st_size;
+
+  // Client copy is still valid or the range is wrong, no need to touch the file
+  respond_t outcome = evaluate_request(req, &resp);
+  if (outcome != RESPOND_BODY) {
+    ESP_LOGD(TAG, "No body (%d) for %s", outcome, filename);
+    return send_without_body(req, &resp, outcome);
+  }
+
+  // Large files are streamed from a worker, the httpd task goes back to the
+  // WebSocket traffic meanwhile. The worker runs this handler again.
+  if (file_stat.st_size > CACHE_MAX_FILE_SIZE && !web_worker_current()) {
+    return web_worker_submit(req, download_get_handler);
+  }
+
   fd = fopen(filepath, "r");
   if (!fd) {
     ESP_LOGE(TAG, "Failed to read existing file: %s", filepath);
@@ -136,44 +848,48 @@ static esp_err_t download_get_handler(httpd_req_t *req) {
     return ESP_FAIL;
   }
 
-  ESP_LOGI(TAG, "Sending file: %s (%ld bytes)...", filename, file_stat.st_size);
-  set_content_type_from_file(req, filename);
-
-  size_t chunksize;
-  do {
-    // Read file in chunks into the scratch buffer
-    chunksize = fread(scratch_buffer, 1, SCRATCH_BUFSIZE, fd);
-
-    if (chunksize > 0) {
-      // Send the buffer contents as HTTP response chunk
-      if (httpd_resp_send_chunk(req, scratch_buffer, chunksize) != ESP_OK) {
-        fclose(fd);
-        ESP_LOGE(TAG, "File sending failed!");
-        // Abort sending file
-        httpd_resp_sendstr_chunk(req, NULL);
-        // Respond with 500 Internal Server Error
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send file");
-        return ESP_FAIL;
-      }
+  // Small files are kept for the next requests
+  if (file_stat.st_size <= CACHE_MAX_FILE_SIZE) {
+    // The cache key is the identity file path
+    filepath[filepath_len] = '\0';
+    entry = cache_load(filepath, gzip_accepted, gzipped, etag, fd, file_stat.st_size);
+    if (entry != NULL) {
+      fclose(fd);
+      esp_err_t ret = send_memory_body(req, &resp, entry->data);
+      cache_release(entry);
+      return ret;
     }
+    // No memory for the entry (fragmented heap) or a short read: stream it
+    // uncached instead, from a worker which has the transfer buffer
+    ESP_LOGW(TAG, "Not cached: %s", filepath);
+    if (!web_worker_current()) {
+      fclose(fd);
+      return web_worker_submit(req, download_get_handler);
+    }
+    rewind(fd);
+  }
 
-    // Keep looping till the whole file is sent
-  } while (chunksize != 0);
+  ESP_LOGD(TAG, "Sending file: %s (%u of %ld bytes)...", filepath, (unsigned)resp.len, file_stat.st_size);
+  esp_err_t ret = send_file_body(req, &resp, fd);
 
   // Close file after sending complete
   fclose(fd);
-  ESP_LOGI(TAG, "File sending complete");
-
-  // Respond with an empty chunk to signal HTTP response completion
-  httpd_resp_send_chunk(req, NULL, 0);
-  return ESP_OK;
+  ESP_LOGD(TAG, "File sending complete");
+  return ret;
 }
 
-// Handler to upload a new binary onto the chip
-static esp_err_t upload_ota_handler(httpd_req_t *req) {
+// Handler to upload a new binary onto the chip, either the firmware or a
+// whole filesystem image
+static esp_err_t upload_ota_handler(httpd_req_t *req, ota_target_t target) {
   int received;
+  upload_progress_t progress = { 0 };
+
+  if (target == OTA_TARGET_STORAGE) {
+    // Files are about to disappear, don't serve them from RAM anymore
+    cache_invalidate_all();
+  }
 
-  esp_err_t ret = esp_ota_begin(esp_ota_get_next_update_partition(NULL), OTA_SIZE_UNKNOWN, &ota_handle);
+  esp_err_t ret = ota_begin(req->content_len, target);
   if (ret != ESP_OK) {
     ESP_LOGE(TAG, "Failed to begin OTAs");
     // Respond with 500 Internal Server Error
@@ -185,49 +901,58 @@ static esp_err_t upload_ota_handler(httpd_req_t *req) {
   int remaining = req->content_len;
 
   while (remaining > 0) {
-    broadcast_upload_progress(req->content_len - remaining, req->content_len);
+    report_upload_progress(&progress, req->content_len - remaining, req->content_len);
 
-    // Receive the file part by part into a buffer
-    if ((received = httpd_req_recv(req, scratch_buffer, min(remaining, SCRATCH_BUFSIZE))) <= 0) {
-      if (received == HTTPD_SOCK_ERR_TIMEOUT) {
-        // Retry if timeout occurred
-        continue;
-      }
-
-      // In case of unrecoverable error, close and delete the unfinished file
-      esp_ota_end(ota_handle);
+    // Wait for a buffer the writer task is done with
+    ota_buffer_t buffer;
+    if (ota_next_buffer(&buffer) != ESP_OK) {
+      ota_abort();
 
-      ESP_LOGE(TAG, "File reception failed!");
+      ESP_LOGE(TAG, "OTA write failed!");
       // Respond with 500 Internal Server Error
-      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive file");
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to OTA");
       return ESP_FAIL;
     }
 
-    // Write buffer content to file on storage
-    if (received && esp_ota_write(ota_handle, scratch_buffer, received) != ESP_OK) {
-      // Couldn't write everything to file!
-      esp_ota_end(ota_handle);
+    // Fill it completely, the previous one is written to flash meanwhile
+    size_t filled = 0;
+    while (filled < buffer.size && remaining > 0) {
+      // Receive the file part by part into a buffer
+      if ((received = httpd_req_recv(req, buffer.data + filled, min((size_t)remaining, buffer.size - filled))) <= 0) {
+        if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+          // Retry if timeout occurred
+          continue;
+        }
 
-      ESP_LOGE(TAG, "OTA write failed!");
-      // Respond with 500 Internal Server Error
-      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to OTA");
-      return ESP_FAIL;
+        // In case of unrecoverable error, drop the unfinished update
+        ota_abort();
+
+        ESP_LOGE(TAG, "File reception failed!");
+        // Respond with 500 Internal Server Error
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive file");
+        return ESP_FAIL;
+      }
+
+      filled += received;
+      // Keep track of remaining size of the file left to be uploaded
+      remaining -= received;
     }
 
-    // Keep track of remaining size of the file left to be uploaded
-    remaining -= received;
+    ota_commit_buffer(&buffer, filled);
   }
 
-  broadcast_upload_progress(req->content_len, req->content_len);
+  report_upload_progress(&progress, req->content_len, req->content_len);
 
-  // End OTA upon upload completion
-  esp_ota_end(ota_handle);
-  // Set new boot partition
-  ret = esp_ota_set_boot_partition(esp_ota_get_next_update_partition(NULL));
+  // Flush the last buffers, validate the image and set the new boot partition
+  ret = ota_finish();
+  if (target == OTA_TARGET_STORAGE) {
+    // Anything cached while the update ran came from the old filesystem
+    cache_invalidate_all();
+  }
   if (ret != ESP_OK) {
-    ESP_LOGE(TAG, "Set new boot partition failed!");
+    ESP_LOGE(TAG, "OTA finish failed!");
     // Respond with 500 Internal Server Error
-    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to set new boot partition");
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write or validate the update");
     return ESP_FAIL;
   }
 
@@ -238,7 +963,9 @@ static esp_err_t upload_ota_handler(httpd_req_t *req) {
   httpd_resp_set_hdr(req, "Location", "/");
   httpd_resp_sendstr(req, "File uploaded successfully");
 
-  xTaskCreate(&restart_task, "restart_task", 2048, NULL, 10, NULL);  
+  if (target == OTA_TARGET_APP) {
+    xTaskCreate(&restart_task, "restart_task", 2048, NULL, 10, NULL);
+  }
   return ESP_OK;
 }
 
@@ -262,18 +989,23 @@ static esp_err_t upload_file_handler(httpd_req_t *req, const char *filepath, con
     return ESP_FAIL;
   }
 
+  // Cached copies of the previous content must not be served anymore
+  cache_invalidate(filepath);
+
   ESP_LOGI(TAG, "Receiving file : %s...", filename);
 
+  char *buffer = web_worker_buffer();
   int received;
+  upload_progress_t progress = { 0 };
 
   // Content length of the request gives the size of the file being uploaded
   int remaining = req->content_len;
 
   while (remaining > 0) {
-    broadcast_upload_progress(req->content_len - remaining, req->content_len);
+    report_upload_progress(&progress, req->content_len - remaining, req->content_len);
 
     // Receive the file part by part into a buffer
-    if ((received = httpd_req_recv(req, scratch_buffer, min(remaining, SCRATCH_BUFSIZE))) <= 0) {
+    if ((received = httpd_req_recv(req, buffer, min(remaining, WEB_WORKER_BUFSIZE))) <= 0) {
       if (received == HTTPD_SOCK_ERR_TIMEOUT) {
         // Retry if timeout occurred
         continue;
@@ -290,7 +1022,7 @@ static esp_err_t upload_file_handler(httpd_req_t *req, const char *filepath, con
     }
 
     // Write buffer content to file on storage
-    if (received && (received != fwrite(scratch_buffer, 1, received, fd))) {
+    if (received && (received != fwrite(buffer, 1, received, fd))) {
       // Couldn't write everything to file!
       // Storage may be full?
       fclose(fd);
@@ -306,11 +1038,20 @@ static esp_err_t upload_file_handler(httpd_req_t *req, const char *filepath, con
     remaining -= received;
   }
 
-  broadcast_upload_progress(req->content_len, req->content_len);
+  report_upload_progress(&progress, req->content_len, req->content_len);
 
   // Close file upon upload completion
   fclose(fd);
 
+  // A precompressed variant of the previous version would be served instead
+  // of the new file, remove it
+  if (!IS_FILE_EXTENSION(filename, GZIP_SUFFIX)) {
+    char gz_path[FILE_PATH_MAX + sizeof(GZIP_SUFFIX)];
+    snprintf(gz_path, sizeof(gz_path), "%s" GZIP_SUFFIX, filepath);
+    unlink(gz_path);
+  }
+  cache_invalidate(filepath);
+
   ESP_LOGI(TAG, "File reception complete");
 
   // Redirect onto root
@@ -322,6 +1063,11 @@ static esp_err_t upload_file_handler(httpd_req_t *req, const char *filepath, con
 
 // Handler to upload a something onto the server
 static esp_err_t upload_post_handler(httpd_req_t *req) {
+  // Receiving takes long, do it on a worker
+  if (!web_worker_current()) {
+    return web_worker_submit(req, upload_post_handler);
+  }
+
   char filepath[FILE_PATH_MAX];
 
   // Skip leading "/upload" from URI to get filename
@@ -340,16 +1086,47 @@ static esp_err_t upload_post_handler(httpd_req_t *req) {
     return ESP_FAIL;
   }
 
-  if (IS_FILE_EXTENSION(filename, ".bin")) {
-    return upload_ota_handler(req);
+  // Firmware, plain or packed by tools/pack_firmware.py
+  if (IS_FILE_EXTENSION(filename, ".bin") || IS_FILE_EXTENSION(filename, ".binz")) {
+    return upload_ota_handler(req, OTA_TARGET_APP);
+  } else if (IS_FILE_EXTENSION(filename, ".img")) {
+    // Filesystem image, plain or packed, replaces all the files at once.
+    // Nothing may hold a file while its partition is unmounted.
+    if (!files_suspend()) {
+      return send_files_busy(req);
+    }
+    esp_err_t ret = upload_ota_handler(req, OTA_TARGET_STORAGE);
+    files_resume();
+    return ret;
   } else {
-    return upload_file_handler(req, filepath, filename);
+    if (!files_enter()) {
+      return send_files_busy(req);
+    }
+    esp_err_t ret = upload_file_handler(req, filepath, filename);
+    files_leave();
+    return ret;
   }
 }
 
 void start_web_file(httpd_handle_t server) {
   ESP_LOGI(TAG, "Start web file");
 
+  if (cache_mutex == NULL) {
+    cache_mutex = xSemaphoreCreateMutex();
+  }
+  start_web_workers();
+
+  // Exact matches, ahead of the wildcard below
+  for (size_t i = 0; i < CAPTIVE_PROBE_COUNT; ++i) {
+    httpd_uri_t probe = {
+      .uri       = CAPTIVE_PROBES[i],
+      .method    = HTTP_GET,
+      .handler   = captive_probe_handler,
+      .user_ctx  = NULL
+    };
+    httpd_register_uri_handler(server, &probe);
+  }
+
   // URI handler for accessing files from server
   httpd_uri_t file_download = {
     .uri       = "/*",  // Match all URIs of type /path/to/file
@@ -3,6 +3,20 @@
 
 #include <esp_http_server.h>
 
+typedef struct {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t evictions;
+  uint32_t invalidations;
+  uint32_t probes;  // captive portal probes, answered without the cache
+  size_t bytes;     // file data held in RAM
+  size_t capacity;
+  uint8_t entries;
+} webfile_cache_stats_t;
+
 void start_web_file(httpd_handle_t server);
 
+// Counters of the RAM file cache
+void webfile_get_cache_stats(webfile_cache_stats_t *out);
+
 #endif
\ No newline at end of file
@@ -1,15 +1,34 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_WEBSERVER
+#include "logbuf.h"
+
 #include "webserver.h"
 
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "freertos/task.h"
 #include <esp_wifi.h>
 #include <esp_event.h>
 #include <esp_log.h>
 #include <esp_system.h>
+#include "esp_random.h"
+#include "esp_app_desc.h"
 #include "esp_netif.h"
 #include <esp_http_server.h>
 
+#include "boot.h"
+#include "captdns.h"
 #include "websocket.h"
 #include "webfile.h"
+#include "webworker.h"
+#include "spiffs.h"
+#include "power_wheel.h"
+#include "storage.h"
+#include "settings.h"
+#include "mqtt.h"
+#include "wifi.h"
+#include "latency.h"
 
 // Local variables
 
@@ -17,8 +36,284 @@ static const char *TAG = "webserver";
 
 static httpd_handle_t server = NULL;
 
+// Serialized JSON documents, rebuilt only when their source version moves.
+// Handlers all run on the httpd task, so no locking.
+typedef struct {
+  bool valid;
+  uint32_t version;
+  char etag[24];
+  char body[512];
+} json_cache_t;
+
+static json_cache_t state_cache;
+static json_cache_t config_cache;
+// Versions restart at 0 on every boot, keep ETags from colliding
+static uint32_t boot_id = 0;
+
 // Implementation
 
+// Tail of the buffered log output, with the ring counters as headers
+static esp_err_t log_get_handler(httpd_req_t *req) {
+  logbuf_stats_t stats;
+  logbuf_get_stats(&stats);
+
+  char written[12], dropped[12], truncated[12];
+  snprintf(written, sizeof(written), "%u", (unsigned)stats.written);
+  snprintf(dropped, sizeof(dropped), "%u", (unsigned)stats.dropped);
+  snprintf(truncated, sizeof(truncated), "%u", (unsigned)stats.truncated);
+
+  char *tail = malloc(LOGBUF_TAIL_LEN);
+  if (tail == NULL) {
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    return ESP_FAIL;
+  }
+  size_t len = logbuf_copy_tail(tail, LOGBUF_TAIL_LEN);
+
+  httpd_resp_set_type(req, "text/plain");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  httpd_resp_set_hdr(req, "X-Log-Written", written);
+  httpd_resp_set_hdr(req, "X-Log-Dropped", dropped);
+  httpd_resp_set_hdr(req, "X-Log-Truncated", truncated);
+  esp_err_t ret = httpd_resp_send(req, tail, len);
+  free(tail);
+
+  return ret;
+}
+
+// Counters of the web file RAM cache
+static esp_err_t cache_get_handler(httpd_req_t *req) {
+  webfile_cache_stats_t stats;
+  webfile_get_cache_stats(&stats);
+
+  uint32_t lookups = stats.hits + stats.misses;
+  char body[224];
+  snprintf(body, sizeof(body),
+           "{\"hits\":%u,\"misses\":%u,\"hit_rate\":%.3f,\"evictions\":%u,\"invalidations\":%u,"
+           "\"entries\":%u,\"bytes\":%u,\"capacity\":%u,\"probes\":%u}",
+           (unsigned)stats.hits, (unsigned)stats.misses, lookups ? (double)stats.hits / lookups : 0.0,
+           (unsigned)stats.evictions, (unsigned)stats.invalidations,
+           (unsigned)stats.entries, (unsigned)stats.bytes, (unsigned)stats.capacity, (unsigned)stats.probes);
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_sendstr(req, body);
+}
+
+// Boot trace, us since esp_timer started for each stage, 0 for the ones
+// still running
+static esp_err_t boot_get_handler(httpd_req_t *req) {
+  char body[384];
+  size_t pos = snprintf(body, sizeof(body), "{\"drivable_us\":%lld,\"stages\":{",
+                        (long long)boot_stage_us(BOOT_DRIVABLE));
+
+  for (boot_stage_t stage = 0; stage < BOOT_STAGE_COUNT && pos < sizeof(body); ++stage) {
+    pos += snprintf(body + pos, sizeof(body) - pos, "%s\"%s\":%lld", stage > 0 ? "," : "",
+                    boot_stage_name(stage), (long long)boot_stage_us(stage));
+  }
+  if (pos < sizeof(body)) {
+    snprintf(body + pos, sizeof(body) - pos, "}}");
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_sendstr(req, body);
+}
+
+// Counters of the write-behind settings cache
+static esp_err_t storage_get_handler(httpd_req_t *req) {
+  storage_stats_t stats;
+  storage_get_stats(&stats);
+
+  char body[128];
+  snprintf(body, sizeof(body),
+           "{\"writes\":%u,\"flushed\":%u,\"avoided\":%u,\"commits\":%u,\"dirty\":%u}",
+           (unsigned)stats.writes, (unsigned)stats.flushed, (unsigned)stats.avoided,
+           (unsigned)stats.commits, (unsigned)stats.dirty);
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_sendstr(req, body);
+}
+
+// Reconnect counters of the home network link, and the captive portal DNS
+// replies of the soft AP
+static esp_err_t wifi_get_handler(httpd_req_t *req) {
+  wifi_sta_stats_t stats;
+  wifi_get_sta_stats(&stats);
+  captdns_stats_t dns;
+  captdns_get_stats(&dns);
+
+  char body[352];
+  snprintf(body, sizeof(body),
+           "{\"attempts\":%u,\"outages\":%u,\"probes\":%u,\"probe_hits\":%u,\"backoff_ms\":%u,"
+           "\"disconnected_ms\":%llu,\"connect_ms\":%u,\"cached_ap\":%s,"
+           "\"dns\":{\"answers\":%u,\"nodata\":%u,\"nxdomain\":%u,\"errors\":%u,\"dropped\":%u}}",
+           (unsigned)stats.attempts, (unsigned)stats.outages, (unsigned)stats.probes,
+           (unsigned)stats.probe_hits, (unsigned)stats.backoff_ms, (unsigned long long)stats.disconnected_ms,
+           (unsigned)wifi_connect_time_ms(), wifi_connected_to_cached_ap() ? "true" : "false",
+           (unsigned)dns.answers, (unsigned)dns.nodata, (unsigned)dns.nxdomain, (unsigned)dns.errors,
+           (unsigned)dns.dropped);
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_sendstr(req, body);
+}
+
+// Radio profiles, time spent in each and the WebSocket round trips seen
+// meanwhile. There is no current sensor: TX power, beacon interval and DTIM
+// stand in for the draw.
+static esp_err_t radio_get_handler(httpd_req_t *req) {
+  char body[768];
+  size_t pos = snprintf(body, sizeof(body), "{\"profiles\":[");
+
+  for (int i = 0; i < WIFI_RADIO_PROFILE_COUNT && pos < sizeof(body); ++i) {
+    wifi_radio_stats_t stats;
+    wifi_get_radio_stats(i, &stats);
+    pos += snprintf(body + pos, sizeof(body) - pos,
+                    "%s{\"name\":\"%s\",\"active\":%s,\"time_s\":%u,\"rtt_samples\":%u,\"rtt_avg_us\":%u,"
+                    "\"rtt_max_us\":%u,\"tx_dbm\":%.1f,\"beacon_ms\":%u,\"dtim\":%u}",
+                    i > 0 ? "," : "", stats.name, stats.active ? "true" : "false", (unsigned)stats.time_s,
+                    (unsigned)stats.rtt_samples, (unsigned)stats.rtt_avg_us, (unsigned)stats.rtt_max_us,
+                    stats.tx_power_dbm, (unsigned)stats.beacon_interval_ms, (unsigned)stats.dtim_period);
+  }
+  if (pos < sizeof(body)) {
+    snprintf(body + pos, sizeof(body) - pos, "]}");
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_sendstr(req, body);
+}
+
+#if WITH_LATENCY_BENCH
+// Filesystem timings of this build's backend, compare builds with and
+// without WITH_LITTLEFS. Bench builds only, it wears the flash. Takes
+// seconds: runs on a web worker so WebSocket control frames, the
+// emergency stop included, are still handled meanwhile.
+static esp_err_t fsbench_post_handler(httpd_req_t *req) {
+  if (!web_worker_current()) {
+    return web_worker_submit(req, fsbench_post_handler);
+  }
+
+  spiffs_bench_t bench;
+  esp_err_t ret = spiffs_benchmark(&bench);
+
+  char body[224];
+  snprintf(body, sizeof(body),
+           "{\"backend\":\"%s\",\"ok\":%s,\"write_avg_us\":%u,\"write_max_us\":%u,"
+           "\"stat_avg_us\":%u,\"stat_max_us\":%u,\"read_kbps\":%u,\"remove_avg_us\":%u}",
+           SPIFFS_BACKEND, ret == ESP_OK ? "true" : "false",
+           (unsigned)bench.write_avg, (unsigned)bench.write_max, (unsigned)bench.stat_avg,
+           (unsigned)bench.stat_max, (unsigned)bench.read_kbps, (unsigned)bench.remove_avg);
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_sendstr(req, body);
+}
+
+// Percentiles of every latency probe, with the firmware they were taken on
+static esp_err_t bench_get_handler(httpd_req_t *req) {
+  const esp_app_desc_t *app = esp_app_get_description();
+  char body[640];
+  int len = snprintf(body, sizeof(body),
+                     "{\"firmware\":\"%s\",\"idf\":\"%s\",\"wifi_connect_ms\":%u,\"wifi_cached_ap\":%s,"
+                     "\"mqtt_connect_ms\":%u,\"probes\":{",
+                     app->version, app->idf_ver, (unsigned)wifi_connect_time_ms(),
+                     wifi_connected_to_cached_ap() ? "true" : "false", (unsigned)mqtt_connect_time_ms());
+
+  for (int i = 0; i < LATENCY_PROBE_COUNT && len < (int)sizeof(body); ++i) {
+    latency_stats_t stats;
+    latency_get_stats(i, &stats);
+    len += snprintf(body + len, sizeof(body) - len,
+                    "%s\"%s\":{\"count\":%u,\"p50_us\":%u,\"p90_us\":%u,\"p99_us\":%u,\"max_us\":%u}",
+                    i ? "," : "", latency_probe_name(i), (unsigned)stats.count, (unsigned)stats.p50,
+                    (unsigned)stats.p90, (unsigned)stats.p99, (unsigned)stats.max);
+  }
+  if (len < (int)sizeof(body)) {
+    snprintf(body + len, sizeof(body) - len, "}}");
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_sendstr(req, body);
+}
+
+// Drive the probes: ?reset, ?pedal=<-100..100> or ?pedal=release
+static esp_err_t bench_post_handler(httpd_req_t *req) {
+  char query[48], value[16];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing query");
+    return ESP_FAIL;
+  }
+
+  if (httpd_query_key_value(query, "reset", value, sizeof(value)) != ESP_ERR_NOT_FOUND) {
+    latency_reset();
+  }
+  if (httpd_query_key_value(query, "pedal", value, sizeof(value)) == ESP_OK) {
+    if (strcmp(value, "release") == 0) {
+      power_wheel_bench_pedal(false, 0);
+    } else {
+      power_wheel_bench_pedal(true, atoi(value));
+    }
+  }
+
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, NULL, 0);
+}
+#endif
+
+static void serialize_state(char *body, size_t len) {
+  power_wheel_state_t state;
+  power_wheel_get_state(&state);
+  snprintf(body, len,
+           "{\"current_speed\":%.1f,\"max_forward\":%.1f,\"max_backward\":%.1f,"
+           "\"emergency_stop\":%s,\"total_runtime_s\":%llu}",
+           state.current_speed, state.max_forward, state.max_backward,
+           state.emergency_stop ? "true" : "false", (unsigned long long)state.total_runtime_s);
+}
+
+// The settings shown in the UI, passwords are never part of it
+static void serialize_config(char *body, size_t len) {
+  if (settings_serialize(body, len, SETTING_UI) == 0) {
+    snprintf(body, len, "{}");
+  }
+}
+
+// Answer from the cache, 304 when the client already has this version
+static esp_err_t send_cached_json(httpd_req_t *req, json_cache_t *cache, uint32_t version,
+                                  void (*serialize)(char *body, size_t len)) {
+  if (!cache->valid || cache->version != version) {
+    serialize(cache->body, sizeof(cache->body));
+    snprintf(cache->etag, sizeof(cache->etag), "\"%08x-%u\"", (unsigned)boot_id, (unsigned)version);
+    cache->version = version;
+    cache->valid = true;
+  }
+
+  httpd_resp_set_hdr(req, "ETag", cache->etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+  char if_none_match[64];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+      strstr(if_none_match, cache->etag) != NULL) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  return httpd_resp_sendstr(req, cache->body);
+}
+
+// Driving state for pollers that don't want a WebSocket
+static esp_err_t state_get_handler(httpd_req_t *req) {
+  power_wheel_state_t state;
+  power_wheel_get_state(&state);
+  return send_cached_json(req, &state_cache, state.version, serialize_state);
+}
+
+static esp_err_t config_get_handler(httpd_req_t *req) {
+  return send_cached_json(req, &config_cache, power_wheel_config_version(), serialize_config);
+}
+
 static void on_client_disconnected(httpd_handle_t hd, int sockfd) {
   on_ws_client_disconnected(sockfd);
 }
@@ -30,6 +325,8 @@ static httpd_handle_t start_webserver(void) {
   config.close_fn = on_client_disconnected;
   config.uri_match_fn = httpd_uri_match_wildcard;
   config.lru_purge_enable = true;
+  // WebSocket, API endpoints, captive portal probes and the web files
+  config.max_uri_handlers = 24;
 
   ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
   esp_err_t ret = httpd_start(&server, &config);
@@ -41,40 +338,107 @@ static httpd_handle_t start_webserver(void) {
   ESP_LOGI(TAG, "Registering URI handlers");
   
   start_websocket(server);
-  start_web_file(server);
 
-  return server;
-}
+  // API handlers go before the web files, which match every other URI
+  httpd_uri_t log_tail = {
+    .uri       = "/api/log",
+    .method    = HTTP_GET,
+    .handler   = log_get_handler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &log_tail);
 
-static void disconnect_handler(void* arg, esp_event_base_t event_base, 
-                               int32_t event_id, void* event_data) {
-  httpd_handle_t* server = (httpd_handle_t*) arg;
-  if (*server) {
-    ESP_LOGI(TAG, "Stopping webserver");
+  httpd_uri_t cache_stats = {
+    .uri       = "/api/cache",
+    .method    = HTTP_GET,
+    .handler   = cache_get_handler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &cache_stats);
 
-    httpd_stop(*server);
+  httpd_uri_t boot_trace = {
+    .uri       = "/api/boot",
+    .method    = HTTP_GET,
+    .handler   = boot_get_handler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &boot_trace);
 
-    stop_websocket();
+  httpd_uri_t storage_stats = {
+    .uri       = "/api/storage",
+    .method    = HTTP_GET,
+    .handler   = storage_get_handler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &storage_stats);
 
-    *server = NULL;
-  }
-}
+  httpd_uri_t wifi_stats = {
+    .uri       = "/api/wifi",
+    .method    = HTTP_GET,
+    .handler   = wifi_get_handler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &wifi_stats);
 
-static void connect_handler(void* arg, esp_event_base_t event_base, 
-                            int32_t event_id, void* event_data) {
-  httpd_handle_t* server = (httpd_handle_t*) arg;
-  if (*server == NULL) {
-    ESP_LOGI(TAG, "Starting webserver");
+  httpd_uri_t radio_stats = {
+    .uri       = "/api/radio",
+    .method    = HTTP_GET,
+    .handler   = radio_get_handler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &radio_stats);
 
-    *server = start_webserver();
-  }
+  httpd_uri_t state = {
+    .uri       = "/api/state",
+    .method    = HTTP_GET,
+    .handler   = state_get_handler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &state);
+
+  httpd_uri_t config_get = {
+    .uri       = "/api/config",
+    .method    = HTTP_GET,
+    .handler   = config_get_handler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &config_get);
+
+#if WITH_LATENCY_BENCH
+  httpd_uri_t bench_get = {
+    .uri       = "/api/bench",
+    .method    = HTTP_GET,
+    .handler   = bench_get_handler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &bench_get);
+
+  httpd_uri_t bench_post = {
+    .uri       = "/api/bench",
+    .method    = HTTP_POST,
+    .handler   = bench_post_handler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &bench_post);
+
+  httpd_uri_t fs_bench = {
+    .uri       = "/api/fsbench",
+    .method    = HTTP_POST,
+    .handler   = fsbench_post_handler,
+    .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &fs_bench);
+#endif
+
+  start_web_file(server);
+
+  return server;
 }
 
 void setup_server(void) {
-  // Register to WIFI events
-  ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &connect_handler, &server));
-  ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &disconnect_handler, &server));
+  boot_id = esp_random();
 
-  // Start the server
+  // Start the server. It listens on every interface, so it stays up for
+  // the firmware's lifetime whatever the STA link does
   server = start_webserver();
 }
@@ -1,3 +1,6 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_WEBSOCKET
+#include "logbuf.h"
+
 #include "websocket.h"
 
 #include "freertos/task.h"
@@ -69,8 +72,9 @@ void on_ws_client_disconnected(int sockfd) {
 esp_err_t broadcast_message(char* msg) {
   esp_err_t ret;
 
+  // Down while the STA reconnects, and at boot until the network is up
   if (server == NULL) {
-    ESP_LOGE(TAG, "Tried to broadcast a message while server down");
+    ESP_LOGD(TAG, "Tried to broadcast a message while server down");
     return ESP_FAIL;
   }
 
@@ -85,7 +89,7 @@ esp_err_t broadcast_message(char* msg) {
     ws_pkt.len = strlen(msg);
     ws_pkt.type = HTTPD_WS_TYPE_TEXT;
 
-    ESP_LOGI(TAG, "Send message to %i", clients_fd[i]);
+    ESP_LOGD(TAG, "Send message to %i", clients_fd[i]);
     ret = httpd_ws_send_frame_async(server, clients_fd[i], &ws_pkt);
     if (ret != ESP_OK) {
       on_ws_client_disconnected(clients_fd[i]);
@@ -115,7 +119,7 @@ esp_err_t receive_message(httpd_req_t *req) {
     ESP_LOGE(TAG, "httpd_ws_recv_frame failed to get frame len with %d", ret);
     return ret;
   }
-  ESP_LOGI(TAG, "frame len is %d", ws_pkt.len);
+  ESP_LOGD(TAG, "frame len is %d", ws_pkt.len);
 
   if (ws_pkt.len) {
     // ws_pkt.len + 1 is for NULL termination as we are expecting a string
@@ -142,7 +146,7 @@ esp_err_t receive_message(httpd_req_t *req) {
     }
   }
 
-  ESP_LOGI(TAG, "Packet type: %d", ws_pkt.type);
+  ESP_LOGD(TAG, "Packet type: %d", ws_pkt.type);
 
   return ret;
 }
@@ -0,0 +1,112 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_WEBWORKER
+#include "logbuf.h"
+
+#include "webworker.h"
+
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+// Local variables
+
+static const char *TAG = "webworker";
+
+// Below httpd (5) so control frames are always handled first
+#define WEB_WORKER_PRIORITY 4
+#define WEB_WORKER_STACK_SIZE 4096
+
+typedef struct {
+  httpd_req_t *req;  // copy owned by the worker until completed
+  web_worker_handler_t handler;
+} web_job_t;
+
+static QueueHandle_t jobs = NULL;
+static SemaphoreHandle_t slots = NULL; // running plus queued transfers
+static TaskHandle_t workers[WEB_WORKER_COUNT];
+static char *buffers[WEB_WORKER_COUNT];
+
+// Implementations
+
+static int current_worker(void) {
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  for (int i = 0; i < WEB_WORKER_COUNT; ++i) {
+    if (workers[i] == self) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void worker_task(void *pvParameter) {
+  web_job_t job;
+
+  while (true) {
+    if (xQueueReceive(jobs, &job, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+
+    ESP_LOGD(TAG, "Running %s", job.req->uri);
+    job.handler(job.req);
+    httpd_req_async_handler_complete(job.req);
+    xSemaphoreGive(slots);
+  }
+}
+
+esp_err_t start_web_workers(void) {
+  if (jobs != NULL) {
+    return ESP_OK;
+  }
+
+  jobs = xQueueCreate(WEB_WORKER_COUNT + WEB_WORKER_QUEUE_LEN, sizeof(web_job_t));
+  slots = xSemaphoreCreateCounting(WEB_WORKER_COUNT + WEB_WORKER_QUEUE_LEN, WEB_WORKER_COUNT + WEB_WORKER_QUEUE_LEN);
+  if (jobs == NULL || slots == NULL) {
+    ESP_LOGE(TAG, "Not enough memory for the web workers");
+    return ESP_ERR_NO_MEM;
+  }
+
+  for (int i = 0; i < WEB_WORKER_COUNT; ++i) {
+    buffers[i] = malloc(WEB_WORKER_BUFSIZE);
+    if (buffers[i] == NULL ||
+        xTaskCreate(&worker_task, "web_worker_task", WEB_WORKER_STACK_SIZE, NULL, WEB_WORKER_PRIORITY, &workers[i]) != pdPASS) {
+      // Workers started so far keep running, the limit is just lower
+      ESP_LOGE(TAG, "Failed to start web worker %d", i);
+      return ESP_ERR_NO_MEM;
+    }
+  }
+
+  ESP_LOGI(TAG, "%d web workers started", WEB_WORKER_COUNT);
+  return ESP_OK;
+}
+
+bool web_worker_current(void) {
+  return current_worker() >= 0;
+}
+
+char *web_worker_buffer(void) {
+  int i = current_worker();
+  return i >= 0 ? buffers[i] : NULL;
+}
+
+esp_err_t web_worker_submit(httpd_req_t *req, web_worker_handler_t handler) {
+  if (slots == NULL || xSemaphoreTake(slots, 0) != pdTRUE) {
+    ESP_LOGW(TAG, "Too many transfers, rejecting %s", req->uri);
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "1");
+    httpd_resp_sendstr(req, "Busy, retry later");
+    return ESP_OK;
+  }
+
+  web_job_t job = { .handler = handler };
+  esp_err_t ret = httpd_req_async_handler_begin(req, &job.req);
+  if (ret != ESP_OK) {
+    xSemaphoreGive(slots);
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to start transfer");
+    return ESP_FAIL;
+  }
+
+  // Never blocks, the queue holds as many jobs as there are slots
+  xQueueSend(jobs, &job, 0);
+  return ESP_OK;
+}
@@ -0,0 +1,31 @@
+#ifndef WEBWORKER_H
+#define WEBWORKER_H
+
+#include <stdbool.h>
+#include <esp_http_server.h>
+
+// Long transfers (file downloads, uploads, OTA) run on a few worker tasks
+// through the httpd async request API, so the httpd task keeps serving
+// WebSocket control frames while they are in progress.
+
+#define WEB_WORKER_COUNT 2      // transfers running at the same time
+#define WEB_WORKER_QUEUE_LEN 2  // transfers waiting, more get a 503
+#define WEB_WORKER_BUFSIZE 8192 // per worker transfer buffer
+
+typedef esp_err_t (*web_worker_handler_t)(httpd_req_t *req);
+
+// Start the workers, safe to call again when the server restarts
+esp_err_t start_web_workers(void);
+
+// Whether the caller runs on a worker
+bool web_worker_current(void);
+
+// Run handler again for req on a worker and return to httpd right away.
+// Answers 503 when all workers and queue entries are taken.
+esp_err_t web_worker_submit(httpd_req_t *req, web_worker_handler_t handler);
+
+// Transfer buffer of the calling worker (WEB_WORKER_BUFSIZE bytes), NULL
+// outside of a worker
+char *web_worker_buffer(void);
+
+#endif
@@ -1,6 +1,11 @@
+#define LOG_LOCAL_LEVEL LOG_CEILING_WIFI
+#include "logbuf.h"
+
 #include "wifi.h"
+#include "mqtt.h"
 
 #include <string.h>
+#include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
@@ -9,12 +14,14 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_netif.h"
+#include "esp_random.h"
+#include "esp_timer.h"
 #include "mdns.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
 
-#include "storage.h"   // <— NVS helpers
+#include "settings.h"  // <— STA credentials and the cached AP
 #include "mqtt.h"      // <— optional: start/stop on link events (ok if you add later)
 
 /* --------- AP (captive portal) --------- */
@@ -23,35 +30,150 @@
 #define AP_CHANNEL     10
 #define AP_MAX_CONN    4
 
-/* NVS keys for STA creds */
-#define KEY_STA_SSID   "sta_ssid"
-#define KEY_STA_PASS   "sta_pass"
+/* --------- STA (home network) --------- */
+/* Reuse the cached IP lease instead of waiting on DHCP. Saves a round trip
+ * or two, but the address may have been given away meanwhile: only for
+ * networks where the car has a reserved address. */
+#ifndef WITH_STA_LEASE_REUSE
+#define WITH_STA_LEASE_REUSE 0
+#endif
+
+/* Reconnects back off exponentially while the home network is out of
+ * range, so they don't take the airtime of the soft AP. Meanwhile the
+ * cached channel is listened to passively, and beacons from the AP cut the
+ * wait short. */
+#define STA_BACKOFF_MIN_MS      250
+#define STA_BACKOFF_MAX_MS      30000
+#define STA_CONNECT_TIMEOUT_MS  10000  /* without any event, try again */
+#define STA_PROBE_INTERVAL_MS   2000
+#define STA_PROBE_DWELL_MS      120    /* beacons come every ~100 ms */
+
+/* --------- Radio profiles --------- */
+/* Control latency against battery life, picked at runtime. The firmware
+ * always runs AP+STA, where modem sleep is not available, so profiles only
+ * differ in TX power and in the soft AP beacon interval and DTIM (how often
+ * buffered frames are announced to sleeping phones). Changing those restarts
+ * the soft AP beacons, phones reassociate within a few seconds. */
+#define RADIO_TX_DEFAULT 0  /* the driver's, as read at start */
+
+typedef struct {
+    const char *name;
+    int8_t max_tx_power;       /* 0.25 dBm, or RADIO_TX_DEFAULT */
+    uint16_t beacon_interval;  /* TU, 1.024 ms */
+    uint8_t dtim_period;       /* AP, in beacons */
+} radio_profile_t;
 
-/* Buffers for loaded creds */
-static char g_sta_ssid[33];    // 32 + NUL
-static char g_sta_pass[65];    // 64 + NUL
+static const radio_profile_t RADIO_PROFILES[WIFI_RADIO_PROFILE_COUNT] = {
+    [WIFI_RADIO_PERFORMANCE] = { "performance", 84,               100, 1 },
+    [WIFI_RADIO_BALANCED]    = { "balanced",    RADIO_TX_DEFAULT, 100, 2 },
+    [WIFI_RADIO_ECO]         = { "eco",         44,               300, 3 },
+};
+
+/* Notifications of the retry task */
+#define RETRY_LINK_DOWN 0x01
+#define RETRY_GOT_IP    0x02
+#define RETRY_AP_SEEN   0x04
+#define RETRY_NOW       0x08  /* STA start, new credentials */
 
 static const char *TAG = "wifi_apsta";
 
+static esp_netif_t *s_sta_netif = NULL;
+static bool s_scan_next = false;        /* the last direct attempt failed */
+static bool s_direct = false;           /* current attempt skips the scan */
+static int64_t s_connect_start_us = 0;  /* 0 while connected or idle */
+static uint32_t s_connect_ms = 0;       /* STA start or link loss → IP */
+static bool s_connect_direct = false;
+
+static TaskHandle_t s_retry_task = NULL;
+static uint32_t s_backoff_ms = STA_BACKOFF_MIN_MS;
+static volatile bool s_associated = false;
+static volatile bool s_has_ip = false;
+static volatile bool s_leaving = false;  /* disconnected on purpose */
+static volatile bool s_probing = false;
+static wifi_sta_stats_t s_stats;
+static uint64_t s_down_ms = 0;          /* outages before the current one */
+
+static wifi_radio_profile_t s_radio = WIFI_RADIO_BALANCED;
+static int8_t s_default_tx_power = 80;
+static int64_t s_radio_since_us = 0;
+static struct {
+    uint64_t time_us;          /* before the current stretch */
+    uint32_t rtt_samples;
+    uint64_t rtt_total_us;
+    uint32_t rtt_max_us;
+} s_radio_stats[WIFI_RADIO_PROFILE_COUNT];
+
 /* Forward */
-static void apply_sta_config_and_connect(void);
+static wifi_radio_profile_t find_radio_profile(const char *name);
+static void apply_radio_profile(const radio_profile_t *profile, bool restart_ap);
+static void connect_sta(void);
+static void retry_task(void *pvParameter);
+static void remember_ap(const esp_netif_ip_info_t *ip_info);
 
 /* Wi-Fi + IP event handlers */
 static void wifi_event_handler(void* arg, esp_event_base_t base, int32_t id, void* data) {
     if (base == WIFI_EVENT) {
         switch (id) {
         case WIFI_EVENT_STA_START:
-            ESP_LOGI(TAG, "STA start → connecting…");
-            esp_wifi_connect();
+            /* Stay AP-only without saved credentials */
+            if (setting_sta_ssid()[0] != '\0') {
+                ESP_LOGI(TAG, "STA start → connecting…");
+                s_connect_start_us = esp_timer_get_time();
+                xTaskNotify(s_retry_task, RETRY_NOW, eSetBits);
+            }
+            break;
+        case WIFI_EVENT_STA_CONNECTED: {
+            wifi_event_sta_connected_t* ev = (wifi_event_sta_connected_t*)data;
+            s_associated = true;
+            /* Found elsewhere by a scan: the cached AP moved channel, or
+             * another AP of the network took over. Probes follow it. */
+            if (!s_direct) {
+                uint64_t bssid = 0;
+                for (int i = 0; i < 6; ++i) {
+                    bssid = (bssid << 8) | ev->bssid[i];
+                }
+                if (bssid != setting_sta_bssid() || ev->channel != setting_sta_channel()) {
+                    setting_set_sta_bssid(bssid);
+                    setting_set_sta_channel(ev->channel);
+                    setting_set_sta_ip(0);
+                }
+            }
             break;
-        case WIFI_EVENT_STA_DISCONNECTED:
-            ESP_LOGW(TAG, "STA disconnected → stopping MQTT and retrying…");
-            /* Optional */
+        }
+        case WIFI_EVENT_STA_DISCONNECTED: {
+            wifi_event_sta_disconnected_t* ev = (wifi_event_sta_disconnected_t*)data;
+            s_associated = false;
+            if (s_has_ip) {
+                s_has_ip = false;
+                s_stats.outages += s_leaving ? 0 : 1;
+                s_connect_start_us = esp_timer_get_time();
+            }
+            /* Optional: the client and its TLS session stay, only paused */
             #ifdef MQTT_H
-            mqtt_stop();
+            mqtt_link_down();
             #endif
-            esp_wifi_connect();
+            if (s_leaving) {
+                /* Left for new credentials, use them right away */
+                s_leaving = false;
+                xTaskNotify(s_retry_task, RETRY_NOW, eSetBits);
+                break;
+            }
+            ESP_LOGW(TAG, "STA disconnected (reason %d) → pausing MQTT and retrying…", ev->reason);
+            xTaskNotify(s_retry_task, RETRY_LINK_DOWN, eSetBits);
             break;
+        }
+        case WIFI_EVENT_SCAN_DONE: {
+            if (!s_probing) break;
+            s_probing = false;
+            uint16_t found = 0;
+            esp_wifi_scan_get_ap_num(&found);
+            esp_wifi_clear_ap_list();
+            if (found > 0) {
+                s_stats.probe_hits++;
+                xTaskNotify(s_retry_task, RETRY_AP_SEEN, eSetBits);
+            }
+            break;
+        }
         case WIFI_EVENT_AP_START:
             ESP_LOGI(TAG, "AP started (SSID: %s, channel: %d)", AP_SSID, AP_CHANNEL);
             break;
@@ -73,27 +195,38 @@ static void wifi_event_handler(void* arg, esp_event_base_t base, int32_t id, voi
 static void ip_event_handler(void* arg, esp_event_base_t base, int32_t id, void* data) {
     if (base == IP_EVENT && id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* e = (ip_event_got_ip_t*)data;
-        ESP_LOGI(TAG, "STA got IP: " IPSTR, IP2STR(&e->ip_info.ip));
+        if (s_connect_start_us != 0) {
+            s_connect_ms = (esp_timer_get_time() - s_connect_start_us) / 1000;
+            s_connect_start_us = 0;
+            s_down_ms += s_connect_ms;
+        }
+        s_connect_direct = s_direct;
+        s_scan_next = false;
+        s_has_ip = true;
+        xTaskNotify(s_retry_task, RETRY_GOT_IP, eSetBits);
         /* Optional: start MQTT when link is usable */
         #ifdef MQTT_H
         mqtt_start();
         #endif
+        ESP_LOGI(TAG, "STA got IP: " IPSTR " in %u ms (%s)", IP2STR(&e->ip_info.ip),
+                 (unsigned)s_connect_ms, s_direct ? "cached AP" : "scan");
+        remember_ap(&e->ip_info);
     }
 }
 
 void setup_softap(void)
 {
-    /* Init netif + event loop once per app */
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-
+    /* Netif and the event loop are up already, see main.c */
     /* Create default netifs */
     esp_netif_create_default_wifi_ap();
-    esp_netif_create_default_wifi_sta();
+    s_sta_netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
+    /* Every STA connect goes through it, before the first event */
+    xTaskCreate(&retry_task, "sta_retry_task", 3072, NULL, 4, &s_retry_task);
+
     /* Register handlers */
     ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &ip_event_handler, NULL));
@@ -107,56 +240,344 @@ void setup_softap(void)
     ap_cfg.ap.authmode       = WIFI_AUTH_WPA_WPA2_PSK;
     if (strlen(AP_PASS) == 0) ap_cfg.ap.authmode = WIFI_AUTH_OPEN;
 
-    /* Load STA creds from NVS (empty by default) */
-    readString(KEY_STA_SSID, g_sta_ssid, sizeof(g_sta_ssid), "");
-    readString(KEY_STA_PASS, g_sta_pass, sizeof(g_sta_pass), "");
+    /* Radio profile from the settings, unknown names fall back to balanced */
+    s_radio = find_radio_profile(setting_radio_profile());
+    if (s_radio == WIFI_RADIO_PROFILE_COUNT) s_radio = WIFI_RADIO_BALANCED;
+    ap_cfg.ap.beacon_interval = RADIO_PROFILES[s_radio].beacon_interval;
+    ap_cfg.ap.dtim_period     = RADIO_PROFILES[s_radio].dtim_period;
 
     /* Start AP+STA */
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &ap_cfg));
     ESP_ERROR_CHECK(esp_wifi_start());
+    /* TX power only sticks once started */
+    esp_wifi_get_max_tx_power(&s_default_tx_power);
+    apply_radio_profile(&RADIO_PROFILES[s_radio], false);
+    s_radio_since_us = esp_timer_get_time();
 
-    /* If we have a saved SSID, apply and connect; otherwise we stay AP-only */
-    if (g_sta_ssid[0] != '\0') {
-        apply_sta_config_and_connect();
+    /* With a saved SSID, WIFI_EVENT_STA_START connects; otherwise we stay AP-only */
+    if (setting_sta_ssid()[0] != '\0') {
         ESP_LOGI(TAG, "AP+STA initialized. AP SSID:%s pass:%s channel:%d | STA SSID:%s",
-                 AP_SSID, AP_PASS, AP_CHANNEL, g_sta_ssid);
+                 AP_SSID, AP_PASS, AP_CHANNEL, setting_sta_ssid());
     } else {
         ESP_LOGI(TAG, "AP-only initialized (no STA creds stored). AP SSID:%s pass:%s channel:%d",
                  AP_SSID, AP_PASS, AP_CHANNEL);
     }
 }
 
-/* Apply the currently loaded g_sta_ssid/g_sta_pass to the driver and connect */
-static void apply_sta_config_and_connect(void) {
+/* Static address from the cached lease on direct attempts, DHCP otherwise */
+static void use_cached_lease(bool use) {
+#if WITH_STA_LEASE_REUSE
+    if (use && setting_sta_ip() != 0) {
+        esp_netif_dhcpc_stop(s_sta_netif);
+        esp_netif_ip_info_t ip = { 0 };
+        ip.ip.addr      = (uint32_t)setting_sta_ip();
+        ip.netmask.addr = (uint32_t)setting_sta_netmask();
+        ip.gw.addr      = (uint32_t)setting_sta_gw();
+        esp_netif_set_ip_info(s_sta_netif, &ip);
+        esp_netif_dns_info_t dns = { 0 };
+        dns.ip.u_addr.ip4.addr = (uint32_t)setting_sta_dns();
+        dns.ip.type = ESP_IPADDR_TYPE_V4;
+        esp_netif_set_dns_info(s_sta_netif, ESP_NETIF_DNS_MAIN, &dns);
+        return;
+    }
+    /* Already running is fine */
+    esp_netif_dhcpc_start(s_sta_netif);
+#endif
+}
+
+/* Apply the STA credentials from the settings to the driver and connect.
+ * The AP of the last connection is tried first on its channel, without a
+ * scan (~1.5 s). The attempt after a failed direct one scans, in case the
+ * AP moved channel or another AP of the network is in range instead. */
+static void connect_sta(void) {
     wifi_config_t sta_cfg = { 0 };
-    strncpy((char*)sta_cfg.sta.ssid, g_sta_ssid, sizeof(sta_cfg.sta.ssid) - 1);
-    strncpy((char*)sta_cfg.sta.password, g_sta_pass, sizeof(sta_cfg.sta.password) - 1);
+    strncpy((char*)sta_cfg.sta.ssid, setting_sta_ssid(), sizeof(sta_cfg.sta.ssid) - 1);
+    strncpy((char*)sta_cfg.sta.password, setting_sta_pass(), sizeof(sta_cfg.sta.password) - 1);
     sta_cfg.sta.scan_method = WIFI_FAST_SCAN;
     sta_cfg.sta.pmf_cfg.capable  = true;
     sta_cfg.sta.pmf_cfg.required = false;
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &sta_cfg));
-    ESP_ERROR_CHECK(esp_wifi_connect());
+
+    uint64_t bssid = setting_sta_bssid();
+    s_direct = bssid != 0 && setting_sta_channel() != 0 && !s_scan_next;
+    if (s_direct) {
+        sta_cfg.sta.bssid_set = true;
+        for (int i = 0; i < 6; ++i) {
+            sta_cfg.sta.bssid[i] = bssid >> (8 * (5 - i));
+        }
+        sta_cfg.sta.channel = setting_sta_channel();
+    }
+    s_stats.attempts++;
+    use_cached_lease(s_direct);
+
+    /* Timed from the link loss on reconnects */
+    if (s_connect_start_us == 0) {
+        s_connect_start_us = esp_timer_get_time();
+    }
+
+    esp_err_t err = esp_wifi_set_config(WIFI_IF_STA, &sta_cfg);
+    if (err == ESP_OK) {
+        err = esp_wifi_connect();
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "STA connect failed: %s", esp_err_to_name(err));
+    }
 }
 
-/* Public: save new creds to NVS and apply immediately */
-void wifi_set_sta_credentials(const char* ssid, const char* pass) {
-    /* Persist */
-    writeString(KEY_STA_SSID, ssid ? ssid : "");
-    writeString(KEY_STA_PASS, pass ? pass : "");
+/* Notifications received within ticks, 0 for none */
+static uint32_t wait_retry_events(TickType_t ticks) {
+    uint32_t events = 0;
+    if (xTaskNotifyWait(0, UINT32_MAX, &events, ticks) != pdTRUE) {
+        return 0;
+    }
+    return events;
+}
+
+/* Listen for the home AP's beacons on its cached channel, answered by
+ * WIFI_EVENT_SCAN_DONE. Without a cached channel the connects scan anyway. */
+static void probe_ap(void) {
+    uint8_t channel = setting_sta_channel();
+    if (channel == 0 || s_probing) {
+        return;
+    }
+    wifi_scan_config_t scan = { 0 };
+    scan.ssid = (uint8_t*)setting_sta_ssid();
+    scan.channel = channel;
+    scan.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+    scan.scan_time.passive = STA_PROBE_DWELL_MS;
+    s_probing = true;
+    if (esp_wifi_scan_start(&scan, false) != ESP_OK) {
+        s_probing = false;
+        return;
+    }
+    s_stats.probes++;
+}
+
+/* Wait the next backoff delay, probing meanwhile. Exponential with equal
+ * jitter: half of it fixed, half random, so nearby devices retrying on the
+ * same AP don't stay in step. Returns the events that cut it short. */
+static uint32_t back_off(void) {
+    uint32_t delay_ms = s_backoff_ms / 2 + esp_random() % (s_backoff_ms / 2 + 1);
+    s_backoff_ms = MIN(s_backoff_ms * 2, STA_BACKOFF_MAX_MS);
 
-    /* Update in-RAM copies */
-    readString(KEY_STA_SSID, g_sta_ssid, sizeof(g_sta_ssid), "");
-    readString(KEY_STA_PASS, g_sta_pass, sizeof(g_sta_pass), "");
+    int64_t until = esp_timer_get_time() + delay_ms * 1000LL;
+    while (true) {
+        int64_t left_ms = (until - esp_timer_get_time()) / 1000;
+        if (left_ms <= 0) {
+            return 0;
+        }
+        uint32_t events = wait_retry_events(pdMS_TO_TICKS(MIN(left_ms, STA_PROBE_INTERVAL_MS)));
+        if (events & (RETRY_AP_SEEN | RETRY_NOW)) {
+            return events;
+        }
+        if (left_ms > STA_PROBE_INTERVAL_MS) {
+            probe_ap();
+        }
+    }
+}
+
+/* Owns every STA connect: right away on start and new credentials, after
+ * a backoff delay when the link is lost or an attempt fails */
+static void retry_task(void *pvParameter) {
+    while (true) {
+        uint32_t events = wait_retry_events(portMAX_DELAY);
+
+        while ((events & (RETRY_LINK_DOWN | RETRY_NOW | RETRY_AP_SEEN)) && !s_has_ip &&
+               setting_sta_ssid()[0] != '\0') {
+            if (!(events & (RETRY_NOW | RETRY_AP_SEEN))) {
+                events = back_off();
+            }
+            if (events & (RETRY_NOW | RETRY_AP_SEEN)) {
+                if (events & RETRY_AP_SEEN) {
+                    ESP_LOGI(TAG, "STA AP back in range");
+                    s_scan_next = false;
+                }
+                s_backoff_ms = STA_BACKOFF_MIN_MS;
+            }
+            while (s_probing) {
+                vTaskDelay(pdMS_TO_TICKS(STA_PROBE_DWELL_MS));
+            }
+
+            connect_sta();
+            events = wait_retry_events(pdMS_TO_TICKS(STA_CONNECT_TIMEOUT_MS));
+            if (events == 0) {
+                events = RETRY_LINK_DOWN;
+            }
+            /* Timed out or disconnected, NO_AP_FOUND included: scan after a
+             * failed direct attempt, back to direct after a failed scan */
+            if (!s_has_ip) {
+                s_scan_next = s_direct;
+            }
+        }
+        if (s_has_ip) {
+            s_backoff_ms = STA_BACKOFF_MIN_MS;
+        }
+    }
+}
 
-    if (g_sta_ssid[0] == '\0') {
+/* Keep the AP and lease of this connection for the next one. Settings
+ * only write what changed, so reconnecting to the same AP is free. */
+static void remember_ap(const esp_netif_ip_info_t *ip_info) {
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        uint64_t bssid = 0;
+        for (int i = 0; i < 6; ++i) {
+            bssid = (bssid << 8) | ap.bssid[i];
+        }
+        setting_set_sta_bssid(bssid);
+        setting_set_sta_channel(ap.primary);
+    }
+
+    setting_set_sta_ip(ip_info->ip.addr);
+    setting_set_sta_netmask(ip_info->netmask.addr);
+    setting_set_sta_gw(ip_info->gw.addr);
+    esp_netif_dns_info_t dns;
+    if (esp_netif_get_dns_info(s_sta_netif, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK) {
+        setting_set_sta_dns(dns.ip.u_addr.ip4.addr);
+    }
+}
+
+/* The cached AP belongs to the previous credentials */
+static void forget_ap(void) {
+    setting_set_sta_bssid(0);
+    setting_set_sta_channel(0);
+    setting_set_sta_ip(0);
+    s_scan_next = false;
+}
+
+/* Public: save new creds and apply immediately */
+void wifi_set_sta_credentials(const char* ssid, const char* pass) {
+    setting_set_sta_ssid(ssid ? ssid : "");
+    setting_set_sta_pass(pass ? pass : "");
+    wifi_apply_sta_settings();
+}
+
+/* Public: reconnect with the STA credentials from the settings */
+void wifi_apply_sta_settings(void) {
+    forget_ap();
+    if (setting_sta_ssid()[0] == '\0') {
         ESP_LOGW(TAG, "Cleared STA credentials; staying AP-only");
         esp_wifi_disconnect();
+        /* Not an outage anymore */
+        if (s_connect_start_us != 0) {
+            s_down_ms += (esp_timer_get_time() - s_connect_start_us) / 1000;
+            s_connect_start_us = 0;
+        }
         return;
     }
 
-    ESP_LOGI(TAG, "Applying new STA credentials: SSID='%s'", g_sta_ssid);
-    esp_wifi_disconnect();            // drop any current STA link
-    apply_sta_config_and_connect();   // set and reconnect with new creds
+    ESP_LOGI(TAG, "Applying new STA credentials: SSID='%s'", setting_sta_ssid());
+    if (s_connect_start_us == 0 && !s_has_ip) {
+        s_connect_start_us = esp_timer_get_time();
+    }
+    if (s_associated) {
+        /* Reconnects from WIFI_EVENT_STA_DISCONNECTED, once the link is down */
+        s_leaving = true;
+        esp_wifi_disconnect();
+        return;
+    }
+    esp_wifi_disconnect();            // stop any attempt with the old creds
+    xTaskNotify(s_retry_task, RETRY_NOW, eSetBits);
+}
+
+void wifi_get_sta_stats(wifi_sta_stats_t *out) {
+    *out = s_stats;
+    out->backoff_ms = s_backoff_ms;
+    out->disconnected_ms = s_down_ms;
+    int64_t since = s_connect_start_us;
+    if (since != 0) {
+        out->disconnected_ms += (esp_timer_get_time() - since) / 1000;
+    }
 }
 
+uint32_t wifi_connect_time_ms(void) {
+    return s_connect_ms;
+}
+
+bool wifi_connected_to_cached_ap(void) {
+    return s_connect_direct;
+}
+
+
+/* WIFI_RADIO_PROFILE_COUNT when unknown */
+static wifi_radio_profile_t find_radio_profile(const char *name) {
+    for (int i = 0; i < WIFI_RADIO_PROFILE_COUNT; ++i) {
+        if (strcmp(RADIO_PROFILES[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return WIFI_RADIO_PROFILE_COUNT;
+}
+
+static int8_t profile_tx_power(const radio_profile_t *profile) {
+    return profile->max_tx_power == RADIO_TX_DEFAULT ? s_default_tx_power : profile->max_tx_power;
+}
+
+static void apply_radio_profile(const radio_profile_t *profile, bool restart_ap) {
+    esp_err_t err = esp_wifi_set_max_tx_power(profile_tx_power(profile));
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "TX power not set: %s", esp_err_to_name(err));
+    }
+
+    wifi_config_t ap_cfg;
+    if (restart_ap && esp_wifi_get_config(WIFI_IF_AP, &ap_cfg) == ESP_OK &&
+        (ap_cfg.ap.beacon_interval != profile->beacon_interval || ap_cfg.ap.dtim_period != profile->dtim_period)) {
+        ap_cfg.ap.beacon_interval = profile->beacon_interval;
+        ap_cfg.ap.dtim_period = profile->dtim_period;
+        esp_wifi_set_config(WIFI_IF_AP, &ap_cfg);
+    }
+}
+
+esp_err_t wifi_set_radio_profile(const char *name) {
+    wifi_radio_profile_t profile = find_radio_profile(name);
+    if (profile == WIFI_RADIO_PROFILE_COUNT) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    setting_set_radio_profile(name);
+    if (profile == s_radio) {
+        return ESP_OK;
+    }
+
+    int64_t now = esp_timer_get_time();
+    s_radio_stats[s_radio].time_us += now - s_radio_since_us;
+    s_radio_since_us = now;
+    s_radio = profile;
+    apply_radio_profile(&RADIO_PROFILES[profile], true);
+    ESP_LOGI(TAG, "Radio profile: %s", RADIO_PROFILES[profile].name);
+    return ESP_OK;
+}
+
+wifi_radio_profile_t wifi_radio_profile(void) {
+    return s_radio;
+}
+
+void wifi_radio_add_rtt(uint32_t rtt_us) {
+    s_radio_stats[s_radio].rtt_samples++;
+    s_radio_stats[s_radio].rtt_total_us += rtt_us;
+    s_radio_stats[s_radio].rtt_max_us = MAX(s_radio_stats[s_radio].rtt_max_us, rtt_us);
+}
+
+void wifi_get_radio_stats(wifi_radio_profile_t profile, wifi_radio_stats_t *out) {
+    const radio_profile_t *p = &RADIO_PROFILES[profile];
+    memset(out, 0, sizeof(*out));
+    out->name = p->name;
+    out->active = profile == s_radio;
+
+    uint64_t time_us = s_radio_stats[profile].time_us;
+    if (out->active) {
+        time_us += esp_timer_get_time() - s_radio_since_us;
+    }
+    out->time_s = time_us / 1000000;
+    out->rtt_samples = s_radio_stats[profile].rtt_samples;
+    out->rtt_avg_us = out->rtt_samples ? s_radio_stats[profile].rtt_total_us / out->rtt_samples : 0;
+    out->rtt_max_us = s_radio_stats[profile].rtt_max_us;
+
+    /* What the driver actually uses while active, the table otherwise */
+    int8_t tx_power = profile_tx_power(p);
+    if (out->active) {
+        esp_wifi_get_max_tx_power(&tx_power);
+    }
+    out->tx_power_dbm = tx_power / 4.0f;
+    out->beacon_interval_ms = p->beacon_interval * 1024 / 1000;
+    out->dtim_period = p->dtim_period;
+}
@@ -1,7 +1,58 @@
 #ifndef WIFI_H
 #define WIFI_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 void setup_softap(void);
 void wifi_set_sta_credentials(const char* ssid, const char* pass);
+void wifi_apply_sta_settings(void);
+
+/* Last STA connection: from STA start, or from the link loss when
+ * reconnecting, to the IP address, in ms */
+uint32_t wifi_connect_time_ms(void);
+/* Whether it went straight to the cached AP, without scanning */
+bool wifi_connected_to_cached_ap(void);
+
+/* Reconnect counters since boot */
+typedef struct {
+    uint32_t attempts;        /* STA connects started */
+    uint32_t outages;         /* connections lost */
+    uint32_t probes;          /* passive listens for the AP while backing off */
+    uint32_t probe_hits;      /* ... that heard it */
+    uint32_t backoff_ms;      /* next delay, before jitter */
+    uint64_t disconnected_ms; /* with credentials but no address, ongoing included */
+} wifi_sta_stats_t;
+
+void wifi_get_sta_stats(wifi_sta_stats_t *out);
+
+/* Radio profiles, from lowest control latency to longest battery life */
+typedef enum {
+    WIFI_RADIO_PERFORMANCE, /* full TX power, DTIM 1 */
+    WIFI_RADIO_BALANCED,    /* the driver's default TX power */
+    WIFI_RADIO_ECO,         /* parked: low TX power, long beacon interval */
+    WIFI_RADIO_PROFILE_COUNT
+} wifi_radio_profile_t;
+
+typedef struct {
+    const char *name;
+    bool active;
+    uint32_t time_s;          /* spent in the profile since boot */
+    uint32_t rtt_samples;     /* WebSocket ping round trips, see wifi_radio_add_rtt() */
+    uint32_t rtt_avg_us;
+    uint32_t rtt_max_us;
+    /* Current draw proxies, no sensor to measure it. No modem sleep, the
+     * firmware runs AP+STA where it isn't available. */
+    float tx_power_dbm;
+    uint32_t beacon_interval_ms;
+    uint8_t dtim_period;
+} wifi_radio_stats_t;
+
+/* Apply and save a profile by name, ESP_ERR_NOT_FOUND when unknown */
+esp_err_t wifi_set_radio_profile(const char *name);
+wifi_radio_profile_t wifi_radio_profile(void);
+/* Counted for the active profile */
+void wifi_radio_add_rtt(uint32_t rtt_us);
+void wifi_get_radio_stats(wifi_radio_profile_t profile, wifi_radio_stats_t *out);
 
 #endif
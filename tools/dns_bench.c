@@ -0,0 +1,200 @@
+/* Throughput of the captive portal DNS replies, on the host.
+ *
+ * Builds src/dns_reply.c as it runs on the device and times replies to the
+ * burst a phone sends when joining the soft AP: A, AAAA and HTTPS lookups
+ * of the connectivity check names, with EDNS. The replies, answer bytes
+ * included, and the replies to malformed queries are checked first.
+ *
+ * Usage: cc -O2 -Isrc tools/dns_bench.c src/dns_reply.c -o dns_bench && ./dns_bench [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dns_reply.h"
+
+#define TYPE_A 1
+#define TYPE_AAAA 28
+#define TYPE_HTTPS 65
+#define AP_IP 0x0104a8c0 // 192.168.4.1, network byte order on little endian hosts
+
+typedef struct {
+  const char *name;
+  unsigned type;
+  dns_reply_result_t expected;
+} query_t;
+
+static const query_t BURST[] = {
+  { "connectivitycheck.gstatic.com", TYPE_A, DNS_REPLY_ANSWER },
+  { "connectivitycheck.gstatic.com", TYPE_AAAA, DNS_REPLY_NODATA },
+  { "captive.apple.com", TYPE_A, DNS_REPLY_ANSWER },
+  { "captive.apple.com", TYPE_HTTPS, DNS_REPLY_NODATA },
+  { "www.msftconnecttest.com", TYPE_A, DNS_REPLY_ANSWER },
+  { "www.msftconnecttest.com", TYPE_AAAA, DNS_REPLY_NODATA },
+  { "1.4.168.192.in-addr.arpa", 12, DNS_REPLY_NXDOMAIN },
+};
+#define BURST_LEN (sizeof(BURST) / sizeof(BURST[0]))
+
+// Query with an EDNS OPT record, as phones send them
+static size_t make_query(uint8_t *out, const char *name, unsigned type) {
+  static const uint8_t header[12] = { 0x12, 0x34, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 1 };
+  static const uint8_t opt[11] = { 0, 0, 41, 0x10, 0, 0, 0, 0, 0, 0, 0 };
+  size_t len = sizeof(header);
+  memcpy(out, header, sizeof(header));
+
+  while (*name) {
+    size_t label = strcspn(name, ".");
+    out[len++] = label;
+    memcpy(out + len, name, label);
+    len += label;
+    name += label + (name[label] == '.');
+  }
+  out[len++] = 0;
+  out[len++] = type >> 8;
+  out[len++] = type & 0xff;
+  out[len++] = 0;
+  out[len++] = 1; // IN
+  memcpy(out + len, opt, sizeof(opt));
+  return len + sizeof(opt);
+}
+
+// The A record after the question: pointer to the name, type, class, TTL
+// and the AP address
+static const uint8_t ANSWER[16] = {
+  0xc0, 12, 0, TYPE_A, 0, 1, 0, 0, DNS_REPLY_TTL_S >> 8, DNS_REPLY_TTL_S & 0xff, 0, 4, 192, 168, 4, 1,
+};
+
+// Reply to packet, expected_len 0 for a drop. rcode is the one expected in
+// the reply header.
+static int check(const dns_reply_template_t *template, const char *what, uint8_t *packet, size_t len,
+                 dns_reply_result_t expected, size_t expected_len, unsigned rcode) {
+  dns_reply_result_t result;
+  size_t reply_len = dns_reply_build(template, packet, len, &result);
+  if (result != expected || reply_len != expected_len ||
+      (reply_len > 0 && (!(packet[2] & 0x80) || (packet[3] & 0x0f) != rcode))) {
+    fprintf(stderr, "unexpected reply to %s: result %d, %zu bytes\n", what, result, reply_len);
+    return 1;
+  }
+  return 0;
+}
+
+// Replies to queries the device must not answer normally
+static int check_malformed(const dns_reply_template_t *template) {
+  uint8_t packet[DNS_REPLY_MAX_LEN];
+  size_t len = make_query(packet, "captive.apple.com", TYPE_A);
+  size_t question_end = len - 11; // without the OPT record
+  int failed = 0;
+
+  uint8_t query[DNS_REPLY_MAX_LEN];
+  memcpy(query, packet, len);
+
+  failed |= check(template, "a short packet", packet, 11, DNS_REPLY_DROP, 0, 0);
+
+  memcpy(packet, query, len);
+  packet[2] |= 0x80;
+  failed |= check(template, "a response", packet, len, DNS_REPLY_DROP, 0, 0);
+
+  memcpy(packet, query, len);
+  packet[2] |= 5 << 3; // UPDATE
+  failed |= check(template, "a non-zero opcode", packet, len, DNS_REPLY_ERROR, 12, 4);
+
+  memcpy(packet, query, len);
+  packet[5] = 0;
+  failed |= check(template, "no question", packet, len, DNS_REPLY_ERROR, 12, 1);
+
+  memcpy(packet, query, len);
+  packet[5] = 2;
+  failed |= check(template, "two questions", packet, len, DNS_REPLY_ERROR, 12, 1);
+
+  memcpy(packet, query, len);
+  packet[12] = 63;
+  failed |= check(template, "a label past the end", packet, 20, DNS_REPLY_ERROR, 12, 1);
+
+  memcpy(packet, query, len);
+  failed |= check(template, "a question cut short", packet, question_end - 1, DNS_REPLY_ERROR, 12, 1);
+
+  // Padded, so the pointer can't pass for a label running past the end
+  memset(packet, 0, DNS_REPLY_MAX_LEN);
+  memcpy(packet, query, 12);
+  packet[12] = 0xc0;
+  packet[13] = 12;
+  memcpy(packet + 14, query + question_end - 4, 4);
+  failed |= check(template, "a compression pointer", packet, DNS_REPLY_MAX_LEN, DNS_REPLY_ERROR, 12, 1);
+
+  // Names are at most 255 bytes, so even with a full buffer of additional
+  // records the reply fits in DNS_REPLY_MAX_LEN
+  memcpy(packet, query, 12);
+  size_t pos = 12;
+  for (int i = 0; i < 4; ++i) {
+    packet[pos++] = 62;
+    memset(packet + pos, 'a', 62);
+    pos += 62;
+  }
+  packet[pos++] = 1;
+  packet[pos++] = 'a';
+  packet[pos++] = 0; // 255 bytes
+  memcpy(packet + pos, query + question_end - 4, 4);
+  pos += 4;
+  memset(packet + pos, 0, DNS_REPLY_MAX_LEN - pos);
+  uint8_t longest[DNS_REPLY_MAX_LEN];
+  memcpy(longest, packet, DNS_REPLY_MAX_LEN);
+  failed |= check(template, "the longest name", packet, DNS_REPLY_MAX_LEN, DNS_REPLY_ANSWER, pos + sizeof(ANSWER), 0);
+
+  memcpy(packet, longest, DNS_REPLY_MAX_LEN);
+  packet[12 + 4 * 63] = 2; // 256 bytes
+  failed |= check(template, "a name over 255 bytes", packet, DNS_REPLY_MAX_LEN, DNS_REPLY_ERROR, 12, 1);
+
+  return failed;
+}
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  long rounds = argc > 1 ? atol(argv[1]) : 1000000;
+  static uint8_t queries[BURST_LEN][DNS_REPLY_MAX_LEN];
+  size_t lengths[BURST_LEN];
+  uint8_t packet[DNS_REPLY_MAX_LEN];
+  dns_reply_template_t template;
+  dns_reply_template_init(&template, AP_IP);
+
+  for (size_t i = 0; i < BURST_LEN; ++i) {
+    lengths[i] = make_query(queries[i], BURST[i].name, BURST[i].type);
+    memcpy(packet, queries[i], lengths[i]);
+    dns_reply_result_t result;
+    size_t len = dns_reply_build(&template, packet, lengths[i], &result);
+    size_t question_end = lengths[i] - 11; // the OPT record is dropped
+    int answered = result == DNS_REPLY_ANSWER;
+    if (result != BURST[i].expected || packet[6] != 0 || packet[7] != answered ||
+        len != question_end + (answered ? sizeof(ANSWER) : 0) ||
+        (answered && memcmp(packet + question_end, ANSWER, sizeof(ANSWER)) != 0)) {
+      fprintf(stderr, "unexpected reply to %s type %u\n", BURST[i].name, BURST[i].type);
+      return 1;
+    }
+  }
+  if (check_malformed(&template)) {
+    return 1;
+  }
+
+  size_t total = 0;
+  double start = now_s();
+  for (long round = 0; round < rounds; ++round) {
+    for (size_t i = 0; i < BURST_LEN; ++i) {
+      // The device receives each query into the buffer it replies from
+      memcpy(packet, queries[i], lengths[i]);
+      dns_reply_result_t result;
+      total += dns_reply_build(&template, packet, lengths[i], &result);
+    }
+  }
+  double elapsed = now_s() - start;
+
+  long replies = rounds * (long)BURST_LEN;
+  printf("%ld replies in %.3f s: %.1f ns each, %.0f replies/s (%zu bytes)\n",
+         replies, elapsed, elapsed * 1e9 / replies, replies / elapsed, total);
+  return 0;
+}
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+"""Generate the C asset bundle (see src/assets.h) from the data directory.
+
+Every file becomes an entry in a perfect-hash manifest with its MIME type,
+strong ETags and, when it pays off, a gzip variant. All variants are
+concatenated into one const blob that stays in flash.
+
+Usage: embed_assets.py <data_dir> <output.c>
+"""
+
+import gzip
+import hashlib
+import os
+import sys
+
+MIME_TYPES = {
+    ".html": "text/html",
+    ".js": "application/javascript",
+    ".css": "text/css",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".jpg": "image/jpeg",
+    ".jpeg": "image/jpeg",
+    ".ico": "image/x-icon",
+    ".pdf": "application/pdf",
+    ".txt": "text/plain",
+}
+
+# Extra URIs served with the content of an asset
+ALIASES = {
+    "/": "/index.html",
+}
+
+# Never embedded: variants produced by gzip_assets.py, firmware images and
+# the MQTT TLS files, the client key must not be downloadable
+SKIP_EXTENSIONS = (".gz", ".bin", ".binz", ".crt", ".key")
+
+
+def fnv1a(seed, data):
+    # Must match asset_hash() in src/assets.c
+    h = 2166136261 ^ seed
+    for b in data:
+        h ^= b
+        h = (h * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def perfect_hash(paths):
+    size = 1
+    while size < 2 * len(paths):
+        size *= 2
+    while True:
+        for seed in range(1 << 16):
+            slots = set()
+            for path in paths:
+                slot = fnv1a(seed, path.encode()) & (size - 1)
+                if slot in slots:
+                    break
+                slots.add(slot)
+            else:
+                return seed, size
+        size *= 2
+
+
+def collect(data_dir):
+    assets = []
+    for root, _, files in os.walk(data_dir):
+        for name in sorted(files):
+            if name.lower().endswith(SKIP_EXTENSIONS):
+                continue
+            full = os.path.join(root, name)
+            path = "/" + os.path.relpath(full, data_dir).replace(os.sep, "/")
+            with open(full, "rb") as f:
+                assets.append((path, f.read()))
+    return sorted(assets)
+
+
+def c_string(s):
+    return '"' + s.replace("\\", "\\\\").replace('"', '\\"') + '"'
+
+
+def generate(data_dir, out_path):
+    assets = collect(data_dir)
+    blob = bytearray()
+    entries = []
+
+    for path, data in assets:
+        ext = os.path.splitext(path)[1].lower()
+        mime = MIME_TYPES.get(ext, "text/plain")
+        digest = hashlib.sha1(data).hexdigest()[:16]
+
+        offset = len(blob)
+        blob += data
+
+        gz_offset, gz_len = 0, 0
+        compressed = gzip.compress(data, compresslevel=9, mtime=0)
+        if len(compressed) < len(data) * 0.9:
+            gz_offset, gz_len = len(blob), len(compressed)
+            blob += compressed
+
+        entries.append({
+            "path": path,
+            "mime": mime,
+            "etag": '"%s"' % digest,
+            "gz_etag": '"%s-gz"' % digest,
+            "offset": offset,
+            "len": len(data),
+            "gz_offset": gz_offset,
+            "gz_len": gz_len,
+        })
+
+    by_path = {e["path"]: e for e in entries}
+    for alias, target in sorted(ALIASES.items()):
+        if target in by_path and alias not in by_path:
+            entries.append(dict(by_path[target], path=alias))
+
+    if not entries:
+        # Keep the table valid for an empty data directory
+        seed, size = 0, 1
+    else:
+        seed, size = perfect_hash([e["path"] for e in entries])
+    if len(entries) > 255:
+        sys.exit("embed_assets: too many assets for the 8 bit slot table")
+
+    slots = [0] * size
+    for index, e in enumerate(entries):
+        slots[fnv1a(seed, e["path"].encode()) & (size - 1)] = index + 1
+
+    lines = [
+        "// Generated by tools/embed_assets.py, do not edit",
+        '#include "assets.h"',
+        "",
+        "const asset_entry_t asset_entries[] = {",
+    ]
+    for e in entries:
+        lines.append("  { %s, %s, %s, %s, %d, %d, %d, %d }," % (
+            c_string(e["path"]), c_string(e["mime"]), c_string(e["etag"]), c_string(e["gz_etag"]),
+            e["offset"], e["len"], e["gz_offset"], e["gz_len"]))
+    if not entries:
+        lines.append("  { 0 },")
+    lines.append("};")
+    lines.append("")
+    lines.append("const uint8_t asset_slots[] = { %s };" % ", ".join(str(s) for s in slots))
+    lines.append("const uint32_t asset_slot_mask = %d;" % (size - 1))
+    lines.append("const uint32_t asset_hash_seed = %d;" % seed)
+    lines.append("")
+    lines.append("const uint8_t asset_blob[%d] = {" % max(len(blob), 1))
+    for i in range(0, len(blob), 16):
+        lines.append("  " + ", ".join("0x%02x" % b for b in blob[i:i + 16]) + ",")
+    lines.append("};")
+    lines.append("")
+
+    os.makedirs(os.path.dirname(os.path.abspath(out_path)), exist_ok=True)
+    with open(out_path, "w") as f:
+        f.write("\n".join(lines))
+    print("embed_assets: %d entries, %d bytes" % (len(entries), len(blob)))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    generate(sys.argv[1], sys.argv[2])
@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+"""Write a gzip copy next to every web asset in the data directory.
+
+The web server sends `<file>.gz` with `Content-Encoding: gzip` to clients
+that accept it, so the filesystem image ships both variants.
+
+Usage: gzip_assets.py [data_dir]
+"""
+
+import gzip
+import os
+import sys
+
+# Already compressed formats gain nothing from gzip, certificates and keys
+# are read by the firmware itself and never served compressed
+SKIP_EXTENSIONS = (".gz", ".jpg", ".jpeg", ".png", ".bin", ".crt", ".key")
+
+
+def gzip_file(path):
+    out_path = path + ".gz"
+    if os.path.exists(out_path) and os.path.getmtime(out_path) >= os.path.getmtime(path):
+        return False
+
+    with open(path, "rb") as f:
+        data = f.read()
+    # mtime=0 keeps the output reproducible for identical input
+    compressed = gzip.compress(data, compresslevel=9, mtime=0)
+    if len(compressed) >= len(data):
+        # Not worth it, make sure a stale variant does not shadow the file
+        if os.path.exists(out_path):
+            os.remove(out_path)
+        return False
+
+    with open(out_path, "wb") as f:
+        f.write(compressed)
+    print("gzip %s: %d -> %d bytes" % (os.path.basename(path), len(data), len(compressed)))
+    return True
+
+
+def gzip_dir(data_dir):
+    for root, _, files in os.walk(data_dir):
+        for name in sorted(files):
+            if name.lower().endswith(SKIP_EXTENSIONS):
+                continue
+            gzip_file(os.path.join(root, name))
+
+
+if __name__ == "__main__":
+    gzip_dir(sys.argv[1] if len(sys.argv) > 1 else "data")
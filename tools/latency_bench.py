@@ -0,0 +1,279 @@
+#!/usr/bin/env python3
+"""Measure control and telemetry latencies of a car running a bench build.
+
+Needs firmware built with -DWITH_LATENCY_BENCH=1 (the bench environment in
+platformio.ini). The bench presses the pedals through /api/bench, so keep
+the wheels off the ground.
+
+Measured on the device, from /api/bench:
+  pedal_to_duty   pedal change to the PWM duty change
+  estop_to_duty   WebSocket emergency_stop to zero duty
+  command_to_ack  WebSocket command to its ack frame queued
+  state_to_mqtt   driving state change to the telemetry publish
+
+Measured here, end to end:
+  command_to_ack  WebSocket command sent to its ack frame received
+  state_to_mqtt   speed limit change sent to <base>/config received from
+                  the broker (needs --mqtt, the device connected to it)
+
+Results go to a JSON file named after the firmware version, pass an older
+one with --baseline to compare.
+
+Usage: latency_bench.py <device> [--rounds N] [--mqtt host[:port]] [--out file] [--baseline file]
+"""
+
+import argparse
+import base64
+import json
+import os
+import queue
+import socket
+import ssl
+import struct
+import threading
+import time
+import urllib.request
+
+PEDAL_HOLD_S = 0.3
+
+
+def percentiles(samples):
+    if not samples:
+        return {"count": 0}
+    ordered = sorted(samples)
+    pick = lambda p: ordered[(len(ordered) - 1) * p // 100]
+    return {"count": len(ordered), "p50_us": pick(50), "p90_us": pick(90),
+            "p99_us": pick(99), "max_us": ordered[-1]}
+
+
+def http(device, method, path):
+    request = urllib.request.Request("http://%s%s" % (device, path), method=method)
+    with urllib.request.urlopen(request, timeout=5) as response:
+        return response.read()
+
+
+class WebSocket:
+    """Just enough of RFC 6455 to send commands and read text frames."""
+
+    def __init__(self, host, path="/ws"):
+        self.sock = socket.create_connection((host, 80), timeout=5)
+        key = base64.b64encode(os.urandom(16)).decode()
+        self.sock.sendall(("GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                           "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n" % (path, host, key)).encode())
+        response = b""
+        while b"\r\n\r\n" not in response:
+            chunk = self.sock.recv(1024)
+            if not chunk:
+                raise ConnectionError("WebSocket handshake failed")
+            response += chunk
+        if b" 101 " not in response.split(b"\r\n", 1)[0]:
+            raise ConnectionError("WebSocket handshake refused")
+        self.buffer = response.split(b"\r\n\r\n", 1)[1]
+
+    def _read(self, n):
+        while len(self.buffer) < n:
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                raise ConnectionError("WebSocket closed")
+            self.buffer += chunk
+        data, self.buffer = self.buffer[:n], self.buffer[n:]
+        return data
+
+    def send(self, text):
+        payload = text.encode()
+        mask = os.urandom(4)
+        header = bytes([0x81])
+        if len(payload) < 126:
+            header += bytes([0x80 | len(payload)])
+        else:
+            header += bytes([0x80 | 126]) + struct.pack(">H", len(payload))
+        masked = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+        self.sock.sendall(header + mask + masked)
+
+    def receive(self):
+        opcode, length = self._read(2)
+        length &= 0x7f
+        if length == 126:
+            length = struct.unpack(">H", self._read(2))[0]
+        elif length == 127:
+            length = struct.unpack(">Q", self._read(8))[0]
+        payload = self._read(length)
+        return payload.decode(errors="replace") if opcode & 0x0f == 1 else None
+
+    def command(self, command, parameters, reply_type, timeout=2.0):
+        """Send a command, return the ack and the round trip in us."""
+        start = time.perf_counter()
+        self.send(json.dumps({"command": command, "parameters": parameters}))
+        while time.perf_counter() - start < timeout:
+            text = self.receive()
+            if text is None:
+                continue
+            try:
+                message = json.loads(text)
+            except ValueError:
+                continue
+            if isinstance(message, dict) and message.get("type") == reply_type:
+                return message, int((time.perf_counter() - start) * 1e6)
+        raise TimeoutError("no %s reply" % reply_type)
+
+
+class MqttListener(threading.Thread):
+    """MQTT 3.1.1 subscriber putting (arrival time, topic, payload) in a queue."""
+
+    def __init__(self, host, port, topic, tls=None):
+        super().__init__(daemon=True)
+        self.messages = queue.Queue()
+        sock = socket.create_connection((host, port), timeout=5)
+        self.sock = tls.wrap_socket(sock, server_hostname=host) if tls else sock
+        client_id = b"latency_bench_%d" % os.getpid()
+        variable = b"\x00\x04MQTT\x04\x02\x00\x3c" + struct.pack(">H", len(client_id)) + client_id
+        self.sock.sendall(b"\x10" + self._length(len(variable)) + variable)
+        if self._packet()[0] >> 4 != 2:
+            raise ConnectionError("MQTT CONNECT refused")
+        filter_ = topic.encode()
+        variable = struct.pack(">HH", 1, len(filter_)) + filter_ + b"\x00"
+        self.sock.sendall(b"\x82" + self._length(len(variable)) + variable)
+        self.sock.settimeout(None)
+
+    @staticmethod
+    def _length(n):
+        out = b""
+        while True:
+            byte, n = n % 128, n // 128
+            out += bytes([byte | (0x80 if n else 0)])
+            if not n:
+                return out
+
+    def _recv(self, n):
+        data = b""
+        while len(data) < n:
+            chunk = self.sock.recv(n - len(data))
+            if not chunk:
+                raise ConnectionError("MQTT closed")
+            data += chunk
+        return data
+
+    def _packet(self):
+        kind = self._recv(1)[0]
+        length, shift = 0, 0
+        while True:
+            byte = self._recv(1)[0]
+            length |= (byte & 0x7f) << shift
+            shift += 7
+            if not byte & 0x80:
+                break
+        return kind, self._recv(length)
+
+    def run(self):
+        while True:
+            kind, body = self._packet()
+            if kind >> 4 != 3:
+                continue
+            arrival = time.perf_counter()
+            topic_len = struct.unpack(">H", body[:2])[0]
+            offset = 2 + topic_len + (2 if kind & 0x06 else 0)
+            self.messages.put((arrival, body[2:2 + topic_len].decode(), body[offset:]))
+
+
+def bench_state_to_mqtt(ws, listener, base, rounds, limits):
+    samples = []
+    forward, backward = limits
+    # Limits are bounded to 0-100, step away from the bound
+    step = -1 if forward >= 100 else 1
+    for i in range(rounds):
+        # Alternate, so every round is a real change
+        value = forward + (step if i % 2 == 0 else 0)
+        # Retained and earlier messages would match too
+        while not listener.messages.empty():
+            listener.messages.get()
+        start = time.perf_counter()
+        ack, _ = ws.command("update_max", {"max_forward": value, "max_backward": backward}, "update_max")
+        if not ack.get("ok"):
+            raise RuntimeError("update_max refused: %s" % ack.get("error"))
+        while True:
+            arrival, topic, payload = listener.messages.get(timeout=5)
+            if arrival < start or topic != base + "/config":
+                continue
+            if json.loads(payload).get("max_forward") == value:
+                samples.append(int((arrival - start) * 1e6))
+                break
+    ws.command("update_max", {"max_forward": forward, "max_backward": backward}, "update_max")
+    return samples
+
+
+def run(args):
+    device = args.device
+    http(device, "POST", "/api/bench?reset=1")
+    ws = WebSocket(device)
+    client = {}
+
+    for _ in range(args.rounds):
+        http(device, "POST", "/api/bench?pedal=100")
+        time.sleep(PEDAL_HOLD_S)
+        http(device, "POST", "/api/bench?pedal=release")
+        time.sleep(PEDAL_HOLD_S)
+
+    for _ in range(args.rounds):
+        ws.command("emergency_stop", {"active": True}, "emergency_stop")
+        ws.command("emergency_stop", {"active": False}, "emergency_stop")
+
+    client["command_to_ack"] = percentiles(
+        [ws.command("get_mqtt", {}, "mqtt_info")[1] for _ in range(args.rounds)])
+
+    if args.mqtt:
+        info, _ = ws.command("get_mqtt", {}, "mqtt_info")
+        host, _, port = args.mqtt.partition(":")
+        tls = None
+        if args.mqtt_cafile:
+            tls = ssl.create_default_context(cafile=args.mqtt_cafile)
+            if args.mqtt_cert:
+                tls.load_cert_chain(args.mqtt_cert, args.mqtt_key)
+        listener = MqttListener(host, int(port or (8883 if tls else 1883)), info["base"] + "/#", tls)
+        listener.start()
+        config = json.loads(http(device, "GET", "/api/config"))
+        limits = (config["max_forward"], config["max_backward"])
+        client["state_to_mqtt"] = percentiles(bench_state_to_mqtt(ws, listener, info["base"], args.rounds, limits))
+
+    result = json.loads(http(device, "GET", "/api/bench"))
+    result["client"] = client
+    result["rounds"] = args.rounds
+    result["date"] = time.strftime("%Y-%m-%dT%H:%M:%S")
+    return result
+
+
+def compare(result, baseline):
+    for name in ("wifi_connect_ms", "mqtt_connect_ms"):
+        if name in result and name in baseline:
+            print("device %-15s %7d -> %7d ms" % (name, baseline[name], result[name]))
+    for side, probes in (("device", result["probes"]), ("client", result["client"])):
+        old_probes = baseline["probes"] if side == "device" else baseline.get("client", {})
+        for name, stats in probes.items():
+            old = old_probes.get(name)
+            if not old or not stats.get("count") or not old.get("count"):
+                continue
+            print("%-6s %-15s p50 %7d -> %7d us   p99 %7d -> %7d us" %
+                  (side, name, old["p50_us"], stats["p50_us"], old["p99_us"], stats["p99_us"]))
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("device", help="address of the car, e.g. 192.168.4.1")
+    parser.add_argument("--rounds", type=int, default=50)
+    parser.add_argument("--mqtt", help="broker the car publishes to, host[:port]")
+    parser.add_argument("--mqtt-cafile")
+    parser.add_argument("--mqtt-cert")
+    parser.add_argument("--mqtt-key")
+    parser.add_argument("--out")
+    parser.add_argument("--baseline")
+    args = parser.parse_args()
+
+    result = run(args)
+    out_path = args.out or "latency_%s.json" % result["firmware"]
+    with open(out_path, "w") as f:
+        json.dump(result, f, indent=2)
+    print(json.dumps(result, indent=2))
+    print("written to %s" % out_path)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            compare(result, json.load(f))
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""Make a delta update from the running firmware to a new one.
+
+The device rebuilds the new image from the running partition and the
+patch, so only the changed parts cross the network. The patch is a list of
+fixed size ops, deflated like a packed image (see pack_firmware.py):
+
+  COPY   <u8 1> <u32 source offset> <u32 length>
+  INSERT <u8 2> <u32 length> <u32 0> followed by the bytes
+
+The header carries the length and SHA-256 of the source firmware, the
+device refuses a delta made for another build.
+
+Usage: make_delta.py <old.bin> <new.bin> [output.binz] [--window-bits N]
+"""
+
+import argparse
+import hashlib
+import struct
+
+from pack_firmware import DEFAULT_WINDOW_BITS, deflate, pack_header, window_bits_arg
+
+KIND_DELTA = 1
+DELTA_HEADER_FORMAT = "<I32s"
+
+OP_COPY = 1
+OP_INSERT = 2
+OP_FORMAT = "<BII"
+
+# Matches are searched from seeds of this size, shorter ones are inserted
+SEED_LEN = 16
+MIN_COPY_LEN = 24
+
+
+def index_source(old):
+    index = {}
+    for pos in range(0, len(old) - SEED_LEN + 1, 4):
+        index.setdefault(old[pos:pos + SEED_LEN], pos)
+    return index
+
+
+def diff(old, new):
+    """Yield (op, a, b) tuples, INSERT ops carry the new offset in b."""
+    index = index_source(old)
+    pos = 0
+    literal_start = 0
+    while pos <= len(new) - SEED_LEN:
+        src = index.get(new[pos:pos + SEED_LEN])
+        if src is None:
+            pos += 1
+            continue
+
+        # Grow the match both ways, backwards into the pending literal
+        start = pos
+        while start > literal_start and src > 0 and old[src - 1] == new[start - 1]:
+            start -= 1
+            src -= 1
+        end = pos + SEED_LEN
+        src_end = src + (end - start)
+        while end < len(new) and src_end < len(old) and old[src_end] == new[end]:
+            end += 1
+            src_end += 1
+
+        if end - start < MIN_COPY_LEN:
+            pos += 1
+            continue
+        if start > literal_start:
+            yield OP_INSERT, start - literal_start, literal_start
+        yield OP_COPY, src, end - start
+        pos = literal_start = end
+
+    if literal_start < len(new):
+        yield OP_INSERT, len(new) - literal_start, literal_start
+
+
+def make_patch(old, new):
+    ops = []
+    copied = 0
+    for op, a, b in diff(old, new):
+        if op == OP_COPY:
+            ops.append(struct.pack(OP_FORMAT, OP_COPY, a, b))
+            copied += b
+        else:
+            ops.append(struct.pack(OP_FORMAT, OP_INSERT, a, 0))
+            ops.append(new[b:b + a])
+    return b"".join(ops), copied
+
+
+def make_delta(old, new, window_bits=DEFAULT_WINDOW_BITS):
+    patch, copied = make_patch(old, new)
+    source = struct.pack(DELTA_HEADER_FORMAT, len(old), hashlib.sha256(old).digest())
+    return pack_header(KIND_DELTA, window_bits, new) + source + deflate(patch, window_bits), copied
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("old")
+    parser.add_argument("new")
+    parser.add_argument("output", nargs="?")
+    parser.add_argument("--window-bits", type=window_bits_arg, default=DEFAULT_WINDOW_BITS)
+    args = parser.parse_args()
+
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+    delta, copied = make_delta(old, new, args.window_bits)
+
+    out_path = args.output or args.new + ".delta.binz"
+    with open(out_path, "wb") as f:
+        f.write(delta)
+    print("delta %s: %d bytes for a %d bytes image (%d%% reused)" %
+          (out_path, len(delta), len(new), 100 * copied // max(len(new), 1)))
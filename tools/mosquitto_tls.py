@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""Set up a local mosquitto broker with TLS to test mqtts:// against.
+
+Creates a throwaway CA, a server certificate for the given host and a
+client certificate, plus a mosquitto.conf that requires the client
+certificate and keeps persistent sessions. The device files are named as
+the firmware expects (see mqtt.h): copy them to the data directory before
+building the filesystem image, or upload them from the web UI.
+
+Then run `mosquitto -c <out>/mosquitto.conf -v` and set the device URI to
+mqtts://<host>:8883. "c0" in the broker's connect log is the persistent
+session, and the device reports connect_ms in mqtt_status.
+
+Usage: mosquitto_tls.py <host> [out_dir] [--port N]
+"""
+
+import argparse
+import ipaddress
+import os
+import subprocess
+
+DEVICE_FILES = ("mqtt_ca.crt", "mqtt_client.crt", "mqtt_client.key")
+DAYS = 825
+
+
+def openssl(*args):
+    subprocess.run(("openssl",) + args, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def subject_alt_name(host):
+    try:
+        ipaddress.ip_address(host)
+        return "subjectAltName=IP:" + host
+    except ValueError:
+        return "subjectAltName=DNS:" + host
+
+
+def make_cert(out, name, common_name, extension=None):
+    key = os.path.join(out, name + ".key")
+    csr = os.path.join(out, name + ".csr")
+    # EC keys keep the handshake short on the ESP32
+    openssl("ecparam", "-name", "prime256v1", "-genkey", "-noout", "-out", key)
+    openssl("req", "-new", "-key", key, "-subj", "/CN=" + common_name, "-out", csr)
+    args = ["x509", "-req", "-in", csr, "-CA", os.path.join(out, "mqtt_ca.crt"),
+            "-CAkey", os.path.join(out, "ca.key"), "-CAcreateserial", "-days", str(DAYS),
+            "-out", os.path.join(out, name + ".crt")]
+    if extension:
+        ext_path = os.path.join(out, name + ".ext")
+        with open(ext_path, "w") as f:
+            f.write(extension + "\n")
+        args += ["-extfile", ext_path]
+    openssl(*args)
+    os.remove(csr)
+
+
+def setup(host, out, port):
+    os.makedirs(out, exist_ok=True)
+    openssl("ecparam", "-name", "prime256v1", "-genkey", "-noout", "-out", os.path.join(out, "ca.key"))
+    openssl("req", "-new", "-x509", "-key", os.path.join(out, "ca.key"), "-subj", "/CN=PowerBentley test CA",
+            "-days", str(DAYS), "-out", os.path.join(out, "mqtt_ca.crt"))
+    make_cert(out, "server", host, subject_alt_name(host))
+    make_cert(out, "mqtt_client", "powerbentley")
+
+    with open(os.path.join(out, "mosquitto.conf"), "w") as f:
+        f.write("persistence true\n")
+        f.write("persistence_location %s/\n" % os.path.abspath(out))
+        f.write("listener %d\n" % port)
+        f.write("cafile %s\n" % os.path.abspath(os.path.join(out, "mqtt_ca.crt")))
+        f.write("certfile %s\n" % os.path.abspath(os.path.join(out, "server.crt")))
+        f.write("keyfile %s\n" % os.path.abspath(os.path.join(out, "server.key")))
+        f.write("require_certificate true\n")
+        f.write("allow_anonymous true\n")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("host")
+    parser.add_argument("out_dir", nargs="?", default="mosquitto_tls")
+    parser.add_argument("--port", type=int, default=8883)
+    args = parser.parse_args()
+
+    setup(args.host, args.out_dir, args.port)
+    print("broker: mosquitto -c %s -v" % os.path.join(args.out_dir, "mosquitto.conf"))
+    print("device: %s, URI mqtts://%s:%d" % (", ".join(DEVICE_FILES), args.host, args.port))
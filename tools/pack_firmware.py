@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+"""Pack a firmware image for faster uploads through /upload/<name>.binz.
+
+Filesystem images are packed the same way and uploaded as /upload/<name>.img.
+
+The output is a 48 bytes header followed by the image as a raw deflate
+stream. The window is kept small so the device can inflate it with a few KB
+of RAM while writing to the OTA partition, then check the embedded length
+and SHA-256 before switching the boot partition (see src/ota.c).
+
+Usage: pack_firmware.py <firmware.bin> [output.binz] [--window-bits N]
+"""
+
+import argparse
+import hashlib
+import struct
+import zlib
+
+MAGIC = b"PBZ1"
+KIND_FULL = 0
+# magic, kind, window bits, reserved, image length, image sha256, reserved
+HEADER_FORMAT = "<4sBBHI32sI"
+
+DEFAULT_WINDOW_BITS = 12
+MIN_WINDOW_BITS = 9
+MAX_WINDOW_BITS = 15
+
+
+def pack_header(kind, window_bits, image):
+    return struct.pack(HEADER_FORMAT, MAGIC, kind, window_bits, 0, len(image), hashlib.sha256(image).digest(), 0)
+
+
+def deflate(data, window_bits):
+    compressor = zlib.compressobj(9, zlib.DEFLATED, -window_bits, 9)
+    return compressor.compress(data) + compressor.flush()
+
+
+def pack(image, window_bits=DEFAULT_WINDOW_BITS):
+    return pack_header(KIND_FULL, window_bits, image) + deflate(image, window_bits)
+
+
+def pack_file(in_path, out_path=None, window_bits=DEFAULT_WINDOW_BITS):
+    if out_path is None:
+        out_path = in_path + "z"
+    with open(in_path, "rb") as f:
+        image = f.read()
+
+    packed = pack(image, window_bits)
+    with open(out_path, "wb") as f:
+        f.write(packed)
+    print("pack %s: %d -> %d bytes (%d%%)" % (out_path, len(image), len(packed), 100 * len(packed) // max(len(image), 1)))
+    return out_path
+
+
+def window_bits_arg(value):
+    bits = int(value)
+    if not MIN_WINDOW_BITS <= bits <= MAX_WINDOW_BITS:
+        raise argparse.ArgumentTypeError("window bits must be %d to %d" % (MIN_WINDOW_BITS, MAX_WINDOW_BITS))
+    return bits
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("image")
+    parser.add_argument("output", nargs="?")
+    parser.add_argument("--window-bits", type=window_bits_arg, default=DEFAULT_WINDOW_BITS,
+                        help="deflate window, the device needs 2^N bytes to inflate (default %d)" % DEFAULT_WINDOW_BITS)
+    args = parser.parse_args()
+    pack_file(args.image, args.output, args.window_bits)
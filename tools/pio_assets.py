@@ -0,0 +1,28 @@
+# PlatformIO extra script: prepare the web assets before the filesystem
+# image is built ("Build Filesystem Image" / "Upload Filesystem Image"), then
+# pack the image as storage.img for an update through /upload/storage.img.
+Import("env")
+
+import os
+import sys
+
+sys.path.insert(0, os.path.join(env.subst("$PROJECT_DIR"), "tools"))
+
+from gzip_assets import gzip_dir
+from pack_firmware import pack_file
+
+
+def before_buildfs(source, target, env):
+    gzip_dir(env.subst("$PROJECT_DATA_DIR"))
+
+
+def after_buildfs(source, target, env):
+    pack_file(str(target[0]), env.subst("$BUILD_DIR/storage.img"))
+
+
+# spiffs.bin or littlefs.bin, following board_build.filesystem. Read from
+# the project options: ESP32_FS_IMAGE_NAME is only set by the platform
+# builder, after this pre: script has run.
+fs_image = "$BUILD_DIR/%s.bin" % env.GetProjectOption("board_build.filesystem", "spiffs")
+env.AddPreAction(fs_image, before_buildfs)
+env.AddPostAction(fs_image, after_buildfs)
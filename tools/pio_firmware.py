@@ -0,0 +1,17 @@
+# PlatformIO extra script: write a packed firmware.binz next to firmware.bin
+# after every build, upload it through /upload/firmware.binz.
+Import("env")
+
+import os
+import sys
+
+sys.path.insert(0, os.path.join(env.subst("$PROJECT_DIR"), "tools"))
+
+from pack_firmware import pack_file
+
+
+def after_build(source, target, env):
+    pack_file(str(target[0]))
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.bin", after_build)